@@ -186,13 +186,14 @@ void pci_platform_init_bar(pci_dev dev, int bar)
     }
 }
 
-u64 pci_platform_allocate_msi(pci_dev dev, thunk h, const char *name, u32 *address, u32 *data)
+u64 pci_platform_allocate_msi(pci_dev dev, thunk h, const char *name, u32 target_cpu,
+                              u32 *address, u32 *data)
 {
     u64 v = allocate_interrupt();
     if (v == INVALID_PHYSICAL)
         return v;
     register_interrupt(v, h, name);
-    msi_format(address, data, v);
+    msi_format(address, data, v, target_cpu);
     return v;
 }
 
@@ -322,7 +322,9 @@ void dev_irq_disable(u32 dev_id, int vector)
     }
 }
 
-void msi_format(u32 *address, u32 *data, int vector)
+/* All MSIs are mapped to the collection of the boot CPU, so target_cpu is not
+   used. */
+void msi_format(u32 *address, u32 *data, int vector, u32 target_cpu)
 {
     if (gic.its_base) {
         *address = gic.its_base + GITS_TRANSLATER - DEVICE_BASE;
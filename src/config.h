@@ -24,6 +24,12 @@
 #define RUNLOOP_TIMER_MAX_PERIOD_US     100000
 #define RUNLOOP_TIMER_MIN_PERIOD_US     1000
 
+/* adaptive halt polling on idle CPUs (enabled with the halt_poll_ns manifest
+   option, which sets the maximum polling interval) */
+#define HALTPOLL_GROW_START_NS  50000
+#define HALTPOLL_GROW_FACTOR    2
+#define HALTPOLL_SHRINK_FACTOR  2
+
 /* length of thread scheduling queue */
 #define MAX_THREADS 8192
 
@@ -35,10 +41,11 @@
 /* per-cpu queue */
 #define CPU_QUEUE_SIZE 512
 
-/* general scheduling queues */
+/* per-cpu deferred work queues */
 #define BHQUEUE_SIZE       8192
 #define RUNQUEUE_SIZE      8192
 #define ASYNC_QUEUE_1_SIZE 65536
+#define POLLQUEUE_SIZE     512
 
 /* locking */
 #define MUTEX_ACQUIRE_SPIN_LIMIT (1ull << 20)
@@ -49,12 +56,20 @@
 /* TFS stuff */
 #define TFS_LOG_INITIAL_SIZE           SECTOR_SIZE
 #define TFS_LOG_DEFAULT_EXTENSION_SIZE (512*KB)
+/* Upper bound for log extensions sized to fit the staged entries (e.g. a log checkpoint). */
+#define TFS_LOG_MAX_EXTENSION_SIZE     (16*MB)
 #define TFS_LOG_FLUSH_DELAY_SECONDS 1
 /* Minimum number of obsolete log entries needed to trigger a log compaction. */
 #define TFS_LOG_COMPACT_OBSOLETE   8192
 /* Log compaction is not triggered if the ratio between total entries and
  * obsolete entries is above the constant below. */
 #define TFS_LOG_COMPACT_RATIO   2
+/* Maximum number of (parent, name) entries in a filesystem path lookup cache; the cache is
+ * flushed when full. */
+#define FS_LOOKUP_CACHE_MAX_ENTRIES 8192
+
+/* maximum number of packets processed in one poll of a virtio-net rx queue */
+#define VIRTIO_NET_RX_POLL_BUDGET   64
 
 /* Xen stuff */
 #define XENNET_INIT_RX_BUFFERS_FACTOR 4
@@ -71,6 +86,27 @@
 #define SG_FRAG_BYTE_THRESHOLD (128*KB)
 #define PAGECACHE_LOWMEM_CONTIGUOUS_PAGESIZE (128*KB)
 
+/* share (in percent) of resident pagecache pages kept on the active list; the target adapts
+   to refaults between the minimum and maximum */
+#define PAGECACHE_ACTIVE_TARGET_DEFAULT 50
+#define PAGECACHE_ACTIVE_MIN_DEFAULT    10
+#define PAGECACHE_ACTIVE_MAX            90
+
+/* nodes at least this long have their pages allocated from large folios, which file mappings
+   can map with a single large page entry */
+#define PAGECACHE_FOLIO_MIN_LENGTH  (8 * MB)
+
+/* dirty page limits (in percent of physical memory): background writeback starts above the
+   background ratio, writers are throttled above the dirty ratio */
+#define PAGECACHE_DIRTY_BACKGROUND_RATIO_DEFAULT    10
+#define PAGECACHE_DIRTY_RATIO_DEFAULT               20
+
+/* writeback is issued in chunks sized to complete in about this time at the measured device
+   bandwidth, within the minimum and maximum chunk size */
+#define PAGECACHE_WRITEBACK_CHUNK_MS    250
+#define PAGECACHE_WRITEBACK_CHUNK_MIN   (1 * MB)
+#define PAGECACHE_WRITEBACK_CHUNK_MAX   (64 * MB)
+
 /* don't go below this minimum amount of physical memory when inflating balloon */
 #define BALLOON_MEMORY_MINIMUM (16 * MB)
 
@@ -34,8 +34,9 @@
 #define NVME_AQ_IDX     0   /* admin queue index */
 #define NVME_AQ_MSIX    0   /* admin queue MSI-X slot */
 
-#define NVME_IOQ_IDX    1   /* I/O queue index and identifier */
-#define NVME_IOQ_MSIX   1   /* I/O queue MSI-X slot */
+/* I/O queue pair N (starting from 0) has queue identifier and MSI-X slot N + 1 */
+#define NVME_IOQ_IDX(n)     ((n) + 1)
+#define NVME_IOQ_MSIX(n)    ((n) + 1)
 
 /* command Dword 0 */
 #define NVME_CID(id)    ((id) << 16)
@@ -77,6 +78,9 @@
 #define NVME_OPC_MI_RECV    0x1E
 #define NVME_OPC_DBL_CFG    0x7C
 
+/* Feature identifiers */
+#define NVME_FEAT_NUM_QUEUES    0x07
+
 /* Identify command */
 #define CNS_IDENTIFY_NAMESPACE  0
 #define CNS_IDENTIFY_CONTROLLER 1
@@ -99,6 +103,12 @@
 #define NVME_OPC_RSV_ACQ    0x11
 #define NVME_OPC_RSV_REL    0x15
 
+/* Optional NVM Command Support (identify controller) */
+#define NVME_ONCS_DSM       (1 << 2)
+
+/* Dataset Management command */
+#define NVME_DSM_AD         (1 << 2)    /* attribute: deallocate */
+
 #define NVME_ASQ_ORDER  1
 #define NVME_ACQ_ORDER  1
 
@@ -124,6 +134,12 @@ struct nvme_sgl {
     u8 id;
 } __attribute__((packed));
 
+struct nvme_dsm_range {
+    u32 cattr;  /* context attributes */
+    u32 nlb;    /* length in logical blocks */
+    u64 slba;   /* starting LBA */
+} __attribute__((packed));
+
 struct nvme_sqe {   /* submission queue entry */
     u32 cdw0;
     u32 nsid;
@@ -167,12 +183,37 @@ typedef struct nvme_cq {
 declare_closure_struct(1, 0, void, nvme_admin_irq,
                        struct nvme *, n);
 declare_closure_struct(1, 0, void, nvme_io_irq,
-                       struct nvme *, n);
+                       struct nvme_ioq *, q);
 declare_closure_struct(1, 0, void, nvme_bh_service,
-                       struct nvme *, n);
+                       struct nvme_ioq *, q);
+declare_closure_struct(1, 0, void, nvme_poll,
+                       struct nvme_ioq *, q);
 declare_closure_struct(3, 3, void, nvme_io,
                        struct nvme *, n, u32, namespace, boolean, write,
                        void *, buf, range, blocks, status_handler, sh);
+declare_closure_struct(0, 1, void, nvme_req_handler,
+                       storage_req, req);
+
+/* I/O submission/completion queue pair; requests are submitted to the queue pair of the current
+ * CPU, and completion interrupts are routed to that CPU. */
+typedef struct nvme_ioq {
+    struct nvme *n;
+    int idx;    /* starting from 0 */
+    struct nvme_sq sq;
+    struct nvme_cq cq;
+    closure_struct(nvme_io_irq, irq);
+    struct list pending_reqs, free_reqs, done_reqs;
+    vector cmds;
+    struct list free_cmds;
+    closure_struct(nvme_bh_service, bh_service);
+    closure_struct(nvme_poll, poll);
+    boolean poll_scheduled;
+    u64 inflight;       /* number of submitted commands */
+    int plugged;        /* the doorbell is deferred until unplugged */
+    boolean doorbell_pending;
+    struct storage_stats stats;
+    struct spinlock lock;
+} *nvme_ioq;
 
 typedef struct nvme {
     heap general, contiguous;
@@ -185,35 +226,38 @@ typedef struct nvme {
     closure_struct(nvme_admin_irq, admin_irq);
     thunk ac_handler;   /* admin completion handler */
     int ioq_order;     /* I/O queue size */
-    struct nvme_sq iosq;    /* I/O submission queue */
-    struct nvme_cq iocq;    /* I/O completion queue */
+    nvme_ioq ioqs;
+    int ioqs_alloc;     /* length of the ioqs array */
+    int max_ioqs;       /* number of I/O queue pairs to be created */
+    int nioqs;          /* number of available I/O queue pairs */
+    boolean polling;    /* I/O completions are polled instead of being interrupt-driven */
+    boolean dsm;        /* Dataset Management (deallocate) is supported */
+    u32 ns_id;
     int attach_id;
-    closure_struct(nvme_io_irq, io_irq);
-    struct list pending_reqs, free_reqs, done_reqs;
-    vector cmds;
-    struct list free_cmds;
-    closure_struct(nvme_bh_service, bh_service);
     closure_struct(nvme_io, r);
     closure_struct(nvme_io, w);
-    closure_struct(storage_simple_req_handler, req_handler);
-    struct spinlock lock;
+    closure_struct(storage_simple_req_handler, simple_req_handler);
+    storage_req_handler io_handler;
+    closure_struct(nvme_req_handler, req_handler);
 } *nvme;
 
 typedef struct nvme_ioreq {
     struct list l;
     u32 namespace;
-    boolean write;
+    u8 opc;
     void *buf;
     range blocks;
     u64 pending_cmds;
     status_handler sh;
     int sc;
+    timestamp start;
 } *nvme_ioreq;
 
 typedef struct nvme_iocmd {
     struct list l;
     u16 id;
     nvme_ioreq req;
+    struct nvme_dsm_range dsm __attribute__((aligned(16))); /* does not cross a page boundary */
 } *nvme_iocmd;
 
 static boolean nvme_init_sq(nvme n, nvme_sq sq, int order)
@@ -294,38 +338,38 @@ static inline void nvme_cq_doorbell(nvme n, int q_idx, nvme_cq q)
     pci_bar_write_4(&n->bar, cqhdbl, q->head);
 }
 
-static nvme_ioreq nvme_get_ioreq(nvme n)
+static nvme_ioreq nvme_get_ioreq(nvme_ioq q)
 {
     nvme_ioreq req;
-    spin_lock(&n->lock);
-    list l = list_get_next(&n->free_reqs);
+    u64 irqflags = spin_lock_irq(&q->lock);
+    list l = list_get_next(&q->free_reqs);
     if (l) {
         list_delete(l);
         req = struct_from_list(l, nvme_ioreq, l);
     } else {
         nvme_debug("new request allocation");
-        req = allocate(n->general, sizeof(*req));
+        req = allocate(q->n->general, sizeof(*req));
     }
-    spin_unlock(&n->lock);
+    spin_unlock_irq(&q->lock, irqflags);
     return req;
 }
 
 /* Called with the lock held. */
-static nvme_iocmd nvme_get_iocmd(nvme n, boolean allocate)
+static nvme_iocmd nvme_get_iocmd(nvme_ioq q, boolean allocate)
 {
-    list l = list_get_next(&n->free_cmds);
+    list l = list_get_next(&q->free_cmds);
     if (l) {
         list_delete(l);
         return struct_from_list(l, nvme_iocmd, l);
-    } else if (allocate && (vector_length(n->cmds) <= NVME_CID_MAX)) {
+    } else if (allocate && (vector_length(q->cmds) <= NVME_CID_MAX)) {
         nvme_debug("new command allocation");
-        nvme_iocmd cmd = allocate(n->general, sizeof(*cmd));
+        nvme_iocmd cmd = allocate(q->n->general, sizeof(*cmd));
         if (cmd == INVALID_ADDRESS) {
             nvme_debug("command allocation failed");
             return cmd;
         }
-        cmd->id = vector_length(n->cmds);
-        vector_push(n->cmds, cmd);
+        cmd->id = vector_length(q->cmds);
+        vector_push(q->cmds, cmd);
         return cmd;
     } else {
         nvme_debug("no available commands");
@@ -334,90 +378,143 @@ static nvme_iocmd nvme_get_iocmd(nvme n, boolean allocate)
 }
 
 /* Called with the lock held. */
-static void nvme_service_pending(nvme n, boolean allocate)
+static void nvme_service_pending(nvme_ioq q, boolean allocate)
 {
     boolean new_reqs = false;
     list l;
-    while ((l = list_get_next(&n->pending_reqs))) {
-        nvme_iocmd cmd = nvme_get_iocmd(n, allocate);
+    while ((l = list_get_next(&q->pending_reqs))) {
+        nvme_iocmd cmd = nvme_get_iocmd(q, allocate);
         if (cmd == INVALID_ADDRESS)
             break;
-        struct nvme_sqe *sqe = nvme_get_sqe(&n->iosq);
+        struct nvme_sqe *sqe = nvme_get_sqe(&q->sq);
         if (!sqe) {
-            list_insert_before(list_begin(&n->free_cmds), &cmd->l);
+            list_insert_before(list_begin(&q->free_cmds), &cmd->l);
             break;
         }
         new_reqs = true;
         nvme_ioreq req = struct_from_list(l, nvme_ioreq, l);
-        sqe->cdw0 = NVME_CID(cmd->id) | NVME_CMD_PRP |
-                (req->write ? NVME_OPC_WRITE : NVME_OPC_READ);
+        sqe->cdw0 = NVME_CID(cmd->id) | NVME_CMD_PRP | req->opc;
         sqe->nsid = req->namespace;
-        u64 buf_start = physical_from_virtual(req->buf);
         u64 nlb = range_span(req->blocks);
-        u64 buf_end = buf_start + nlb * SECTOR_SIZE;
-        sqe->dptr.prp1 = buf_start;
-        if (buf_end > (buf_start & ~PAGEMASK) + PAGESIZE) {
-            sqe->dptr.prp2 = (buf_start & ~PAGEMASK) + PAGESIZE;
-            if (buf_end > sqe->dptr.prp2 + PAGESIZE) {
-                nlb = (sqe->dptr.prp2 + PAGESIZE - buf_start) / SECTOR_SIZE;
-                req->buf += nlb * SECTOR_SIZE;
+        if (req->opc == NVME_OPC_DS_MGMT) {
+            /* one range per command */
+            nlb = MIN(nlb, U32_MAX);
+            cmd->dsm.cattr = 0;
+            cmd->dsm.nlb = nlb;
+            cmd->dsm.slba = req->blocks.start;
+            sqe->dptr.prp1 = physical_from_virtual(&cmd->dsm);
+            sqe->dptr.prp2 = 0;
+            sqe->cdw10 = 0; /* number of ranges, 0's based */
+            sqe->cdw11 = NVME_DSM_AD;
+            /* reserved for this command, but left over from previous commands in this entry */
+            sqe->cdw12 = sqe->cdw13 = sqe->cdw14 = sqe->cdw15 = 0;
+        } else {
+            u64 buf_start = physical_from_virtual(req->buf);
+            u64 buf_end = buf_start + nlb * SECTOR_SIZE;
+            sqe->dptr.prp1 = buf_start;
+            if (buf_end > (buf_start & ~PAGEMASK) + PAGESIZE) {
+                sqe->dptr.prp2 = (buf_start & ~PAGEMASK) + PAGESIZE;
+                if (buf_end > sqe->dptr.prp2 + PAGESIZE) {
+                    nlb = (sqe->dptr.prp2 + PAGESIZE - buf_start) / SECTOR_SIZE;
+                    req->buf += nlb * SECTOR_SIZE;
+                }
             }
+            sqe->cdw10 = req->blocks.start;
+            sqe->cdw11 = req->blocks.start >> 32;
+            sqe->cdw12 = nlb - 1;
         }
         if (nlb == range_span(req->blocks))
             list_delete(l);
         nvme_debug("request sectors [0x%x, 0x%x), cmd ID 0x%0x",
                    req->blocks.start, req->blocks.start + nlb, cmd->id);
-        sqe->cdw10 = req->blocks.start;
-        sqe->cdw12 = nlb - 1;
         cmd->req = req;
         req->pending_cmds++;
+        q->inflight++;
         req->blocks.start += nlb;
         new_reqs = true;
     }
-    if (new_reqs)
-        nvme_sq_doorbell(n, NVME_IOQ_IDX, &n->iosq);
+    if (new_reqs) {
+        if (q->plugged)
+            q->doorbell_pending = true;
+        else
+            nvme_sq_doorbell(q->n, NVME_IOQ_IDX(q->idx), &q->sq);
+    }
 }
 
-define_closure_function(3, 3, void, nvme_io,
-                        nvme, n, u32, namespace, boolean, write,
-                        void *, buf, range, blocks, status_handler, sh)
+static void nvme_plug(nvme n, boolean plug)
 {
-    nvme n = bound(n);
-    u32 namespace = bound(namespace);
-    boolean write = bound(write);
-    nvme_debug("[%d] %s %R", namespace, write ? "write" : "read", blocks);
-    nvme_ioreq req = nvme_get_ioreq(n);
+    nvme_ioq q = &n->ioqs[current_cpu()->id % n->nioqs];
+    u64 irqflags = spin_lock_irq(&q->lock);
+    if (plug) {
+        q->plugged++;
+    } else {
+        assert(q->plugged > 0);
+        if ((--q->plugged == 0) && q->doorbell_pending) {
+            q->doorbell_pending = false;
+            nvme_sq_doorbell(n, NVME_IOQ_IDX(q->idx), &q->sq);
+        }
+    }
+    spin_unlock_irq(&q->lock, irqflags);
+}
+
+/* Called with the lock held. */
+static void nvme_poll_kick(nvme_ioq q)
+{
+    if (!q->poll_scheduled) {
+        q->poll_scheduled = true;
+        async_apply_poll((thunk)&q->poll);
+    }
+}
+
+static void nvme_submit(nvme n, u32 namespace, u8 opc, void *buf, range blocks,
+                        status_handler sh)
+{
+    nvme_ioq q = &n->ioqs[current_cpu()->id % n->nioqs];
+    nvme_debug("[%d] opcode 0x%x %R, queue %d", namespace, opc, blocks, q->idx);
+    nvme_ioreq req = nvme_get_ioreq(q);
     if (req == INVALID_ADDRESS) {
         apply(sh, timm("result", "request allocation failed"));
         return;
     }
     req->namespace = namespace;
-    req->write = write;
+    req->opc = opc;
     req->buf = buf;
     req->blocks = blocks;
     req->pending_cmds = 0;
     req->sh = sh;
     req->sc = NVME_SC_OK;
-    u64 irqflags = spin_lock_irq(&n->lock);
-    list_push_back(&n->pending_reqs, &req->l);
-    nvme_service_pending(n, true);
-    spin_unlock_irq(&n->lock, irqflags);
+    req->start = now(CLOCK_ID_MONOTONIC_RAW);
+    u64 irqflags = spin_lock_irq(&q->lock);
+    list_push_back(&q->pending_reqs, &req->l);
+    nvme_service_pending(q, true);
+
+    /* In polling mode, completions are reaped from the CPU that submitted the request. */
+    if (n->polling)
+        nvme_poll_kick(q);
+    spin_unlock_irq(&q->lock, irqflags);
 }
 
-define_closure_function(1, 0, void, nvme_io_irq,
-                        nvme, n)
+define_closure_function(3, 3, void, nvme_io,
+                        nvme, n, u32, namespace, boolean, write,
+                        void *, buf, range, blocks, status_handler, sh)
+{
+    nvme_submit(bound(n), bound(namespace), bound(write) ? NVME_OPC_WRITE : NVME_OPC_READ,
+                buf, blocks, sh);
+}
+
+/* Called with the lock held. */
+static void nvme_reap_completions(nvme_ioq q)
 {
-    nvme_debug("%s", __func__);
-    nvme n = bound(n);
-    spin_lock(&n->lock);
-    boolean done_empty = list_empty(&n->done_reqs);
     struct nvme_cqe *cqe;
-    while ((cqe = nvme_get_cqe(&n->iocq))) {
-        n->iosq.head = NVME_SQ_HEAD(cqe->dw2);
-        nvme_iocmd cmd = vector_get(n->cmds, NVME_CMD_ID(cqe->dw3));
+    boolean reaped = false;
+    while ((cqe = nvme_get_cqe(&q->cq))) {
+        reaped = true;
+        q->inflight--;
+        q->sq.head = NVME_SQ_HEAD(cqe->dw2);
+        nvme_iocmd cmd = vector_get(q->cmds, NVME_CMD_ID(cqe->dw3));
         nvme_debug("  cmd ID 0x%0x complete", cmd->id);
         nvme_ioreq req = cmd->req;
-        list_insert_before(list_begin(&n->free_cmds), &cmd->l);
+        list_insert_before(list_begin(&q->free_cmds), &cmd->l);
         int sc = NVME_STATUS_CODE(cqe->dw3);
         u64 remaining = range_span(req->blocks);
         if ((sc != NVME_SC_OK) && (remaining != 0))
@@ -426,33 +523,121 @@ define_closure_function(1, 0, void, nvme_io_irq,
             req->sc = sc;
         boolean req_complete = !(--req->pending_cmds) && (!remaining || (sc != NVME_SC_OK));
         if (req_complete)
-            list_push_back(&n->done_reqs, &req->l);
+            list_push_back(&q->done_reqs, &req->l);
+    }
+    if (reaped) {
+        nvme_cq_doorbell(q->n, NVME_IOQ_IDX(q->idx), &q->cq);
+        nvme_service_pending(q, false);
     }
-    nvme_cq_doorbell(n, NVME_IOQ_IDX, &n->iocq);
-    nvme_service_pending(n, false);
-    if (done_empty && !list_empty(&n->done_reqs))
-        async_apply_bh((thunk)&n->bh_service);
-    spin_unlock(&n->lock);
+}
+
+define_closure_function(1, 0, void, nvme_io_irq,
+                        nvme_ioq, q)
+{
+    nvme_debug("%s", __func__);
+    nvme_ioq q = bound(q);
+    spin_lock(&q->lock);
+    boolean done_empty = list_empty(&q->done_reqs);
+    nvme_reap_completions(q);
+    if (done_empty && !list_empty(&q->done_reqs))
+        async_apply_bh((thunk)&q->bh_service);
+    spin_unlock(&q->lock);
 }
 
 define_closure_function(1, 0, void, nvme_bh_service,
-                        nvme, n)
+                        nvme_ioq, q)
 {
     nvme_debug("%s", __func__);
-    nvme n = bound(n);
+    nvme_ioq q = bound(q);
     list l;
-    u64 irqflags = spin_lock_irq(&n->lock);
-    while ((l = list_get_next(&n->done_reqs))) {
+    u64 irqflags = spin_lock_irq(&q->lock);
+    while ((l = list_get_next(&q->done_reqs))) {
         list_delete(l);
-        spin_unlock_irq(&n->lock, irqflags);
+        spin_unlock_irq(&q->lock, irqflags);
         nvme_ioreq req = struct_from_list(l, nvme_ioreq, l);
+        timestamp latency = now(CLOCK_ID_MONOTONIC_RAW) - req->start;
         apply(req->sh, (req->sc == NVME_SC_OK) ? STATUS_OK :
                 timm("result", "NVMe status code 0x%x", req->sc));
-        irqflags = spin_lock_irq(&n->lock);
-        list_insert_before(list_begin(&n->free_reqs), l);
+        irqflags = spin_lock_irq(&q->lock);
+        if (req->opc != NVME_OPC_DS_MGMT)
+            storage_stats_account(&q->stats, req->opc == NVME_OPC_WRITE, latency);
+        list_insert_before(list_begin(&q->free_reqs), l);
+    }
+    nvme_service_pending(q, true);
+    spin_unlock_irq(&q->lock, irqflags);
+}
+
+/* Runs from the poll queue of the submitting CPU, and reschedules itself as long as there are
+ * commands in flight. */
+define_closure_function(1, 0, void, nvme_poll,
+                        nvme_ioq, q)
+{
+    nvme_ioq q = bound(q);
+    u64 irqflags = spin_lock_irq(&q->lock);
+    nvme_reap_completions(q);
+    boolean done = !list_empty(&q->done_reqs);
+    spin_unlock_irq(&q->lock, irqflags);
+    if (done) {
+        thunk t = (thunk)&q->bh_service;
+        apply(t);
+    }
+    irqflags = spin_lock_irq(&q->lock);
+    if (q->inflight)
+        async_apply_poll((thunk)&q->poll);
+    else
+        q->poll_scheduled = false;
+    spin_unlock_irq(&q->lock, irqflags);
+}
+
+static void nvme_set_polling(nvme n, boolean enable)
+{
+    nvme_debug("%s polling", enable ? "enabling" : "disabling");
+    n->polling = enable;
+    for (int i = 0; i < n->nioqs; i++) {
+        pci_mask_msix(n->d, NVME_IOQ_MSIX(i), enable);
+        if (enable) {
+            /* commands in flight no longer raise interrupts */
+            nvme_ioq q = &n->ioqs[i];
+            u64 irqflags = spin_lock_irq(&q->lock);
+            if (q->inflight)
+                nvme_poll_kick(q);
+            spin_unlock_irq(&q->lock, irqflags);
+        }
+    }
+}
+
+define_closure_function(0, 1, void, nvme_req_handler,
+                        storage_req, req)
+{
+    nvme n = struct_from_field(closure_self(), nvme, req_handler);
+    switch (req->op) {
+    case STORAGE_OP_SETPOLL:
+        nvme_set_polling(n, req->data != 0);
+        apply(req->completion, STATUS_OK);
+        break;
+    case STORAGE_OP_DISCARD:
+        if (n->dsm)
+            nvme_submit(n, n->ns_id, NVME_OPC_DS_MGMT, 0, req->blocks, req->completion);
+        else
+            apply(req->completion, timm("result", "discard not supported"));
+        break;
+    case STORAGE_OP_PLUG:
+    case STORAGE_OP_UNPLUG:
+        nvme_plug(n, req->op == STORAGE_OP_PLUG);
+        apply(req->completion, STATUS_OK);
+        break;
+    case STORAGE_OP_GETSTATS:
+        for (int i = 0; i < n->nioqs; i++) {
+            nvme_ioq q = &n->ioqs[i];
+            u64 irqflags = spin_lock_irq(&q->lock);
+            storage_stats_merge(req->data, &q->stats);
+            spin_unlock_irq(&q->lock, irqflags);
+        }
+        apply(req->completion, STATUS_OK);
+        break;
+    default:
+        apply(n->io_handler, req);
     }
-    nvme_service_pending(n, true);
-    spin_unlock_irq(&n->lock, irqflags);
 }
 
 closure_function(4, 0, void, nvme_ns_attach,
@@ -461,10 +646,11 @@ closure_function(4, 0, void, nvme_ns_attach,
     nvme n = bound(n);
     u32 ns_id = bound(ns_id);
     u64 disk_size = bound(disk_size);
-    apply(bound(a),
-          storage_init_req_handler(&n->req_handler, init_closure(&n->r, nvme_io, n, ns_id, false),
-                                   init_closure(&n->w, nvme_io, n, ns_id, true)),
-          disk_size, n->attach_id);
+    n->ns_id = ns_id;
+    n->io_handler = storage_init_req_handler(&n->simple_req_handler,
+                                             init_closure(&n->r, nvme_io, n, ns_id, false),
+                                             init_closure(&n->w, nvme_io, n, ns_id, true));
+    apply(bound(a), init_closure(&n->req_handler, nvme_req_handler), disk_size, n->attach_id);
     closure_finish();
 }
 
@@ -598,6 +784,7 @@ closure_function(3, 0, void, nvme_identify_controller_resp,
         }
         u16 vid = *(u16 *)resp; /* PCI Vendor ID */
         u32 nn = *(u32 *)(resp + 516);  /* number of namespaces */
+        n->dsm = (*(u16 *)(resp + 520) & NVME_ONCS_DSM) != 0;
         nvme_debug("controller (vendor ID 0x%x) reports %d namespace(s)", vid, nn);
         if (vid == AMZN_NVME_VID) {
             /* Retrieve block device name in vendor-specific field.
@@ -713,10 +900,78 @@ static boolean nvme_get_active_namespaces(nvme n, u32 start_id, storage_attach a
     return true;
 }
 
-closure_function(2, 0, void, nvme_create_iosq_resp,
-                 nvme, n, storage_attach, a)
+static boolean nvme_create_iocq(nvme n, int idx, storage_attach a);
+
+/* Called when all I/O queue pairs have been created (or when the creation of a queue pair other
+ * than the first one failed). */
+static void nvme_ioqs_ready(nvme n, int nioqs, storage_attach a)
+{
+    nvme_debug("%d I/O queue pair(s) available", nioqs);
+    n->nioqs = nioqs;
+    if (n->vs >= NVME_VER(1, 1, 0))
+        nvme_get_active_namespaces(n, 0, a);
+    else
+        nvme_identify_controller(n, a);
+}
+
+/* Releases the resources of an I/O queue pair except for its submission queue. */
+static void nvme_ioq_deinit(nvme n, nvme_ioq q)
+{
+    pci_teardown_msix(n->d, NVME_IOQ_MSIX(q->idx));
+    nvme_deinit_cq(n, &q->cq);
+    nvme_iocmd cmd;
+    vector_foreach(q->cmds, cmd)
+        deallocate(n->general, cmd, sizeof(*cmd));
+    deallocate_vector(q->cmds);
+}
+
+closure_function(3, 0, void, nvme_delete_iocq_resp,
+                 nvme, n, int, idx, storage_attach, a)
+{
+    nvme n = bound(n);
+    int idx = bound(idx);
+    storage_attach a = bound(a);
+    struct nvme_cqe *cqe = nvme_get_cqe(&n->acq);
+    if (cqe) {
+        n->asq.head = NVME_SQ_HEAD(cqe->dw2);
+        int sc = NVME_STATUS_CODE(cqe->dw3);
+        nvme_cq_doorbell(n, NVME_AQ_IDX, &n->acq);
+        if (sc == NVME_SC_OK) {
+            nvme_debug("I/O CQ %d deleted", idx);
+            nvme_ioq_deinit(n, &n->ioqs[idx]);
+        } else {
+            /* the queue memory may still be in use by the controller: leave it allocated */
+            msg_err("failed to delete I/O CQ %d: status code 0x%x\n", idx, sc);
+        }
+        if (idx > 0)
+            nvme_ioqs_ready(n, idx, a);
+    }
+    closure_finish();
+}
+
+/* Deletes a completion queue whose submission queue could not be created, before releasing its
+ * resources. */
+static boolean nvme_delete_iocq(nvme n, int idx, storage_attach a)
+{
+    n->ac_handler = closure(n->general, nvme_delete_iocq_resp, n, idx, a);
+    if (n->ac_handler == INVALID_ADDRESS) {
+        msg_err("failed to allocate completion handler\n");
+        return false;
+    }
+    struct nvme_sqe *cmd = nvme_get_sqe(&n->asq);
+    assert(cmd);
+    zero(cmd, sizeof(*cmd));
+    cmd->cdw0 = NVME_CID(n->asq.tail) | NVME_CMD_PRP | NVME_OPC_DEL_IOCQ;
+    cmd->cdw10 = NVME_IOQ_IDX(idx);    /* queue ID */
+    nvme_sq_doorbell(n, NVME_AQ_IDX, &n->asq);
+    return true;
+}
+
+closure_function(3, 0, void, nvme_create_iosq_resp,
+                 nvme, n, int, idx, storage_attach, a)
 {
     nvme n = bound(n);
+    int idx = bound(idx);
     storage_attach a = bound(a);
     struct nvme_cqe *cqe = nvme_get_cqe(&n->acq);
     if (cqe) {
@@ -724,90 +979,173 @@ closure_function(2, 0, void, nvme_create_iosq_resp,
         int sc = NVME_STATUS_CODE(cqe->dw3);
         nvme_cq_doorbell(n, NVME_AQ_IDX, &n->acq);
         if (sc == NVME_SC_OK) {
-            nvme_debug("I/O SQ created");
-            if (n->vs >= NVME_VER(1, 1, 0))
-                nvme_get_active_namespaces(n, 0, a);
-            else
-                nvme_identify_controller(n, a);
+            nvme_debug("I/O SQ %d created", idx);
+            if ((++idx == n->max_ioqs) || !nvme_create_iocq(n, idx, a))
+                nvme_ioqs_ready(n, idx, a);
         } else {
-            msg_err("failed to create I/O SQ: status code 0x%x\n", sc);
+            msg_err("failed to create I/O SQ %d: status code 0x%x\n", idx, sc);
+            nvme_deinit_sq(n, &n->ioqs[idx].sq);
+            if (!nvme_delete_iocq(n, idx, a) && (idx > 0))
+                nvme_ioqs_ready(n, idx, a);
         }
     }
     closure_finish();
 }
 
-static boolean nvme_create_iosq(nvme n, storage_attach a)
+static boolean nvme_create_iosq(nvme n, int idx, storage_attach a)
 {
-    if (!nvme_init_sq(n, &n->iosq, n->ioq_order)) {
+    nvme_ioq q = &n->ioqs[idx];
+    if (!nvme_init_sq(n, &q->sq, n->ioq_order)) {
         msg_err("failed to initialize queue\n");
         return false;
     }
-    n->ac_handler = closure(n->general, nvme_create_iosq_resp, n, a);
+    n->ac_handler = closure(n->general, nvme_create_iosq_resp, n, idx, a);
     if (n->ac_handler == INVALID_ADDRESS) {
         msg_err("failed to allocate completion handler\n");
-        nvme_deinit_sq(n, &n->iosq);
+        nvme_deinit_sq(n, &q->sq);
         return false;
     }
 
     /* Zero out all submission queue entries, so that when submitting an entry
      * only used fields need to be set. This relies on the fact that all I/O
      * commands use the same set of fields. */
-    zero(n->iosq.ring, U64_FROM_BIT(n->iosq.order) * sizeof(struct nvme_sqe));
+    zero(q->sq.ring, U64_FROM_BIT(q->sq.order) * sizeof(struct nvme_sqe));
 
     struct nvme_sqe *cmd = nvme_get_sqe(&n->asq);
     assert(cmd);
     zero(cmd, sizeof(*cmd));
     cmd->cdw0 = NVME_CID(n->asq.tail) | NVME_CMD_PRP | NVME_OPC_CRE_IOSQ;
-    cmd->dptr.prp1 = physical_from_virtual(n->iosq.ring);
-    cmd->cdw10 = (MASK(n->ioq_order) << 16) | NVME_IOQ_IDX; /* queue size and queue ID */
-    cmd->cdw11 = (NVME_IOQ_IDX << 16) | 0x01;  /* completion queue ID, physically contiguous */
+    cmd->dptr.prp1 = physical_from_virtual(q->sq.ring);
+    cmd->cdw10 = (MASK(n->ioq_order) << 16) | NVME_IOQ_IDX(idx); /* queue size and queue ID */
+    cmd->cdw11 = (NVME_IOQ_IDX(idx) << 16) | 0x01;  /* completion queue ID, physically contiguous */
     nvme_sq_doorbell(n, NVME_AQ_IDX, &n->asq);
     return true;
 }
 
-closure_function(2, 0, void, nvme_create_iocq_resp,
-                 nvme, n, storage_attach, a)
+closure_function(3, 0, void, nvme_create_iocq_resp,
+                 nvme, n, int, idx, storage_attach, a)
 {
     nvme n = bound(n);
+    int idx = bound(idx);
+    storage_attach a = bound(a);
     struct nvme_cqe *cqe = nvme_get_cqe(&n->acq);
     if (cqe) {
         n->asq.head = NVME_SQ_HEAD(cqe->dw2);
         int sc = NVME_STATUS_CODE(cqe->dw3);
         nvme_cq_doorbell(n, NVME_AQ_IDX, &n->acq);
         if (sc == NVME_SC_OK) {
-            nvme_debug("I/O CQ created");
-            nvme_create_iosq(n, bound(a));
+            nvme_debug("I/O CQ %d created", idx);
+            if (nvme_create_iosq(n, idx, a) || nvme_delete_iocq(n, idx, a))
+                goto done;
         } else {
-            msg_err("failed to create I/O CQ: status code 0x%x\n", sc);
+            msg_err("failed to create I/O CQ %d: status code 0x%x\n", idx, sc);
+            nvme_ioq_deinit(n, &n->ioqs[idx]);
         }
+        if (idx > 0)
+            nvme_ioqs_ready(n, idx, a);
     }
+  done:
     closure_finish();
 }
 
-static boolean nvme_create_iocq(nvme n, storage_attach a)
+/* Each I/O queue pair has its own MSI-X vector targeted at the CPU that submits requests to the
+ * queue pair, so that completions are processed on the same CPU. */
+static boolean nvme_create_iocq(nvme n, int idx, storage_attach a)
 {
-    if (!nvme_init_cq(n, &n->iocq, n->ioq_order)) {
-        msg_err("failed to initialize queue\n");
+    nvme_ioq q = &n->ioqs[idx];
+    q->n = n;
+    q->idx = idx;
+    list_init(&q->pending_reqs);
+    list_init(&q->free_reqs);
+    list_init(&q->done_reqs);
+    list_init(&q->free_cmds);
+    spin_lock_init(&q->lock);
+    init_closure(&q->bh_service, nvme_bh_service, q);
+    init_closure(&q->poll, nvme_poll, q);
+    q->poll_scheduled = false;
+    q->inflight = 0;
+    zero(&q->stats, sizeof(q->stats));
+    q->cmds = allocate_vector(n->general, MIN(U64_FROM_BIT(n->ioq_order), NVME_CID_MAX + 1));
+    if (q->cmds == INVALID_ADDRESS) {
+        msg_err("failed to allocate command vector\n");
         return false;
     }
-    n->ac_handler = closure(n->general, nvme_create_iocq_resp, n, a);
+    if (!nvme_init_cq(n, &q->cq, n->ioq_order)) {
+        msg_err("failed to initialize queue\n");
+        goto free_cmds;
+    }
+    n->ac_handler = closure(n->general, nvme_create_iocq_resp, n, idx, a);
     if (n->ac_handler == INVALID_ADDRESS) {
         msg_err("failed to allocate completion handler\n");
-        nvme_deinit_cq(n, &n->iocq);
-        return false;
+        goto deinit_cq;
+    }
+    const char *name;
+    if (n->max_ioqs == 1) {
+        name = "nvme I/O";
+    } else {
+        buffer b = aprintf(n->general, "nvme I/O %d", idx);
+        buffer_write_byte(b, 0);
+        name = buffer_ref(b, 0);
     }
-    if (pci_setup_msix(n->d, NVME_IOQ_MSIX, init_closure(&n->io_irq, nvme_io_irq, n),
-                       "nvme I/O") == INVALID_PHYSICAL) {
+    if (pci_setup_msix_cpu(n->d, NVME_IOQ_MSIX(idx), init_closure(&q->irq, nvme_io_irq, q),
+                           name, idx) == INVALID_PHYSICAL) {
         msg_err("failed to allocate MSI-X vector\n");
-        return false;
+        deallocate_closure(n->ac_handler);
+        goto deinit_cq;
     }
     struct nvme_sqe *cmd = nvme_get_sqe(&n->asq);
     assert(cmd);
     zero(cmd, sizeof(*cmd));
     cmd->cdw0 = NVME_CID(n->asq.tail) | NVME_CMD_PRP | NVME_OPC_CRE_IOCQ;
-    cmd->dptr.prp1 = physical_from_virtual(n->iocq.ring);
-    cmd->cdw10 = (MASK(n->ioq_order) << 16) | NVME_IOQ_IDX; /* queue size and queue ID */
-    cmd->cdw11 = (NVME_IOQ_MSIX << 16) | 0x03;  /* interrupts enabled, physically contiguous */
+    cmd->dptr.prp1 = physical_from_virtual(q->cq.ring);
+    cmd->cdw10 = (MASK(n->ioq_order) << 16) | NVME_IOQ_IDX(idx); /* queue size and queue ID */
+    cmd->cdw11 = (NVME_IOQ_MSIX(idx) << 16) | 0x03;  /* interrupts enabled, physically contiguous */
+    nvme_sq_doorbell(n, NVME_AQ_IDX, &n->asq);
+    return true;
+  deinit_cq:
+    nvme_deinit_cq(n, &q->cq);
+  free_cmds:
+    deallocate_vector(q->cmds);
+    return false;
+}
+
+closure_function(2, 0, void, nvme_set_num_queues_resp,
+                 nvme, n, storage_attach, a)
+{
+    nvme n = bound(n);
+    struct nvme_cqe *cqe = nvme_get_cqe(&n->acq);
+    if (cqe) {
+        n->asq.head = NVME_SQ_HEAD(cqe->dw2);
+        int sc = NVME_STATUS_CODE(cqe->dw3);
+        nvme_cq_doorbell(n, NVME_AQ_IDX, &n->acq);
+        if (sc == NVME_SC_OK) {
+            /* number of allocated submission and completion queues (0's based) */
+            int nsq = (cqe->dw0 & 0xffff) + 1;
+            int ncq = (cqe->dw0 >> 16) + 1;
+            nvme_debug("controller allocated %d I/O SQs, %d I/O CQs", nsq, ncq);
+            n->max_ioqs = MIN(n->max_ioqs, MIN(nsq, ncq));
+        } else {
+            msg_err("failed to set number of queues: status code 0x%x\n", sc);
+            n->max_ioqs = 1;
+        }
+        nvme_create_iocq(n, 0, bound(a));
+    }
+    closure_finish();
+}
+
+static boolean nvme_set_num_queues(nvme n, storage_attach a)
+{
+    n->ac_handler = closure(n->general, nvme_set_num_queues_resp, n, a);
+    if (n->ac_handler == INVALID_ADDRESS) {
+        msg_err("failed to allocate completion handler\n");
+        return false;
+    }
+    struct nvme_sqe *cmd = nvme_get_sqe(&n->asq);
+    assert(cmd);
+    zero(cmd, sizeof(*cmd));
+    cmd->cdw0 = NVME_CID(n->asq.tail) | NVME_OPC_SET_FEAT;
+    cmd->cdw10 = NVME_FEAT_NUM_QUEUES;
+    cmd->cdw11 = ((n->max_ioqs - 1) << 16) | (n->max_ioqs - 1);
     nvme_sq_doorbell(n, NVME_AQ_IDX, &n->asq);
     return true;
 }
@@ -863,11 +1201,6 @@ closure_function(3, 1, boolean, nvme_probe,
         n->ioq_order--;
     nvme_debug("new controller (version %d.%d.%d), MQES %d, I/O queue order %d",
                NVME_VS_MJR(n->vs), NVME_VS_MNR(n->vs), NVME_VS_TER(n->vs), mqes, n->ioq_order);
-    n->cmds = allocate_vector(general, NVME_CID_MAX + 1);
-    if (n->cmds == INVALID_ADDRESS) {
-        msg_err("failed to allocate request vector\n");
-        goto deinit_acq;
-    }
     pci_bar_write_4(&n->bar, NVME_AQA, NVME_AQA_ACQS(U64_FROM_BIT(NVME_ACQ_ORDER)) |
                     NVME_AQA_ASQS(U64_FROM_BIT(NVME_ASQ_ORDER)));
     pci_bar_write_8(&n->bar, NVME_ASQ, physical_from_virtual(n->asq.ring));
@@ -882,29 +1215,37 @@ closure_function(3, 1, boolean, nvme_probe,
             kernel_delay(milliseconds(1 << retries));
         } else {
             msg_err("failed to enable controller\n");
-            goto free_cmds;
+            goto deinit_acq;
         }
     }
     n->d = d;
-    pci_enable_msix(d);
+
+    /* one I/O queue pair per CPU, each with its own MSI-X vector */
+    int msix_count = pci_enable_msix(d);
+    n->max_ioqs = MAX(MIN((int)total_processors, msix_count - 1), 1);
+    n->ioqs_alloc = n->max_ioqs;
+    n->nioqs = 0;
+    n->polling = false;
+    n->ioqs = allocate(general, n->ioqs_alloc * sizeof(struct nvme_ioq));
+    if (n->ioqs == INVALID_ADDRESS) {
+        msg_err("failed to allocate I/O queues\n");
+        goto disable_msix;
+    }
     if (pci_setup_msix(d, NVME_AQ_MSIX, init_closure(&n->admin_irq, nvme_admin_irq, n),
                        "nvme admin") == INVALID_PHYSICAL) {
         msg_err("failed to allocate MSI-X vector\n");
-        goto free_cmds;
+        goto free_ioqs;
     }
     n->attach_id = -1;
-    list_init(&n->pending_reqs);
-    list_init(&n->free_reqs);
-    list_init(&n->done_reqs);
-    list_init(&n->free_cmds);
-    spin_lock_init(&n->lock);
-    init_closure(&n->bh_service, nvme_bh_service, n);
-    if (nvme_create_iocq(n, bound(a))) {
+    if (nvme_set_num_queues(n, bound(a))) {
         d->driver_data = n;
         return true;
     }
-  free_cmds:
-    deallocate_vector(n->cmds);
+    pci_teardown_msix(d, NVME_AQ_MSIX);
+  free_ioqs:
+    deallocate(general, n->ioqs, n->ioqs_alloc * sizeof(struct nvme_ioq));
+  disable_msix:
+    pci_disable_msix(d);
   deinit_acq:
     nvme_deinit_cq(n, &n->acq);
   deinit_asq:
@@ -919,11 +1260,14 @@ closure_function(2, 0, void, nvme_detach_complete,
 {
     nvme_debug("detach complete");
     nvme n = bound(n);
-    pci_teardown_msix(n->d, NVME_IOQ_MSIX);
-    nvme_deinit_cq(n, &n->iocq);
+    for (int i = 0; i < n->nioqs; i++) {
+        nvme_ioq q = &n->ioqs[i];
+        nvme_deinit_sq(n, &q->sq);
+        nvme_ioq_deinit(n, q);
+    }
+    deallocate(n->general, n->ioqs, n->ioqs_alloc * sizeof(struct nvme_ioq));
     pci_teardown_msix(n->d, NVME_AQ_MSIX);
     pci_disable_msix(n->d);
-    deallocate_vector(n->cmds);
     pci_bar_deinit(&n->bar);
     nvme_deinit_cq(n, &n->acq);
     nvme_deinit_sq(n, &n->asq);
@@ -61,6 +61,119 @@ const char *string_from_fs_status(fs_status s)
     }
 }
 
+/* Path lookup cache: maps (parent, name) to the entry found by the filesystem lookup, or to zero
+ * for names that don't exist, so that repeated resolution of the same paths (including misses)
+ * skips symbol interning and directory lookups. Filesystems whose namespace can change behind
+ * their back (e.g. 9p) don't enable it. Covered by the filesystem lock. */
+typedef struct fs_dentry {
+    tuple parent;
+    buffer name;
+    tuple t;
+} *fs_dentry;
+
+static key fs_dentry_key(void *x)
+{
+    fs_dentry d = x;
+    return fnv64(d->name) ^ u64_from_pointer(d->parent);
+}
+
+static boolean fs_dentry_equal(void *x, void *y)
+{
+    fs_dentry a = x, b = y;
+    return (a->parent == b->parent) && buffer_compare(a->name, b->name);
+}
+
+void fs_lookup_cache_enable(filesystem fs)
+{
+    fs->lookup_cache = allocate_table(fs->h, fs_dentry_key, fs_dentry_equal);
+    assert(fs->lookup_cache != INVALID_ADDRESS);
+}
+
+static void fs_dentry_free(filesystem fs, fs_dentry d)
+{
+    deallocate_buffer(d->name);
+    deallocate(fs->h, d, sizeof(*d));
+}
+
+static void fs_lookup_cache_flush(filesystem fs)
+{
+    table_foreach(fs->lookup_cache, k, v) {
+        (void)v;
+        fs_dentry_free(fs, k);
+    }
+    table_clear(fs->lookup_cache);
+}
+
+#ifndef FS_READ_ONLY
+static void fs_lookup_cache_destroy(filesystem fs)
+{
+    if (fs->lookup_cache) {
+        fs_lookup_cache_flush(fs);
+        deallocate_table(fs->lookup_cache);
+        fs->lookup_cache = 0;
+    }
+}
+#endif
+
+/* Called with fs locked. */
+void fs_lookup_cache_invalidate(filesystem fs, tuple parent, string name)
+{
+    if (!fs->lookup_cache)
+        return;
+    struct fs_dentry k = { .parent = parent, .name = name };
+    fs_dentry d = table_find(fs->lookup_cache, &k);
+    if (d) {
+        table_remove(fs->lookup_cache, d);
+        fs_dentry_free(fs, d);
+    }
+}
+
+#ifndef FS_READ_ONLY
+/* Called with fs locked, before a directory is destroyed, to drop the entries looked up in it. */
+static void fs_lookup_cache_invalidate_dir(filesystem fs, tuple dir)
+{
+    if (!fs->lookup_cache)
+        return;
+    table_foreach(fs->lookup_cache, k, v) {
+        (void)v;
+        fs_dentry d = k;
+        if (d->parent == dir) {
+            table_remove(fs->lookup_cache, d);
+            fs_dentry_free(fs, d);
+        }
+    }
+}
+#endif
+
+/* Called with fs locked. "." and ".." are resolved by the filesystem, since they depend on the
+ * current location of the directory. */
+static tuple fs_lookup(filesystem fs, tuple parent, string name)
+{
+    table c = fs->lookup_cache;
+    if (!c || !buffer_strcmp(name, ".") || !buffer_strcmp(name, ".."))
+        return fs->lookup(fs, parent, name);
+    struct fs_dentry k = { .parent = parent, .name = name };
+    fs_dentry d = table_find(c, &k);
+    if (d)
+        return d->t;
+    tuple t = fs->lookup(fs, parent, name);
+    if (table_elements(c) >= FS_LOOKUP_CACHE_MAX_ENTRIES)
+        fs_lookup_cache_flush(fs);
+    d = allocate(fs->h, sizeof(*d));
+    if (d == INVALID_ADDRESS)
+        return t;
+    d->name = allocate_buffer(fs->h, buffer_length(name));
+    if (d->name == INVALID_ADDRESS) {
+        deallocate(fs->h, d, sizeof(*d));
+        return t;
+    }
+    assert(push_buffer(d->name, name));
+    d->parent = parent;
+    d->t = t;
+    table_set(c, d, d);
+    return t;
+}
+
 u64 fsfile_get_length(fsfile f)
 {
     return f->length;
@@ -344,6 +457,7 @@ define_closure_function(1, 1, void, fs_free,
     filesystem fs = bound(fs);
     if (fs->sync_complete)
         apply(fs->sync_complete);
+    fs_lookup_cache_destroy(fs);
     fs->destroy_fs(fs);
 }
 
@@ -371,6 +485,7 @@ static fs_status fs_create_dir_entry(filesystem fs, tuple parent, string name, t
     fs_status s = fs->create(fs, parent, name, md, f);
     if (s == FS_STATUS_OK) {
         symbol name_sym = intern(name);
+        fs_lookup_cache_invalidate(fs, parent, name);
         set(children(parent), name_sym, md);
         set(md, sym_this(".."), parent);
         filesystem_update_mtime(fs, parent);
@@ -568,6 +683,9 @@ fs_status filesystem_delete(filesystem fs, inode cwd, const char *path, boolean
     fss = fs->unlink(fs, parent, name, t, &destruct_md);
     if (fss == FS_STATUS_OK) {
         symbol name_sym = intern(name);
+        fs_lookup_cache_invalidate(fs, parent, name);
+        if (c)
+            fs_lookup_cache_invalidate_dir(fs, t);
         set(children(parent), name_sym, 0);
         fs_notify_delete(t, parent, name_sym);
         fs_notify_release(t, false);
@@ -650,6 +768,10 @@ fs_status filesystem_rename(filesystem oldfs, inode oldwd, const char *oldpath,
     boolean destruct_md;
     s = oldfs->rename(oldfs, oldparent, oldname, old, newparent, newname, new, false, &destruct_md);
     if (s == FS_STATUS_OK) {
+        fs_lookup_cache_invalidate(oldfs, oldparent, oldname);
+        fs_lookup_cache_invalidate(oldfs, newparent, newname);
+        if (new && children(new))
+            fs_lookup_cache_invalidate_dir(oldfs, new);
         set(children(oldparent), old_s, 0);
         set(children(newparent), new_s, old);
         set(old, sym_this(".."), newparent);
@@ -723,6 +845,8 @@ fs_status filesystem_exchange(filesystem fs1, inode wd1, const char *path1,
     string name2 = alloca_wrap_cstring(filename_from_path(path2));
     s = fs1->rename(fs1, parent1, name1, n1, parent2, name2, n2, true, 0);
     if (s == FS_STATUS_OK) {
+        fs_lookup_cache_invalidate(fs1, parent1, name1);
+        fs_lookup_cache_invalidate(fs1, parent2, name2);
         set(children(parent1), intern(name1), n2);
         set(n2, sym_this(".."), parent1);
         set(children(parent2), intern(name2), n1);
@@ -772,6 +896,7 @@ status filesystem_init(filesystem fs, heap h, u64 size, u64 blocksize, boolean r
     fs->sync_complete = 0;
     filesystem_lock_init(fs);
 #endif
+    fs->lookup_cache = 0;
     fs->ro = ro;
     return STATUS_OK;
 }
@@ -833,7 +958,7 @@ void fs_set_path_helper(filesystem (*get_root_fs)(), inode (*get_mountpoint)(tup
 static tuple lookup_follow(filesystem *fs, tuple t, string a, tuple *p)
 {
     *p = t;
-    t = (*fs)->lookup(*fs, t, a);
+    t = fs_lookup(*fs, t, a);
     if (!t)
         return t;
     if (fs_path_helper.get_mountpoint) {
@@ -870,7 +995,7 @@ static tuple lookup_follow(filesystem *fs, tuple t, string a, tuple *p)
             *fs = parent_fs;
             if (mp) {
                 *p = mp;
-                t = parent_fs->lookup(parent_fs, mp, a);
+                t = fs_lookup(parent_fs, mp, a);
             } else {
                 /* The mount directory in the parent filesystem has disappeared before the
                  * filesystem could be locked. */
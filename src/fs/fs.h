@@ -104,6 +104,7 @@ struct filesystem {
                                        status_handler completion);
     void (*destroy_fs)(filesystem fs);
     tuple root;
+    table lookup_cache;         /* see fs_lookup(); zero if disabled */
 #ifdef KERNEL
     struct mutex lock;
 #endif
@@ -162,6 +163,9 @@ static inline u64 sector_from_offset(filesystem fs, bytes b)
 
 tuple fs_new_entry(filesystem fs);
 
+void fs_lookup_cache_enable(filesystem fs);
+void fs_lookup_cache_invalidate(filesystem fs, tuple parent, string name);
+
 boolean file_tuple_is_ancestor(tuple t1, tuple t2, tuple p2);
 
 fs_status filesystem_mkdir(filesystem fs, inode cwd, const char *path);
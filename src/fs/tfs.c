@@ -20,11 +20,19 @@
 #define tfs_storage_lock(fs)    spin_lock(&(fs)->storage_lock)
 #define tfs_storage_unlock(fs)  spin_unlock(&(fs)->storage_lock)
 
+#define tfsfile_lock_init(f)    mutex_init(&(f)->lock, 0)
+#define tfsfile_lock(f)         mutex_lock(&(f)->lock)
+#define tfsfile_unlock(f)       mutex_unlock(&(f)->lock)
+
 #else
 
 #define tfs_storage_lock(fs)    ((void)fs)
 #define tfs_storage_unlock(fs)  ((void)fs)
 
+#define tfsfile_lock_init(f)
+#define tfsfile_lock(f)         ((void)f)
+#define tfsfile_unlock(f)       ((void)f)
+
 #endif
 
 #define fs_is_tfs(fs)   ((fs)->get_meta == fs_tuple_from_inode)
@@ -38,13 +46,10 @@ static tuple fs_tuple_from_inode(filesystem fs, inode n)
     return table_find(((tfs)fs)->files, t) ? t : 0;
 }
 
+/* Lock-free, so that it can be called with the filesystem lock held. */
 static s64 tfsfile_get_blocks(fsfile f)
 {
-    s64 blocks = 0;
-    rangemap_foreach(((tfsfile)f)->extentmap, n) {
-        blocks += range_span(n->r);
-    }
-    return blocks;
+    return ((tfsfile)f)->blocks;
 }
 
 void fixup_directory(tuple parent, tuple dir);
@@ -102,20 +107,34 @@ closure_function(2, 1, boolean, tfs_storage_alloc,
     return true;
 }
 
+/* Called with storage lock held */
+static u64 filesystem_allocate_storage_locked(tfs fs, u64 nblocks)
+{
+    u64 start_block;
+    int result = rangemap_range_find_gaps(fs->storage,
+                                          irange(0, fs->fs.size >> fs->fs.blocksize_order),
+                                          stack_closure(tfs_storage_alloc, nblocks, &start_block));
+    if ((result == RM_ABORT) &&
+        rangemap_insert_range(fs->storage, irangel(start_block, nblocks)))
+        return start_block;
+    return INVALID_PHYSICAL;
+}
+
+#ifdef KERNEL
+static boolean filesystem_discard_cancel_locked(tfs fs);
+#endif
+
 u64 filesystem_allocate_storage(tfs fs, u64 nblocks)
 {
     if (fs->storage) {
         tfs_storage_lock(fs);
-        u64 start_block;
-        int result = rangemap_range_find_gaps(fs->storage,
-                                              irange(0, fs->fs.size >> fs->fs.blocksize_order),
-                                              stack_closure(tfs_storage_alloc,
-                                                            nblocks, &start_block));
-        boolean success = (result == RM_ABORT) &&
-                          rangemap_insert_range(fs->storage, irangel(start_block, nblocks));
+        u64 start_block = filesystem_allocate_storage_locked(fs, nblocks);
+#ifdef KERNEL
+        if ((start_block == INVALID_PHYSICAL) && filesystem_discard_cancel_locked(fs))
+            start_block = filesystem_allocate_storage_locked(fs, nblocks);
+#endif
         tfs_storage_unlock(fs);
-        if (success)
-            return start_block;
+        return start_block;
     }
     return INVALID_PHYSICAL;
 }
@@ -136,13 +155,121 @@ boolean filesystem_free_storage(tfs fs, range blocks)
 {
     if (fs->storage) {
         tfs_storage_lock(fs);
-        boolean success = rangemap_insert_hole(fs->storage, blocks);
+        boolean success;
+#ifdef KERNEL
+        /* Freed blocks stay allocated until the log flush that records the free has completed and
+         * the device has been told to discard them. */
+        if (fs->discard)
+            success = !rangemap_range_intersects(fs->discard_pending, blocks) &&
+                      rangemap_insert_range(fs->discard_pending, blocks);
+        else
+#endif
+        success = rangemap_insert_hole(fs->storage, blocks);
         tfs_storage_unlock(fs);
         return success;
     }
     return true;
 }
 
+#ifdef KERNEL
+
+/* Called when a log flush starts: any frees pending so far are recorded by this flush. Ranges from
+ * a failed flush are left in discard_flushing and go out with the next successful one. */
+void filesystem_discard_prepare(tfs fs)
+{
+    tfs_storage_lock(fs);
+    rmnode n;
+    while ((n = rangemap_first_node(fs->discard_pending)) != INVALID_ADDRESS) {
+        range r = n->r;
+        rangemap_remove_range(fs->discard_pending, n);
+        if (!rangemap_insert_range(fs->discard_flushing, r) &&
+            !rangemap_insert_hole(fs->storage, r))
+            msg_err("failed to mark %R as free\n", r);
+    }
+    tfs_storage_unlock(fs);
+}
+
+/* Called with storage lock held */
+static boolean filesystem_discard_cancel_map(tfs fs, rangemap rm)
+{
+    boolean freed = false;
+    rmnode n;
+    while ((n = rangemap_first_node(rm)) != INVALID_ADDRESS) {
+        range r = n->r;
+        rangemap_remove_range(rm, n);
+        if (rangemap_insert_hole(fs->storage, r))
+            freed = true;
+        else
+            msg_err("failed to mark %R as free\n", r);
+    }
+    return freed;
+}
+
+/* Rather than failing an allocation while freed blocks wait for a log flush and their discard,
+ * give up discarding them and make them available right away, as is done when discard is off.
+ * Blocks whose discard has already been issued are returned to the allocator on its completion.
+ * Returns true if any blocks have been made available. Called with storage lock held. */
+static boolean filesystem_discard_cancel_locked(tfs fs)
+{
+    boolean pending = filesystem_discard_cancel_map(fs, fs->discard_pending);
+    boolean flushing = filesystem_discard_cancel_map(fs, fs->discard_flushing);
+    tfs_debug("%s: pending %d, flushing %d\n", __func__, pending, flushing);
+    return pending || flushing;
+}
+
+closure_function(2, 1, void, tfs_discard_complete,
+                 tfs, fs, range, blocks,
+                 status, s)
+{
+    tfs fs = bound(fs);
+    if (!is_ok(s)) {
+        /* discard is advisory; stop issuing it if the device cannot handle it */
+        tfs_debug("%s: discard of %R failed (%v), disabling\n", __func__, bound(blocks), s);
+        fs->discard = false;
+        timm_dealloc(s);
+    }
+    tfs_storage_lock(fs);
+    if (!rangemap_insert_hole(fs->storage, bound(blocks)))
+        msg_err("failed to mark %R as free\n", bound(blocks));
+    boolean destroy = (--fs->discards_inflight == 0) && fs->destroy_pending;
+    tfs_storage_unlock(fs);
+    closure_finish();
+    if (destroy)
+        destroy_filesystem(&fs->fs);
+}
+
+/* Called after a successful log flush: the blocks freed by the flushed log entries can no longer
+ * be referenced after a crash, so it is safe to discard them and return them to the allocator. */
+void filesystem_discard_issue(tfs fs)
+{
+    tfs_storage_lock(fs);
+    rmnode n;
+    while ((n = rangemap_first_node(fs->discard_flushing)) != INVALID_ADDRESS) {
+        range r = n->r;
+        rangemap_remove_range(fs->discard_flushing, n);
+        status_handler sh = fs->discard ? closure(fs->fs.h, tfs_discard_complete, fs, r) :
+                                          INVALID_ADDRESS;
+        if (sh == INVALID_ADDRESS) {
+            if (!rangemap_insert_hole(fs->storage, r))
+                msg_err("failed to mark %R as free\n", r);
+            continue;
+        }
+        fs->discards_inflight++;
+        tfs_storage_unlock(fs);
+        tfs_debug("%s: discarding %R\n", __func__, r);
+        struct storage_req req = {
+            .op = STORAGE_OP_DISCARD,
+            .blocks = r,
+            .completion = sh,
+        };
+        apply(fs->req_handler, &req);
+        tfs_storage_lock(fs);
+    }
+    tfs_storage_unlock(fs);
+}
+
+#endif
+
 void ingest_extent(tfsfile f, symbol off, tuple value)
 {
     tfs_debug("ingest_extent: f %p, off %b, value %v\n", f, symbol_string(off), value);
@@ -169,6 +296,7 @@ void ingest_extent(tfsfile f, symbol off, tuple value)
     if (get(value, sym(uninited)))
         ex->uninited = INVALID_ADDRESS;
     assert(rangemap_insert(f->extentmap, &ex->node));
+    f->blocks += length;
 }
 
 closure_function(1, 2, boolean, tfs_ingest_extent,
@@ -351,11 +479,11 @@ closure_function(2, 3, void, filesystem_storage_read,
 
     /* read extent data and zero gaps */
     range blocks = range_rshift_pad(q, fs->fs.blocksize_order);
-    filesystem_lock(&fs->fs);
+    tfsfile_lock(f);
     rangemap_range_lookup_with_gaps(f->extentmap, blocks,
                                     stack_closure(read_extent, fs, sg, m, blocks),
                                     stack_closure(zero_hole, fs, sg, blocks));
-    filesystem_unlock(&fs->fs);
+    tfsfile_unlock(f);
     apply(k, STATUS_OK);
 }
 
@@ -504,6 +632,7 @@ static fs_status add_extent_to_file(tfsfile f, extent ex)
         rbtree_dump(&f->extentmap->t, RB_INORDER);
         assert(0);
     }
+    f->blocks += range_span(ex->node.r);
     return FS_STATUS_OK;
 }
 
@@ -521,6 +650,7 @@ static void remove_extent_from_file(tfsfile f, extent ex)
         set(extents, offs, 0);
     }
     rangemap_remove_node(f->extentmap, &ex->node);
+    f->blocks -= range_span(ex->node.r);
 }
 
 static fs_status add_extents(tfs fs, range i, rangemap rm)
@@ -723,6 +853,7 @@ static fs_status update_extent_length(tfsfile f, extent ex, u64 new_length)
 
     /* TODO cheating; should be reinsert - update rangemap interface? */
     tfs_debug("   %s: was %R\n", __func__, ex->node.r);
+    f->blocks += new_length - range_span(ex->node.r);
     ex->node.r = irangel(ex->node.r.start, new_length);
     tfs_debug("   %s: now %R\n", __func__, ex->node.r);
     return FS_STATUS_OK;
@@ -852,6 +983,37 @@ static status extents_range_handler(tfs fs, tfsfile f, range q, sg_list sg, merg
     return STATUS_OK;
 }
 
+/* Called with file locked. True if the range is backed by initialized (or initializing) extents
+   within the file length, i.e. writing to or reserving it needs no metadata updates. */
+static boolean extents_range_allocated(tfs fs, tfsfile f, range q)
+{
+    if (fsfile_get_length(&f->f) < q.end)
+        return false;
+    range blocks = range_rshift_pad(q, fs->fs.blocksize_order);
+    while (blocks.start < blocks.end) {
+        extent ex = (extent)rangemap_lookup(f->extentmap, blocks.start);
+        if (ex == INVALID_ADDRESS || ex->uninited == INVALID_ADDRESS)
+            return false;
+        blocks.start = ex->node.r.end;
+    }
+    return true;
+}
+
+/* Overwrites of allocated extents only need the file lock; the filesystem lock is taken for
+   operations which allocate storage or write to the log. */
+static status tfsfile_range_op(tfs fs, tfsfile f, range q, sg_list sg, merge m)
+{
+    tfsfile_lock(f);
+    boolean fs_locked = (m && !sg) || !extents_range_allocated(fs, f, q);
+    if (fs_locked)
+        filesystem_lock(&fs->fs);
+    status s = extents_range_handler(fs, f, q, sg, m);
+    if (fs_locked)
+        filesystem_unlock(&fs->fs);
+    tfsfile_unlock(f);
+    return s;
+}
+
 closure_function(2, 1, status, filesystem_check_or_reserve_extent,
                  tfs, fs, tfsfile, f,
                  range, q)
@@ -861,10 +1023,7 @@ closure_function(2, 1, status, filesystem_check_or_reserve_extent,
     tfs_debug("%s: file %p range %R\n", __func__, f, q);
     if (fs->fs.ro)
        return timm("result", "read-only filesystem", "fsstatus", "%d", FS_STATUS_READONLY);
-    filesystem_lock(&fs->fs);
-    status s = extents_range_handler(fs, f, q, 0, 0);
-    filesystem_unlock(&fs->fs);
-    return s;
+    return tfsfile_range_op(fs, f, q, 0, 0);
 }
 
 closure_function(2, 3, void, filesystem_storage_write,
@@ -884,10 +1043,7 @@ closure_function(2, 3, void, filesystem_storage_write,
     merge m = allocate_merge(fs->fs.h, complete);
     status_handler sh = apply_merge(m);
 
-    filesystem_lock(&fs->fs);
-    status s = extents_range_handler(fs, f, q, sg, m);
-    filesystem_unlock(&fs->fs);
-    apply(sh, s);
+    apply(sh, tfsfile_range_op(fs, f, q, sg, m));
 }
 
 closure_function(3, 1, void, fs_cache_sync_complete,
@@ -986,6 +1142,7 @@ void filesystem_alloc(fsfile f, long offset, long len,
 
     tfsfile fsf = (tfsfile)f;
     tfs tfs = (struct tfs *)fs;
+    tfsfile_lock(fsf);
     filesystem_lock(fs);
     u64 lastedge = blocks.start;
     rmnode curr = rangemap_first_node(fsf->extentmap);
@@ -1018,6 +1175,7 @@ void filesystem_alloc(fsfile f, long offset, long len,
     }
 done:
     filesystem_unlock(fs);
+    tfsfile_unlock(fsf);
     deallocate_rangemap(new_rm, (status == FS_STATUS_OK ?
                                  stack_closure(assert_no_node) :
                                  stack_closure(destroy_extent_node, tfs)));
@@ -1096,6 +1254,7 @@ static fs_status do_mkentry(tfs fs, tuple parent, const char *name, tuple entry,
     }
 
     if (s == FS_STATUS_OK) {
+        fs_lookup_cache_invalidate(&fs->fs, parent, symbol_string(name_sym));
         set(c, name_sym, entry);
         table_set(fs->files, entry, INVALID_ADDRESS);
         fs_notify_create(entry, parent, name_sym);
@@ -1322,6 +1481,16 @@ void filesystem_log_rebuild(tfs fs, log new_tl, status_handler sh)
     }
 }
 
+/* The completion runs once the rewritten log has replaced the old one; if a compaction is already
+   in progress, it runs when that compaction completes. */
+void filesystem_log_checkpoint(filesystem fs, status_handler completion)
+{
+    tfs tfs = (struct tfs *)fs;
+    filesystem_lock(fs);
+    log_checkpoint(tfs->tl, completion);
+    filesystem_unlock(fs);
+}
+
 void filesystem_log_rebuild_done(tfs fs, log new_tl)
 {
     tfs_debug("%s\n", __func__);
@@ -1388,7 +1557,9 @@ tfsfile allocate_fsfile(tfs fs, tuple md)
         deallocate(h, f, sizeof(struct tfsfile));
         return INVALID_ADDRESS;
     }
+    tfsfile_lock_init(f);
     f->extentmap = allocate_rangemap(h);
+    f->blocks = 0;
     fsf->get_blocks = tfsfile_get_blocks;
     if (md)
         table_set(fs->files, md, f);
@@ -1499,6 +1670,7 @@ void create_filesystem(heap h,
     fs->fs.root = 0;
     fs->page_order = pagecache_get_page_order();
     fs->fs.lookup = tfs_lookup;
+    fs_lookup_cache_enable(&fs->fs);
     fs->fs.get_fsfile = tfs_get_fsfile;
     fs->fs.get_inode = tfs_get_inode;
     fs->fs.get_meta = fs_tuple_from_inode;
@@ -1514,6 +1686,15 @@ void create_filesystem(heap h,
     assert(fs->storage != INVALID_ADDRESS);
     spin_lock_init(&fs->storage_lock);
     fs->temp_log = 0;
+#ifdef KERNEL
+    fs->discard_pending = allocate_rangemap(h);
+    assert(fs->discard_pending != INVALID_ADDRESS);
+    fs->discard_flushing = allocate_rangemap(h);
+    assert(fs->discard_flushing != INVALID_ADDRESS);
+    fs->discards_inflight = 0;
+    fs->discard = !ro;
+    fs->destroy_pending = false;
+#endif
 #else
     fs->storage = 0;
 #endif
@@ -1553,6 +1734,13 @@ void destroy_filesystem(filesystem fs)
 {
     tfs_debug("%s %p\n", __func__, fs);
     tfs tfs = (struct tfs *)fs;
+#ifdef KERNEL
+    tfs_storage_lock(tfs);
+    tfs->destroy_pending = tfs->discards_inflight != 0;
+    tfs_storage_unlock(tfs);
+    if (tfs->destroy_pending)
+        return; /* resumed by the last discard completion */
+#endif
     log_destroy(tfs->tl);
     table_foreach(tfs->files, k, v) {
         fs_notify_release(k, true);
@@ -1564,6 +1752,10 @@ void destroy_filesystem(filesystem fs)
     pagecache_dealloc_volume(fs->pv);
     deallocate_table(tfs->files);
     deallocate_rangemap(tfs->storage, stack_closure(tfs_storage_destroy, fs->h));
+#ifdef KERNEL
+    deallocate_rangemap(tfs->discard_pending, stack_closure(tfs_storage_destroy, fs->h));
+    deallocate_rangemap(tfs->discard_flushing, stack_closure(tfs_storage_destroy, fs->h));
+#endif
     deallocate(fs->h, fs, sizeof(*fs));
 }
 
@@ -24,6 +24,8 @@ void destroy_filesystem(filesystem fs);
 fsfile fsfile_from_node(filesystem fs, tuple n);
 tfsfile allocate_fsfile(tfs fs, tuple md);
 
+void filesystem_log_checkpoint(filesystem fs, status_handler completion);
+
 fs_status filesystem_write_tuple(tfs fs, tuple t);
 fs_status filesystem_write_eav(tfs fs, tuple t, symbol a, value v, boolean cleanup);
 
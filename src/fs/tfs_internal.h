@@ -28,11 +28,22 @@ typedef struct tfs {
     log temp_log;
     u64 next_extend_log_offset;
     u64 next_new_log_offset;
+#ifdef KERNEL
+    rangemap discard_pending;   /* freed blocks not yet recorded in a log flush */
+    rangemap discard_flushing;  /* freed blocks recorded by the current log flush */
+    u64 discards_inflight;
+    boolean discard;
+    boolean destroy_pending;
+#endif
 } *tfs;
 
 typedef struct tfsfile {
     struct fsfile f;    /* must be first */
+#ifdef KERNEL
+    struct mutex lock;  /* covers extentmap and extent state; taken before the filesystem lock */
+#endif
     rangemap extentmap;
+    u64 blocks;         /* total length of extents; updated with both locks held, read with none */
 } *tfsfile;
 
 typedef struct uninited_queued_op {
@@ -76,12 +87,17 @@ log log_create(heap h, tfs fs, boolean initialize, status_handler sh);
 boolean log_write(log tl, tuple t);
 boolean log_write_eav(log tl, tuple e, symbol a, value v);
 void log_flush(log tl, status_handler completion);
+void log_checkpoint(log tl, status_handler completion);
 void log_destroy(log tl);
 u64 filesystem_allocate_storage(tfs fs, u64 nblocks);
 boolean filesystem_reserve_storage(tfs fs, range storage_blocks);
 boolean filesystem_free_storage(tfs fs, range storage_blocks);
 void filesystem_storage_op(tfs fs, sg_list sg, range blocks, boolean write,
                            status_handler completion);
+#ifdef KERNEL
+void filesystem_discard_prepare(tfs fs);
+void filesystem_discard_issue(tfs fs);
+#endif
 
 void filesystem_log_rebuild(tfs fs, log new_tl, status_handler sh);
 void filesystem_log_rebuild_done(tfs fs, log new_tl);
@@ -92,8 +92,10 @@ struct log {
 
     struct timer flush_timer;
     vector flush_completions;
+    vector checkpoint_completions;  /* run once a requested checkpoint is written */
     boolean dirty;
     boolean flushing;
+    boolean checkpoint;         /* rewrite the log at the next flush */
     enum {
         TLOG_STATE_INIT,
         TLOG_STATE_LINKED,
@@ -209,15 +211,19 @@ static log log_new(heap h, tfs fs)
     tl->tuple_bytes_remain = 0;
     tl->dirty = false;
     tl->flushing = false;
+    tl->checkpoint = false;
     init_timer(&tl->flush_timer);
     tl->flush_completions = allocate_vector(tl->h, COMPLETION_QUEUE_SIZE);
     if (tl->flush_completions == INVALID_ADDRESS)
         goto fail_dealloc_encoding_lengths;
+    tl->checkpoint_completions = allocate_vector(tl->h, COMPLETION_QUEUE_SIZE);
+    if (tl->checkpoint_completions == INVALID_ADDRESS)
+        goto fail_dealloc_completions;
     tl->total_entries = tl->obsolete_entries = 0;
 #ifndef TLOG_READ_ONLY
     tl->extensions = allocate_rangemap(h);
     if (tl->extensions == INVALID_ADDRESS) {
-        goto fail_dealloc_completions;
+        goto fail_dealloc_checkpoint_completions;
     }
     init_refcount(&tl->refcount, 1, init_closure(&tl->free, log_free, tl));
 #endif
@@ -227,9 +233,11 @@ static log log_new(heap h, tfs fs)
 #ifndef TLOG_READ_ONLY
         deallocate_rangemap(tl->extensions, stack_closure(log_dealloc_ext_node, tl));
 #endif
-        goto fail_dealloc_completions;
+        goto fail_dealloc_checkpoint_completions;
     }
     return tl;
+  fail_dealloc_checkpoint_completions:
+    deallocate_vector(tl->checkpoint_completions);
   fail_dealloc_completions:
     deallocate_vector(tl->flush_completions);
   fail_dealloc_encoding_lengths:
@@ -366,11 +374,20 @@ log_ext log_extend(log tl, u64 size, status_handler sh) {
     tlog_debug("log_extend: tl %p, size 0x%lx\n", tl, size);
 
     /* allocate new log and write with end of log */
-    size >>= tl->fs->fs.blocksize_order;
-    u64 offset;
-    if (!filesystem_reserve_log_space(tl->fs, &tl->fs->next_extend_log_offset, &offset, size)) {
-        apply(sh, timm("result", "failed to extend log"));
-        return INVALID_ADDRESS;
+    tfs fs = tl->fs;
+    size >>= fs->fs.blocksize_order;
+    u64 offset = INVALID_PHYSICAL;
+
+    /* Extensions larger than the default are allocated on their own, so that the space reserved
+       for the next extension keeps its size; if that fails, fall back to a default extension. */
+    if (size > filesystem_log_blocks(fs))
+        offset = filesystem_allocate_storage(fs, size);
+    if (offset == INVALID_PHYSICAL) {
+        size = filesystem_log_blocks(fs);
+        if (!filesystem_reserve_log_space(fs, &fs->next_extend_log_offset, &offset, size)) {
+            apply(sh, timm("result", "failed to extend log"));
+            return INVALID_ADDRESS;
+        }
     }
 
     /* new log extension */
@@ -394,6 +411,16 @@ static inline u64 log_size(log_ext ext)
     return bytes_from_sectors(&ext->tl->fs->fs, range_span(ext->sectors));
 }
 
+/* Size of a new extension able to hold all staged entries (of which 'pending' are yet to be
+   started), so that a log checkpoint, which stages the whole metadata tree at once, is stored
+   contiguously and read back with a single storage request. */
+static u64 log_extension_size(log tl, int pending)
+{
+    u64 size = buffer_length(tl->tuple_staging) + pending * TUPLE_AVAILABLE_HEADER_SIZE +
+               TFS_LOG_RESERVED_BYTES + TUPLE_AVAILABLE_MIN_SIZE;
+    return MIN(pad(size, TFS_LOG_DEFAULT_EXTENSION_SIZE), TFS_LOG_MAX_EXTENSION_SIZE);
+}
+
 static inline boolean log_write_internal(log tl, merge m)
 {
     log_ext ext = tl->current;
@@ -413,7 +440,7 @@ static inline boolean log_write_internal(log tl, merge m)
             if (ext->staging->end + min >= size || ext->old_encoding) {
                 tlog_ext_unlock(ext);
                 status_handler sh = apply_merge(m);
-                ext = log_extend(tl, TFS_LOG_DEFAULT_EXTENSION_SIZE, sh);
+                ext = log_extend(tl, log_extension_size(tl, n - i), sh);
                 if (ext == INVALID_ADDRESS)
                     return false;
                 size = log_size(ext);
@@ -443,20 +470,30 @@ static inline boolean log_write_internal(log tl, merge m)
     return true;
 }
 
-static void run_flush_completions(log tl, status s)
+static void run_completions(vector completions, status s)
 {
-    if (tl->flush_completions) {
+    if (completions) {
         status_handler sh;
-        vector_foreach(tl->flush_completions, sh)
+        vector_foreach(completions, sh)
 #ifdef KERNEL
             async_apply_status_handler(sh, s);
 #else
             apply(sh, s);
 #endif
-        vector_clear(tl->flush_completions);
+        vector_clear(completions);
     }
 }
 
+static void log_checkpoint_failed(log tl, const char *reason)
+{
+    tl->checkpoint = false;
+    if (vector_length(tl->checkpoint_completions) == 0)
+        return;
+    status s = timm("result", "log checkpoint failed: %s", reason);
+    run_completions(tl->checkpoint_completions, s);
+    timm_dealloc(s);
+}
+
 closure_function(1, 1, void, log_flush_complete,
                  log, tl,
                  status, s)
@@ -464,8 +501,16 @@ closure_function(1, 1, void, log_flush_complete,
     /* would need to move these to runqueue if a flush is ever invoked from a tfs op */
     tlog_lock(bound(tl));
     bound(tl)->dirty = false;
-    run_flush_completions(bound(tl), s);
+#ifdef KERNEL
+    if (is_ok(s))
+        filesystem_discard_issue(bound(tl)->fs);
+#endif
+    run_completions(bound(tl)->flush_completions, s);
     bound(tl)->flushing = false;
+
+    /* a checkpoint requested while this flush was in progress */
+    if (bound(tl)->checkpoint)
+        log_flush(bound(tl), 0);
     tlog_unlock(bound(tl));
     refcount_release(&bound(tl)->refcount);
     closure_finish();
@@ -504,7 +549,8 @@ closure_function(2, 1, void, log_switch_complete,
             msg_err("failed to mark to_be_destroyed log at %R as free", ext->r);
     }
 
-    run_flush_completions(old_tl, s);
+    run_completions(old_tl->flush_completions, s);
+    run_completions(old_tl->checkpoint_completions, s);
     filesystem_unlock(&fs->fs);
 
     refcount_release(&to_be_destroyed->refcount);
@@ -515,7 +561,7 @@ closure_function(2, 1, void, log_switch_complete,
 void log_flush(log tl, status_handler completion)
 {
     tlog_debug("%s: log %p, completion %p, dirty %d\n", __func__, tl, completion, tl->dirty);
-    if (!tl->dirty && (tl->state != TLOG_STATE_COMPACTING)) {
+    if (!tl->dirty && !tl->checkpoint && (tl->state != TLOG_STATE_COMPACTING)) {
         if (completion)
 #ifdef KERNEL
             async_apply_status_handler(completion, STATUS_OK);
@@ -532,6 +578,13 @@ void log_flush(log tl, status_handler completion)
     remove_timer(kernel_timers, &tl->flush_timer, 0);
 #endif
     tl->flushing = true;
+
+    /* cleared before flushing, so that a synchronous flush completion does not start it again */
+    boolean checkpoint = tl->checkpoint;
+    tl->checkpoint = false;
+#ifdef KERNEL
+    filesystem_discard_prepare(tl->fs);
+#endif
     refcount_reserve(&tl->refcount);
     merge m = allocate_merge(tl->h, closure(tl->h, log_flush_complete, tl));
     status_handler sh = apply_merge(m);
@@ -546,14 +599,15 @@ void log_flush(log tl, status_handler completion)
     flush_log_extension(tl->current, false, sh);
     tlog_lock(tl);
 
-    if ((tl->state == TLOG_STATE_LINKED) && (tl->obsolete_entries >= TFS_LOG_COMPACT_OBSOLETE) &&
-        (tl->total_entries <= TFS_LOG_COMPACT_RATIO * tl->obsolete_entries)) {
+    if ((tl->state == TLOG_STATE_LINKED) && (checkpoint ||
+        ((tl->obsolete_entries >= TFS_LOG_COMPACT_OBSOLETE) &&
+         (tl->total_entries <= TFS_LOG_COMPACT_RATIO * tl->obsolete_entries)))) {
         tlog_debug("%ld obsolete entries out of %ld, starting log compaction\n",
             tl->obsolete_entries, tl->total_entries);
         tfs fs = tl->fs;
         log new_tl = log_new(fs->fs.h, fs);
         if (new_tl == INVALID_ADDRESS)
-            return;
+            goto fail;
         log_ext new_ext = log_ext_new(new_tl);
         if (new_ext == INVALID_ADDRESS)
             goto fail_log_destroy;
@@ -580,6 +634,28 @@ void log_flush(log tl, status_handler completion)
             msg_err("failed to mark new_ext at %R as free", new_ext->sectors);
   fail_log_destroy:
         log_destroy(new_tl);
+  fail:
+        log_checkpoint_failed(tl, "failed to start log compaction");
+    } else if (checkpoint && (tl->state == TLOG_STATE_FAILED)) {
+        log_checkpoint_failed(tl, "log failure");
+    }
+}
+
+/* Rewrite the log as a checkpoint of the current metadata tree, without the history of changes
+   that led to it, so that a mount parses only the checkpoint and the entries written after it.
+   The completion runs once the rewritten log has replaced the old one; if a compaction is already
+   in progress, it runs when that compaction completes. */
+void log_checkpoint(log tl, status_handler completion)
+{
+    if ((tl->state != TLOG_STATE_LINKED) && (tl->state != TLOG_STATE_COMPACTING)) {
+        log_flush(tl, completion);
+        return;
+    }
+    if (completion)
+        vector_push(tl->checkpoint_completions, completion);
+    if (tl->state == TLOG_STATE_LINKED) {
+        tl->checkpoint = true;
+        log_flush(tl, 0);   /* if a flush is in progress, its completion starts the checkpoint */
     }
 }
 
@@ -940,6 +1016,7 @@ void log_destroy(log tl)
     remove_timer(kernel_timers, &tl->flush_timer, 0);
 #endif
     deallocate_vector(tl->flush_completions);
+    deallocate_vector(tl->checkpoint_completions);
 #ifndef TLOG_READ_ONLY
     deallocate_rangemap(tl->extensions, stack_closure(log_dealloc_ext_node,
         tl));
@@ -123,7 +123,7 @@ vmbus_chan_ins_list(vmbus_dev sc, struct vmbus_channel *chan)
 
 void
 vmbus_chan_open(struct vmbus_channel *chan, int txbr_size, int rxbr_size,
-                const void *udata, int udlen, vmbus_chan_callback_t cb, void *cbarg, queue sched_queue)
+                const void *udata, int udlen, vmbus_chan_callback_t cb, void *cbarg, boolean sched_bh)
 {
     struct vmbus_chan_br cbr;
 
@@ -142,7 +142,7 @@ vmbus_chan_open(struct vmbus_channel *chan, int txbr_size, int rxbr_size,
     cbr.cbr_txsz = txbr_size;
     cbr.cbr_rxsz = rxbr_size;
 
-    vmbus_chan_open_br(chan, &cbr, udata, udlen, cb, cbarg, sched_queue);
+    vmbus_chan_open_br(chan, &cbr, udata, udlen, cb, cbarg, sched_bh);
 }
 
 closure_function(1, 0, void, vmbus_chan_closure,
@@ -154,7 +154,7 @@ closure_function(1, 0, void, vmbus_chan_closure,
 
 int
 vmbus_chan_open_br(struct vmbus_channel *chan, const struct vmbus_chan_br *cbr,
-                   const void *udata, int udlen, vmbus_chan_callback_t cb, void *cbarg, queue sched_queue)
+                   const void *udata, int udlen, vmbus_chan_callback_t cb, void *cbarg, boolean sched_bh)
 {
     vmbus_dev vmbus = chan->ch_vmbus;
 
@@ -179,7 +179,7 @@ vmbus_chan_open_br(struct vmbus_channel *chan, const struct vmbus_chan_br *cbr,
 
     chan->ch_cb = cb;
     chan->ch_cbarg = cbarg;
-    chan->sched_queue = sched_queue;
+    chan->sched_bh = sched_bh;
     vmbus_chan_debug("OPEN_BR, cbarg = %x", chan->ch_cbarg);
 
     vmbus_chan_update_evtflagcnt(vmbus, chan);
@@ -714,7 +714,10 @@ vmbus_event_flags_proc(vmbus_dev sc, volatile u64 *event_flags,
             if (chan->ch_flags & VMBUS_CHAN_FLAG_BATCHREAD)
                 vmbus_rxbr_intr_mask(&chan->ch_rxbr);
             if (!sc->poll_mode) {
-                assert(enqueue_irqsafe(chan->sched_queue, chan->ch_tq));
+                if (chan->sched_bh)
+                    async_apply_bh(chan->ch_tq);
+                else
+                    assert(enqueue_irqsafe(current_cpu()->runqueue, chan->ch_tq));
             } else {
                 apply(chan->ch_tq);
             }
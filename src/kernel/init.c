@@ -142,6 +142,9 @@ closure_function(2, 2, void, fsstarted,
     assert(wrapped_root != INVALID_ADDRESS);
     // XXX use wrapped_root after root fs is separate
     tuple root = filesystem_getroot(root_fs);
+    storage_register_stats(bound(req_handler), sym(root));
+    if (get(root, sym(io_poll)))
+        storage_set_polling(bound(req_handler), true);
     tuple mounts = get_tuple(root, sym(mounts));
     if (mounts)
         storage_set_mountpoints(mounts);
@@ -178,6 +181,7 @@ closure_function(2, 2, void, fsstarted,
     if (!get(root, booted))
         filesystem_write_eav((tfs)fs, root, booted, null_value, false);
     config_console(root);
+    pci_config_irq_affinity(root);
 }
 
 #ifdef MM_DEBUG
@@ -286,7 +290,7 @@ static void rootfs_init(u8 *mbr, u64 offset, storage_req_handler req_handler, u6
     create_filesystem(h,
                       SECTOR_SIZE,
                       length,
-                      closure(h, offset_req_handler, offset, req_handler),
+                      storage_plug_handler(h, closure(h, offset_req_handler, offset, req_handler)),
                       false,
                       false,
                       closure(h, fsstarted, mbr, req_handler));
@@ -296,7 +300,8 @@ closure_function(2, 2, void, volume_fs_init,
                  storage_req_handler, req_handler, u64, length,
                  boolean, readonly, filesystem_complete, complete)
 {
-    create_filesystem(heap_locked(init_heaps), SECTOR_SIZE, bound(length), bound(req_handler),
+    heap h = heap_locked(init_heaps);
+    create_filesystem(h, SECTOR_SIZE, bound(length), storage_plug_handler(h, bound(req_handler)),
                       readonly, 0 /* no label */, complete);
     closure_finish();
 }
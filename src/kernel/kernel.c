@@ -183,6 +183,14 @@ cpuinfo init_cpuinfo(heap backed, int cpu)
     assert(ci->free_process_contexts != INVALID_ADDRESS);
     ci->cpu_queue = allocate_queue(backed, CPU_QUEUE_SIZE);
     assert(ci->cpu_queue != INVALID_ADDRESS);
+    ci->bhqueue = allocate_queue(backed, BHQUEUE_SIZE);
+    assert(ci->bhqueue != INVALID_ADDRESS);
+    ci->runqueue = allocate_queue(backed, RUNQUEUE_SIZE);
+    assert(ci->runqueue != INVALID_ADDRESS);
+    ci->async_queue_1 = allocate_queue(backed, ASYNC_QUEUE_1_SIZE);
+    assert(ci->async_queue_1 != INVALID_ADDRESS);
+    ci->pollqueue = allocate_queue(backed, POLLQUEUE_SIZE);
+    assert(ci->pollqueue != INVALID_ADDRESS);
     ci->last_timer_update = 0;
     ci->frcount = 0;
     ci->mcs_prev = 0;
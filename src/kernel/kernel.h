@@ -60,8 +60,14 @@ extern boolean shutting_down;
 typedef struct sched_task {
     thunk t;
     timestamp runtime;
+    bitmap affinity;    /* CPUs allowed to run the task (0 means any CPU) */
 } *sched_task;
 
+static inline boolean sched_task_cpu_allowed(sched_task task, u64 cpu)
+{
+    return !task->affinity || bitmap_get(task->affinity, cpu);
+}
+
 typedef struct sched_queue {
     pqueue q;
     timestamp min_runtime;
@@ -76,9 +82,21 @@ struct cpuinfo {
     u32 id;
     int state;
     queue cpu_queue;
+    queue bhqueue;          /* kernel from interrupt */
+    queue runqueue;
+    queue async_queue_1;    /* queue of async 1 arg completions */
+    queue pollqueue;        /* self-rescheduling pollers, see async_apply_poll() */
     struct sched_queue thread_queue;
     timestamp last_timer_update;
     u64 frcount;
+
+    /* adaptive halt polling */
+    timestamp haltpoll_interval;
+    timestamp idle_start;
+    boolean haltpolling;
+    u64 haltpoll_success;
+    u64 haltpoll_fail;
+    timestamp haltpoll_time;
     u64 inval_gen; /* Generation number for invalidates */
 
     cpuinfo mcs_prev;
@@ -375,9 +393,6 @@ static inline boolean in_interrupt(void)
     return current_cpu()->state == cpu_interrupt;
 }
 
-extern queue bhqueue;
-extern queue runqueue;
-extern queue async_queue_1;
 extern timerqueue kernel_timers;
 extern thunk timer_interrupt_handler;
 
@@ -399,15 +414,28 @@ static inline void set_platform_timer(timestamp duration)
     apply(platform_timer, duration);
 }
 
+/* Deferred work is queued on the current CPU, so that it completes on the CPU
+   which raised it (e.g. the CPU that took an interrupt). Work meant for another
+   CPU must be handed off explicitly with async_apply_bh_cpu(). */
 static inline void async_apply(thunk t)
 {
     assert(!in_interrupt());
-    assert(enqueue(runqueue, t));
+    assert(enqueue_irqsafe(current_cpu()->runqueue, t));
 }
 
 static inline void async_apply_bh(thunk t)
 {
-    assert(enqueue_irqsafe(bhqueue, t));
+    assert(enqueue_irqsafe(current_cpu()->bhqueue, t));
+}
+
+void async_apply_bh_cpu(u64 cpu, thunk t);
+
+/* The poll queue is serviced once per runloop pass, after the other queues, and only for the items
+   queued before the pass started; a poller that reschedules itself from here (e.g. to reap device
+   completions) thus cannot starve other deferred work, threads or timers. */
+static inline void async_apply_poll(thunk t)
+{
+    assert(enqueue_irqsafe(current_cpu()->pollqueue, t));
 }
 
 typedef closure_type(async_1, void, u64);
@@ -422,7 +450,7 @@ static inline void async_apply_1(void *a, void *arg0)
     struct applied_async_1 aa;
     aa.a = a;
     aa.arg0 = u64_from_pointer(arg0);
-    assert(enqueue_n_irqsafe(async_queue_1, &aa, sizeof(aa) / sizeof(u64)));
+    assert(enqueue_n_irqsafe(current_cpu()->async_queue_1, &aa, sizeof(aa) / sizeof(u64)));
 }
 #define async_apply_status_handler async_apply_1
 
@@ -769,9 +797,8 @@ timestamp kern_now(clock_id id);    /* klibs must use this instead of now() */
 
 void init_clock(void);
 
-void process_bhqueue();
 
-void msi_format(u32 *address, u32 *data, int vector);
+void msi_format(u32 *address, u32 *data, int vector, u32 target_cpu);
 int msi_get_vector(u32 data);
 
 u64 allocate_ipi_interrupt(void);
@@ -791,11 +818,14 @@ void send_ipi(u64 cpu, u8 vector);
 
 void init_scheduler(heap);
 void init_scheduler_cpus(heap h);
+void init_scheduler_config(tuple root);
 void mm_service(void);
 
 boolean sched_queue_init(sched_queue sq, heap h);
 void sched_enqueue(sched_queue sq, sched_task task);
+void sched_thread_enqueue(cpuinfo ci, sched_task task);
 sched_task sched_dequeue(sched_queue sq);
+sched_task sched_dequeue_for_cpu(sched_queue sq, u64 cpu);
 u64 sched_queue_length(sched_queue sq);
 
 static inline boolean sched_queue_empty(sched_queue sq)
@@ -32,6 +32,7 @@ static struct {
     void *initial_map;
     u64 initial_physbase;
     u64 levelmask;              /* bitmap of levels allowed to map */
+    u64 free_tables;            /* list of freed table pages, linked through their first entry */
 } pagemem;
 
 BSS_RO_AFTER_INIT boolean bootstrapping;
@@ -72,6 +73,13 @@ void *allocate_table_page(u64 *phys)
         return p;
     }
     page_init_debug("allocate_table_page:");
+    if (pagemem.free_tables) {
+        *phys = pagemem.free_tables;
+        u64 *p = pointer_from_pteaddr(*phys);
+        pagemem.free_tables = p[0];
+        zero(p, PAGESIZE);
+        return p;
+    }
     if (range_span(pagemem.current_phys) == 0) {
         assert(pagemem.pageheap);
         page_init_debug(" [new alloc, va: ");
@@ -97,6 +105,22 @@ void *allocate_table_page(u64 *phys)
 }
 
 #define PTE_ENTRIES U64_FROM_BIT(9)
+
+/* Return a table page, along with the lower-level tables it references, for reuse by
+   allocate_table_page(); called with lock held */
+static void deallocate_table_page(u64 *tp, u64 phys, int level)
+{
+    if (level < PT_PTE_LEVEL) {
+        for (int i = 0; i < PTE_ENTRIES; i++) {
+            pte e = tp[i];
+            if (pte_is_present(e) && !pte_is_mapping(level, e))
+                deallocate_table_page(pointer_from_pteaddr(page_from_pte(e)), page_from_pte(e),
+                                      level + 1);
+        }
+    }
+    tp[0] = pagemem.free_tables;
+    pagemem.free_tables = phys;
+}
 static boolean recurse_ptes(u64 pbase, int level, u64 vstart, u64 len, u64 laddr, entry_handler ph)
 {
     int shift = pt_level_shift(level);
@@ -226,8 +250,10 @@ closure_function(2, 3, boolean, update_pte_flags,
     return true;
 }
 
-/* Update access protection flags for any pages mapped within a given area */
-void update_map_flags_with_complete(u64 vaddr, u64 length, pageflags flags, status_handler complete)
+/* Update access protection flags for any pages mapped within a given area. Fails, leaving the
+   flags unchanged, if a block mapping straddling the area cannot be split. */
+boolean update_map_flags_with_complete(u64 vaddr, u64 length, pageflags flags,
+                                       status_handler complete)
 {
     flags = pageflags_no_minpage(flags);
     page_debug("%s: vaddr 0x%lx, length 0x%lx, flags 0x%lx\n", __func__, vaddr, length, flags.w);
@@ -235,12 +261,19 @@ void update_map_flags_with_complete(u64 vaddr, u64 length, pageflags flags, stat
     /* Catch any attempt to change page flags in a linear_backed mapping */
     assert(!intersects_linear_backed(irangel(vaddr, length)));
     flush_entry fe = get_page_flush_entry();
+    if (!split_block_mappings(vaddr, length, fe)) {
+        page_invalidate_sync(fe, 0);
+        if (complete)
+            apply(complete, timm("result", "failed to split block mapping"));
+        return false;
+    }
     traverse_ptes(vaddr, length, stack_closure(update_pte_flags, flags, fe));
     page_invalidate_sync(fe, complete);
 #ifdef PAGE_DUMP_ALL
     early_debug("update_map_flags ");
     dump_page_tables(vaddr, length);
 #endif
+    return true;
 }
 
 static boolean map_level(u64 *table_ptr, int level, range v, u64 *p, u64 flags, flush_entry fe);
@@ -285,21 +318,65 @@ closure_function(3, 3, boolean, remap_entry,
    (e.g. to support MREMAP_FIXED in mremap(2) without depending on
    MREMAP_MAYMOVE), write a "traverse_ptes_reverse" to walk pages
    from high address to low (like memcpy).
+   Fails, moving nothing, if a block mapping straddling the old range cannot be split.
 */
-void remap_pages(u64 vaddr_new, u64 vaddr_old, u64 length)
+boolean remap_pages(u64 vaddr_new, u64 vaddr_old, u64 length)
 {
     page_debug("vaddr_new 0x%lx, vaddr_old 0x%lx, length 0x%lx\n", vaddr_new, vaddr_old, length);
     if (vaddr_new == vaddr_old)
-        return;
+        return true;
     assert(range_empty(range_intersection(irange(vaddr_new, vaddr_new + length),
                                           irange(vaddr_old, vaddr_old + length))));
     flush_entry fe = get_page_flush_entry();
-    traverse_ptes(vaddr_old, length, stack_closure(remap_entry, vaddr_new, vaddr_old, fe));
+    boolean split = split_block_mappings(vaddr_old, length, fe);
+    if (split)
+        traverse_ptes(vaddr_old, length, stack_closure(remap_entry, vaddr_new, vaddr_old, fe));
     page_invalidate_sync(fe, 0);
 #ifdef PAGE_DUMP_ALL
     early_debug("remap ");
     dump_page_tables(vaddr_new, length);
 #endif
+    return split;
+}
+
+/* called with lock held */
+closure_function(2, 3, boolean, split_block_entry,
+                 u64, vaddr, flush_entry, fe,
+                 int, level, u64, addr, pteptr, entry)
+{
+    pte e = pte_from_pteptr(entry);
+    if (level == PT_PTE_LEVEL || !pte_is_present(e) || !pte_is_mapping(level, e) ||
+        addr == bound(vaddr))
+        return true;
+
+    /* replace the block with a table mapping the same pages; the traversal then descends into
+       the new table, where any smaller block containing vaddr is split in turn */
+    u64 tp_phys;
+    u64 *tp = allocate_table_page(&tp_phys);
+    if (tp == INVALID_ADDRESS)
+        return false;
+    u64 p = page_from_pte(e);
+    if (!map_level(tp, level + 1, irangel(addr, pte_map_size(level, e)), &p, flags_from_pte(e), 0)) {
+        deallocate_table_page(tp, tp_phys, level + 1);
+        return false;
+    }
+#ifdef PAGE_UPDATE_DEBUG
+    page_debug("level %d, addr 0x%lx, entry 0x%lx, split at 0x%lx\n", level, addr, e, bound(vaddr));
+#endif
+    pte_set(entry, new_level_pte(tp_phys));
+    page_invalidate(bound(fe), addr);
+    return true;
+}
+
+/* Demote any block mapping which straddles either end of the range, so that the range can be
+   unmapped or updated without affecting its surroundings. Returns false if a page table page
+   cannot be allocated, in which case the range must not be operated on. */
+boolean split_block_mappings(u64 vaddr, u64 length, flush_entry fe)
+{
+    if (!traverse_ptes(vaddr, PAGESIZE, stack_closure(split_block_entry, vaddr, fe)))
+        return false;
+    u64 end = vaddr + length;
+    return !end || traverse_ptes(end, PAGESIZE, stack_closure(split_block_entry, end, fe));
 }
 
 /* called with lock held */
@@ -345,17 +422,21 @@ closure_function(2, 3, boolean, unmap_page,
 }
 
 /* Be warned: the page table lock is held when rh is called; don't try
-   to modify the page table while traversing it */
-void unmap_pages_with_handler(u64 virtual, u64 length, range_handler rh)
+   to modify the page table while traversing it. Fails, unmapping nothing, if a block mapping
+   straddling the range cannot be split. */
+boolean unmap_pages_with_handler(u64 virtual, u64 length, range_handler rh)
 {
     assert(!((virtual & PAGEMASK) || (length & PAGEMASK)));
     flush_entry fe = get_page_flush_entry();
-    traverse_ptes(virtual, length, stack_closure(unmap_page, rh, fe));
+    boolean split = split_block_mappings(virtual, length, fe);
+    if (split)
+        traverse_ptes(virtual, length, stack_closure(unmap_page, rh, fe));
     page_invalidate_sync(fe, 0);
 #ifdef PAGE_DUMP_ALL
     early_debug("unmap ");
     dump_page_tables(virtual, length);
 #endif
+    return split;
 }
 
 #define next_addr(a, mask) (a = (a + (mask) + 1) & ~(mask))
@@ -512,6 +593,31 @@ physical map_with_complete(u64 v, physical p, u64 length, pageflags flags, statu
     return p - length;
 }
 
+/* Map the naturally aligned range [v, v + length) with a single entry at the level whose mapping
+ * size is length (or with smaller mappings where that level is not allowed), only if no part of
+ * the range is already mapped. Returns false, leaving the page tables untouched, otherwise. */
+boolean map_block(u64 v, physical p, u64 length, pageflags flags)
+{
+    assert(((v | p) & (length - 1)) == 0);
+    boolean mapped = false;
+    pagetable_lock();
+    u64 *table_ptr = pointer_from_pteaddr(get_pagetable_base(v));
+    for (int level = PT_FIRST_LEVEL; level <= PT_PTE_LEVEL; level++) {
+        int shift = pt_level_shift(level);
+        pte e = table_ptr[(v >> shift) & INDEX_MASK];
+        if (!pte_is_present(e)) {
+            mapped = map_level(pointer_from_pteaddr(get_pagetable_base(v)), PT_FIRST_LEVEL,
+                               irangel(v, length), &p, pageflags_no_minpage(flags).w, 0);
+            break;
+        }
+        if (pte_is_mapping(level, e) || U64_FROM_BIT(shift) <= length)
+            break;
+        table_ptr = pointer_from_pteaddr(page_from_pte(e));
+    }
+    pagetable_unlock();
+    return mapped;
+}
+
 /* Set up a mapping, like the map() function but without acquiring the page table lock; this
  * function is meant to be called by init code, when there is only one CPU running. */
 void map_nolock(u64 v, physical p, u64 length, pageflags flags)
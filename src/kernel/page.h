@@ -39,25 +39,28 @@ static inline void map(u64 v, physical p, u64 length, pageflags flags)
 }
 
 void map_nolock(u64 v, physical p, u64 length, pageflags flags);
+boolean map_block(u64 v, physical p, u64 length, pageflags flags);
 
-void update_map_flags_with_complete(u64 vaddr, u64 length, pageflags flags, status_handler complete);
+boolean update_map_flags_with_complete(u64 vaddr, u64 length, pageflags flags,
+                                       status_handler complete);
 
-static inline void update_map_flags(u64 vaddr, u64 length, pageflags flags)
+static inline boolean update_map_flags(u64 vaddr, u64 length, pageflags flags)
 {
-    update_map_flags_with_complete(vaddr, length, flags, 0);
+    return update_map_flags_with_complete(vaddr, length, flags, 0);
 }
 
 /* overwrite any existing mappings in the virtual address range */
 void remap(u64 v, physical p, u64 length, pageflags flags);
 
 void zero_mapped_pages(u64 vaddr, u64 length);
-void remap_pages(u64 vaddr_new, u64 vaddr_old, u64 length);
+boolean remap_pages(u64 vaddr_new, u64 vaddr_old, u64 length);
 void unmap(u64 virtual, u64 length);
-void unmap_pages_with_handler(u64 virtual, u64 length, range_handler rh);
+boolean unmap_pages_with_handler(u64 virtual, u64 length, range_handler rh);
+boolean split_block_mappings(u64 vaddr, u64 length, flush_entry fe);
 
-static inline void unmap_pages(u64 virtual, u64 length)
+static inline boolean unmap_pages(u64 virtual, u64 length)
 {
-    unmap_pages_with_handler(virtual, length, 0);
+    return unmap_pages_with_handler(virtual, length, 0);
 }
 
 #include <page_machine.h>
@@ -1,5 +1,4 @@
 /* TODO:
-   - keep refault stats
    - interface to physical free page list / shootdown epochs
 
    - would be nice to propagate a priority alone with requests to
@@ -61,6 +60,11 @@ static inline range byte_range_from_page(pagecache pc, pagecache_page pp)
     return range_lshift(irangel(page_offset(pp), 1), pc->page_order);
 }
 
+static inline u64 folio_pages(pagecache pc)
+{
+    return PAGECACHE_FOLIO_SIZE >> pc->page_order;
+}
+
 static inline void pagelist_enqueue(pagelist pl, pagecache_page pp)
 {
     list_insert_before(&pl->l, &pp->l);
@@ -85,6 +89,36 @@ static inline void pagelist_touch(pagelist pl, pagecache_page pp)
     list_insert_before(&pl->l, &pp->l);
 }
 
+static inline boolean page_filled(pagecache_page pp)
+{
+    return page_state(pp) >= PAGECACHE_PAGESTATE_NEW;
+}
+
+static inline void page_ref(pagecache_page pp)
+{
+    fetch_and_add_32((u32 *)&pp->refcount, 1);
+}
+
+/* Lock-free cache hit: if the page is filled, take a reference on it and mark it as referenced
+ * instead of moving it between page lists; the LRU order is updated in bulk when pages are
+ * balanced or evicted. The node lock must be held, so that a page which has been freed (refcount
+ * zero) cannot be reallocated concurrently. */
+static boolean page_get_if_filled(pagecache_page pp)
+{
+    if (!page_filled(pp))
+        return false;
+    u32 *rc = (u32 *)&pp->refcount;
+    u32 c;
+    do {
+        c = *rc;
+        if (c == 0)
+            return false;
+    } while (!compare_and_swap_32(rc, c, c + 1));
+    if (!pp->referenced)
+        pp->referenced = true;
+    return true;
+}
+
 #ifdef KERNEL
 static inline void pagecache_lock(pagecache pc)
 {
@@ -151,11 +185,16 @@ static inline void change_page_state_locked(pagecache pc, pagecache_page pp, int
     case PAGECACHE_PAGESTATE_FREE:
         if (old_state == PAGECACHE_PAGESTATE_NEW) {
             pagelist_move(&pc->free, &pc->new, pp);
+            pp->evicted_active = false;
+            pp->eviction = ++pc->evictions;
         } else if (old_state == PAGECACHE_PAGESTATE_ACTIVE) {
             pagelist_move(&pc->free, &pc->active, pp);
+            pp->evicted_active = true;
+            pp->eviction = ++pc->evictions;
         } else {
             assert(old_state == PAGECACHE_PAGESTATE_ALLOC);
             pagelist_enqueue(&pc->free, pp);
+            pp->eviction = 0;
         }
         break;
     case PAGECACHE_PAGESTATE_ALLOC:
@@ -208,6 +247,10 @@ static inline void change_page_state_locked(pagecache pc, pagecache_page pp, int
     default:
         halt("%s: bad state %d, old %d\n", __func__, state, old_state);
     }
+    if (state == PAGECACHE_PAGESTATE_DIRTY && old_state != PAGECACHE_PAGESTATE_DIRTY)
+        pc->dirty_pages++;
+    else if (old_state == PAGECACHE_PAGESTATE_DIRTY && state != PAGECACHE_PAGESTATE_DIRTY)
+        pc->dirty_pages--;
 
     pp->state_offset = (pp->state_offset & MASK(PAGECACHE_PAGESTATE_SHIFT)) |
         ((u64)state << PAGECACHE_PAGESTATE_SHIFT);
@@ -238,19 +281,89 @@ static void enqueue_page_completion_statelocked(pagecache pc, pagecache_page pp,
     list_push_back(l, &c->l);
 }
 
+/* Returns the memory of page pi within the folio, or INVALID_ADDRESS if the folio memory has
+   been released. */
+static void *folio_back_locked(pagecache pc, pagecache_folio f, u64 pi)
+{
+    if (f->kvirt == INVALID_ADDRESS)
+        return INVALID_ADDRESS;
+    f->backed++;
+    return f->kvirt + ((pi & (folio_pages(pc) - 1)) << pc->page_order);
+}
+
+static void folio_unback_locked(pagecache pc, pagecache_folio f)
+{
+    assert(f->backed > 0);
+    if (--f->backed == 0) {
+        deallocate(pc->folio_heap, f->kvirt, PAGECACHE_FOLIO_SIZE);
+        f->kvirt = INVALID_ADDRESS;
+        fetch_and_add(&pc->folios, -1);
+        pc->folios_released++;
+    }
+}
+
+static void folio_put_locked(pagecache pc, pagecache_folio f)
+{
+    if (--f->members > 0)
+        return;
+    if (f->kvirt != INVALID_ADDRESS) {
+        deallocate(pc->folio_heap, f->kvirt, PAGECACHE_FOLIO_SIZE);
+        fetch_and_add(&pc->folios, -1);
+        pc->folios_released++;
+    }
+    deallocate(pc->h, f, sizeof(*f));
+}
+
+/* The refault distance of a freed page is the number of evictions since its own. If it is no
+   larger than the active list, the page would still be resident had it been activated, so it
+   is promoted on the next scan. Refaults within the size of the cache also move the active
+   target towards the list that the page was evicted from. */
+static void page_refault_locked(pagecache pc, pagecache_page pp)
+{
+    if (!pp->eviction)
+        return;
+    u64 distance = pc->evictions - pp->eviction;
+    pagecache_debug("%s: pp %p, distance %ld, evicted from %s\n", __func__, pp, distance,
+                    pp->evicted_active ? "active" : "new");
+    pc->refaults++;
+    if (distance <= pc->active.pages) {
+        pp->referenced = true;
+        pc->refault_activations++;
+    }
+    if (distance <= pc->total_pages) {
+        if (pp->evicted_active) {
+            if (pc->active_target < PAGECACHE_ACTIVE_MAX)
+                pc->active_target++;
+        } else if (pc->active_target > pc->active_min) {
+            pc->active_target--;
+        }
+    }
+    pp->eviction = 0;
+}
+
 static boolean realloc_pagelocked(pagecache pc, pagecache_page pp)
 {
     pagecache_debug("%s: pc %p pp %p refcount %d state %d\n", __func__, pc, pp, pp->refcount, page_state(pp));
-    pp->kvirt = allocate(pc->contiguous, U64_FROM_BIT(pc->page_order));
+    pp->kvirt = INVALID_ADDRESS;
+    if (pp->folio) {
+        pp->kvirt = folio_back_locked(pc, pp->folio, page_offset(pp));
+        if (pp->kvirt == INVALID_ADDRESS) {
+            folio_put_locked(pc, pp->folio);
+            pp->folio = 0;
+        }
+    }
+    if (pp->kvirt == INVALID_ADDRESS)
+        pp->kvirt = allocate(pc->contiguous, U64_FROM_BIT(pc->page_order));
     if (pp->kvirt == INVALID_ADDRESS) {
         return false;
     }
-    assert(pp->refcount++ == 0);
+    assert(fetch_and_add_32((u32 *)&pp->refcount, 1) == 0);
     pp->write_count = 0;
     #ifdef KERNEL
     pp->phys = physical_from_virtual(pp->kvirt);
     #endif
     fetch_and_add(&pc->total_pages, 1);
+    page_refault_locked(pc, pp);
     change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_ALLOC);
     pp->evicted = false;
     return true;
@@ -287,13 +400,9 @@ static boolean touch_page_locked(pagecache_node pn, pagecache_page pp, merge m)
         change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_READING);
         return false;
     case PAGECACHE_PAGESTATE_ACTIVE:
-        /* move to bottom of active list */
-        list_delete(&pp->l);
-        list_insert_before(&pc->active.l, &pp->l);
-        break;
     case PAGECACHE_PAGESTATE_NEW:
-        /* cache hit -> active */
-        change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_ACTIVE);
+        /* cache hit: new pages are moved to the active list on the next scan */
+        pp->referenced = true;
         break;
     }
     return true;
@@ -330,13 +439,15 @@ static boolean touch_or_fill_page_nodelocked(pagecache_node pn, pagecache_page p
     pagecache pc = pv->pc;
     range r;
 
+    if (page_get_if_filled(pp))
+        return true;
     pagecache_lock_state(pc);
     pagecache_debug("%s: pn %p, pp %p, m %p, state %d\n", __func__, pn, pp, m, page_state(pp));
     switch (page_state(pp)) {
     case PAGECACHE_PAGESTATE_READING:
         if (m) {
             enqueue_page_completion_statelocked(pc, pp, apply_merge(m));
-            pp->refcount++;
+            page_ref(pp);
         }
         pagecache_unlock_state(pc);
         return false;
@@ -359,7 +470,7 @@ static boolean touch_or_fill_page_nodelocked(pagecache_node pn, pagecache_page p
                 zero(pp->kvirt, cache_pagesize(pc));
                 change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_NEW);
             }
-            pp->refcount++;
+            page_ref(pp);
         } else {
             r = irange(0, 0);
         }
@@ -380,13 +491,8 @@ static boolean touch_or_fill_page_nodelocked(pagecache_node pn, pagecache_page p
         }
         return true;
     case PAGECACHE_PAGESTATE_ACTIVE:
-        /* move to bottom of active list */
-        list_delete(&pp->l);
-        list_insert_before(&pc->active.l, &pp->l);
-        break;
     case PAGECACHE_PAGESTATE_NEW:
-        /* cache hit -> active */
-        change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_ACTIVE);
+        pp->referenced = true;
         break;
     case PAGECACHE_PAGESTATE_WRITING:
     case PAGECACHE_PAGESTATE_DIRTY:
@@ -394,7 +500,7 @@ static boolean touch_or_fill_page_nodelocked(pagecache_node pn, pagecache_page p
     default:
         halt("%s: invalid state %d\n", __func__, page_state(pp));
     }
-    pp->refcount++;
+    page_ref(pp);
     pagecache_unlock_state(pc);
     return true;
 }
@@ -410,22 +516,27 @@ static void pagecache_page_delete_locked(pagecache pc, pagecache_page pp)
     if (!pagecache_trylock_node(pn))
         return;
 
-    rbtree_remove_node(&pn->pages, &pp->rbnode);
+    assert(radix_remove(&pn->pages, page_offset(pp)) == pp);
     pagecache_unlock_node(pn);
     pagelist_remove(&pc->free, pp);
+    if (pp->folio)
+        folio_put_locked(pc, pp->folio);
     deallocate(pc->pp_heap, pp, sizeof(*pp));
 }
 
 static void pagecache_page_release_locked(pagecache pc, pagecache_page pp, boolean full_delete)
 {
-    if (--pp->refcount > 0)
+    if (fetch_and_add_32((u32 *)&pp->refcount, -1) > 1)
         return;
     pagecache_debug("%s: pp %p state %d\n", __func__, pp, page_state(pp));
     assert(pp->write_count == 0);
     assert(pp->read_refcount.c == 0);
 
     change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_FREE);
-    deallocate(pc->contiguous, pp->kvirt, cache_pagesize(pc));
+    if (pp->folio)
+        folio_unback_locked(pc, pp->folio);
+    else
+        deallocate(pc->contiguous, pp->kvirt, cache_pagesize(pc));
     pp->kvirt = INVALID_ADDRESS;
     pp->phys = INVALID_PHYSICAL;
     u64 pre = fetch_and_add(&pc->total_pages, -1);
@@ -444,12 +555,81 @@ define_closure_function(2, 0, void, pagecache_page_read_release,
     pagecache_unlock_state(pc);
 }
 
-static pagecache_page allocate_page_nodelocked(pagecache_node pn, u64 offset)
+/* Drop a reference without taking the state lock, unless it may be the last one. */
+static void pagecache_page_put(pagecache pc, pagecache_page pp)
+{
+    u32 *rc = (u32 *)&pp->refcount;
+    u32 c;
+    while ((c = *rc) > 1) {
+        if (compare_and_swap_32(rc, c, c - 1))
+            return;
+    }
+    pagecache_lock_state(pc);
+    pagecache_page_release_locked(pc, pp, false);
+    pagecache_unlock_state(pc);
+}
+
+static boolean node_folio_capable(pagecache_node pn, u64 pi)
+{
+    pagecache pc = pn->pv->pc;
+    if (!pc->folio_heap || pn->length < PAGECACHE_FOLIO_MIN_LENGTH)
+        return false;
+    u64 end = (pi & ~(folio_pages(pc) - 1)) + folio_pages(pc);
+    return (end << pc->page_order) <= pn->length;
+}
+
+/* Returns the folio of the group containing page pi, or zero if the page is not to be part of a
+   folio. A folio is allocated only if none of the pages in the group exist yet and the group is
+   entirely within fill, the pages that the caller is about to populate; a small random access thus
+   doesn't pin a whole folio. */
+static pagecache_folio page_folio_nodelocked(pagecache_node pn, u64 pi, range fill)
+{
+    pagecache pc = pn->pv->pc;
+    if (!node_folio_capable(pn, pi))
+        return 0;
+    u64 first = pi & ~(folio_pages(pc) - 1);
+    u64 index = first;
+    pagecache_page pp = radix_lookup_next(&pn->pages, &index);
+    if (pp != INVALID_ADDRESS && index < first + folio_pages(pc))
+        return pp->folio;
+    if (!range_contains(fill, irangel(first, folio_pages(pc))))
+        return 0;
+    pagecache_folio f = allocate(pc->h, sizeof(*f));
+    if (f == INVALID_ADDRESS)
+        return 0;
+    f->kvirt = allocate(pc->folio_heap, PAGECACHE_FOLIO_SIZE);
+    if (f->kvirt == INVALID_ADDRESS) {
+        deallocate(pc->h, f, sizeof(*f));
+        return 0;
+    }
+#ifdef KERNEL
+    f->phys = physical_from_virtual(f->kvirt);
+#endif
+    f->backed = 0;
+    f->members = 0;
+    fetch_and_add(&pc->folios, 1);
+    pagecache_debug("%s: node %p, group 0x%lx, folio %p, phys 0x%lx\n", __func__, pn, first,
+                    f->kvirt, f->phys);
+    return f;
+}
+
+static pagecache_page allocate_page_nodelocked(pagecache_node pn, u64 offset, range fill)
 {
-    /* allocate - later we can look at blocks of pages at a time */
     pagecache pc = pn->pv->pc;
     u64 pagesize = U64_FROM_BIT(pc->page_order);
-    void *p = allocate(pc->contiguous, pagesize);
+    void *p = INVALID_ADDRESS;
+    pagecache_folio f = page_folio_nodelocked(pn, offset, fill);
+    if (f) {
+        pagecache_lock_state(pc);
+        p = folio_back_locked(pc, f, offset);
+        if (p != INVALID_ADDRESS)
+            f->members++;
+        pagecache_unlock_state(pc);
+        if (p == INVALID_ADDRESS)
+            f = 0;
+    }
+    if (p == INVALID_ADDRESS)
+        p = allocate(pc->contiguous, pagesize);
     if (p == INVALID_ADDRESS)
         return INVALID_ADDRESS;
 
@@ -457,7 +637,6 @@ static pagecache_page allocate_page_nodelocked(pagecache_node pn, u64 offset)
     if (pp == INVALID_ADDRESS)
         goto fail_dealloc_contiguous;
 
-    init_rbnode(&pp->rbnode);
     pp->refcount = 1;
     init_refcount(&pp->read_refcount, 0,
                   init_closure(&pp->read_release, pagecache_page_read_release, pc, pp));
@@ -468,53 +647,131 @@ static pagecache_page allocate_page_nodelocked(pagecache_node pn, u64 offset)
     pp->node = pn;
     pp->l.next = pp->l.prev = 0;
     pp->evicted = false;
+    pp->referenced = false;
+    pp->eviction = 0;
+    pp->folio = f;
 #ifdef KERNEL
     pp->phys = physical_from_virtual(p);
 #endif
     list_init(&pp->bh_completions);
-    assert(rbtree_insert_node(&pn->pages, &pp->rbnode));
+    if (!radix_insert(&pn->pages, offset, pp))
+        goto fail_dealloc_pp;
     fetch_and_add(&pc->total_pages, 1); /* decrement happens without cache lock */
     return pp;
+  fail_dealloc_pp:
+    deallocate(pc->pp_heap, pp, sizeof(*pp));
   fail_dealloc_contiguous:
-    deallocate(pc->contiguous, p, pagesize);
+    if (f) {
+        pagecache_lock_state(pc);
+        folio_unback_locked(pc, f);
+        folio_put_locked(pc, f);
+        pagecache_unlock_state(pc);
+    } else {
+        deallocate(pc->contiguous, p, pagesize);
+    }
     return INVALID_ADDRESS;
 }
 
 #ifndef PAGECACHE_READ_ONLY
+/* Folio memory is freed only when none of its pages is backed any more: along with pp, evict the
+   other pages of its folio that are idle. Returns the number of pages whose memory has been freed,
+   and advances *next past any page evicted here. */
+static u64 evict_folio_locked(pagecache pc, pagecache_page pp, list *next)
+{
+    pagecache_folio f = pp->folio;
+    pagecache_node pn = pp->node;
+    pp->evicted = true;
+    pagecache_page_release_locked(pc, pp, false);
+    if ((f->kvirt != INVALID_ADDRESS) && pagecache_trylock_node(pn)) {
+        u64 first = page_offset(pp) & ~(folio_pages(pc) - 1);
+        u64 index = first;
+        pagecache_page sp;
+        while ((f->kvirt != INVALID_ADDRESS) &&
+               ((sp = radix_lookup_next(&pn->pages, &index)) != INVALID_ADDRESS) &&
+               (index < first + folio_pages(pc))) {
+            index++;
+            int state = page_state(sp);
+            if ((sp->folio != f) || sp->evicted || sp->referenced || (sp->refcount != 1) ||
+                ((state != PAGECACHE_PAGESTATE_NEW) && (state != PAGECACHE_PAGESTATE_ACTIVE)))
+                continue;
+            if (&sp->l == *next)
+                *next = sp->l.next;
+            sp->evicted = true;
+            pagecache_page_release_locked(pc, sp, false);
+        }
+        pagecache_unlock_node(pn);
+    }
+    return (f->kvirt == INVALID_ADDRESS) ? folio_pages(pc) : 0;
+}
+
+/* Returns the number of pages whose memory has been freed. */
 static u64 evict_from_list_locked(pagecache pc, struct pagelist *pl, u64 pages)
 {
     u64 evicted = 0;
-    list_foreach(&pl->l, l) {
-        if (evicted >= pages)
-            break;
-
+    list next;
+    for (list l = list_begin(&pl->l); (l != list_end(&pl->l)) && (evicted < pages); l = next) {
+        next = l->next;
         pagecache_page pp = struct_from_list(l, pagecache_page, l);
         if (pp->evicted)
             continue;
+        if (pp->referenced) {
+            /* second chance: referenced new pages become active */
+            pp->referenced = false;
+            if (pl == &pc->new)
+                change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_ACTIVE);
+            continue;
+        }
         assert(pp->refcount != 0);
         pagecache_debug("%s: list %s, release pp %p - %R, state %d, count %ld\n", __func__,
                         pl == &pc->new ? "new" : "active", pp, byte_range_from_page(pc, pp),
                         page_state(pp), pp->refcount);
+        if (pp->folio) {
+            evicted += evict_folio_locked(pc, pp, &next);
+            continue;
+        }
         pp->evicted = true;
-        pagecache_page_release_locked(pc, pp, true);
+        pagecache_page_release_locked(pc, pp, false);
         evicted++;
     }
     return evicted;
 }
 
+/* Freed pages are kept as ghost entries for refault detection, up to the number of resident
+   pages; the oldest are deleted first. */
+static void trim_ghost_pages_locked(pagecache pc)
+{
+    list_foreach(&pc->free.l, l) {
+        if (pc->free.pages <= pc->total_pages)
+            break;
+        pagecache_page_delete_locked(pc, struct_from_list(l, pagecache_page, l));
+    }
+}
+
 static void balance_page_lists_locked(pagecache pc)
 {
-    /* balance active and new lists */
-    s64 dp = ((s64)pc->active.pages - (s64)pc->new.pages) / 2;
-    pagecache_debug("%s: active %ld, new %ld, dp %ld\n", __func__, pc->active.pages, pc->new.pages, dp);
+    /* promote new pages that have been hit since the last scan */
+    list_foreach(&pc->new.l, l) {
+        pagecache_page pp = struct_from_list(l, pagecache_page, l);
+        if (pp->referenced) {
+            pp->referenced = false;
+            change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_ACTIVE);
+        }
+    }
+
+    /* Demote pages from the active list only down to the active target, so that a large scan,
+       which doesn't refault, cycles through the new list without displacing the working set. */
+    u64 resident = pc->active.pages + pc->new.pages;
+    s64 dp = (s64)pc->active.pages - (s64)(resident * pc->active_target / 100);
+    pagecache_debug("%s: active %ld, new %ld, target %ld%%, dp %ld\n", __func__,
+                    pc->active.pages, pc->new.pages, pc->active_target, dp);
     list_foreach(&pc->active.l, l) {
         if (dp <= 0)
             break;
         pagecache_page pp = struct_from_list(l, pagecache_page, l);
-        /* We don't presently have a notion of "time" in the cache, so
-           just cull unreferenced buffers in LRU fashion until active
-           pages are equivalent to new...loosely inspired by linux
-           approach. */
+        if (pp->referenced) {
+            pp->referenced = false;
+            continue;
+        }
         if (pp->refcount == 1) {
             pagecache_debug("   pp %R -> new\n", byte_range_from_page(pc, pp));
             change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_NEW);
@@ -525,16 +782,21 @@ static void balance_page_lists_locked(pagecache pc)
 
 static pagecache_page page_lookup_nodelocked(pagecache_node pn, u64 n)
 {
-    struct pagecache_page k;
-    k.state_offset = n;
-    return (pagecache_page)rbtree_lookup(&pn->pages, &k.rbnode);
+    return radix_lookup(&pn->pages, n);
+}
+
+/* Also used without the node lock on a range of pages which are all referenced. */
+static pagecache_page page_next_nodelocked(pagecache_node pn, pagecache_page pp)
+{
+    u64 index = page_offset(pp) + 1;
+    return radix_lookup_next(&pn->pages, &index);
 }
 
 static pagecache_page page_lookup_or_alloc_nodelocked(pagecache_node pn, u64 n)
 {
     pagecache_page pp = page_lookup_nodelocked(pn, n);
     if (pp == INVALID_ADDRESS)
-        pp = allocate_page_nodelocked(pn, n);
+        pp = allocate_page_nodelocked(pn, n, irangel(n, 1));
     return pp;
 }
 
@@ -548,6 +810,51 @@ static pagecache_page touch_or_fill_page_by_num_nodelocked(pagecache_node pn, u6
     return pp;
 }
 
+#ifdef KERNEL
+static inline u64 pagecache_dirty_total(pagecache pc)
+{
+    return pc->dirty_pages + pc->writing.pages;
+}
+
+/* Start a writeback pass unless one is in progress. Passes follow each other while dirty pages
+   are above the background threshold or, if flush is set, until no dirty data is left. */
+static void pagecache_start_writeback(pagecache pc, boolean flush)
+{
+    pagecache_lock_state(pc);
+    boolean start = !pc->writeback_in_progress;
+    pc->writeback_in_progress = true;
+    if (flush)
+        pc->writeback_flush = true;
+    pagecache_unlock_state(pc);
+    if (start)
+        async_apply_status_handler((status_handler)&pc->writeback_pass, STATUS_OK);
+}
+
+/* Resume throttled writers once dirty and writing pages are back under the limit, or if there is
+   no writeback left which could bring them there (e.g. after a write error). */
+static void pagecache_release_throttled_writes(pagecache pc)
+{
+    struct list l;
+    if (list_empty(&pc->throttled_writes))
+        return;
+    pagecache_lock_state(pc);
+    if (list_empty(&pc->throttled_writes) ||
+        ((pagecache_dirty_total(pc) > pc->dirty_limit_pages) &&
+         (pc->writing.pages > 0 || pc->writeback_in_progress))) {
+        pagecache_unlock_state(pc);
+        return;
+    }
+    list_move(&l, &pc->throttled_writes);
+    pagecache_unlock_state(pc);
+    list_foreach(&l, e) {
+        page_completion c = struct_from_list(e, page_completion, l);
+        list_delete(e);
+        async_apply_status_handler(c->sh, STATUS_OK);
+        deallocate(pc->completions, c, sizeof(*c));
+    }
+}
+#endif
+
 /* called with node locked */
 static boolean pagecache_set_dirty(pagecache_node pn, range r)
 {
@@ -635,7 +942,7 @@ closure_function(6, 1, void, pagecache_write_sg_finish,
         pagecache_unlock_state(pc);
         offset = 0;
         bound(pi)++;
-        pp = (pagecache_page)rbnode_get_next((rbnode)pp);
+        pp = page_next_nodelocked(pn, pp);
     } while (bound(pi) < end);
     if ((bound(pi) == end) && !pagecache_set_dirty(pn, r))
         s = timm("result", "failed to add dirty range");
@@ -643,6 +950,8 @@ closure_function(6, 1, void, pagecache_write_sg_finish,
 #ifdef KERNEL
     if (saved_ctx)
         clear_fault_handler();
+    if (!pc->writeback_in_progress && (pc->dirty_pages > pc->dirty_background_pages))
+        pagecache_start_writeback(pc, false);
 #endif
     if (bound(pi) < end)
         return;
@@ -655,11 +964,24 @@ closure_function(6, 1, void, pagecache_write_sg_finish,
 #endif
 }
 
-closure_function(1, 3, void, pagecache_write_sg,
-                 pagecache_node, pn,
-                 sg_list, sg, range, q, status_handler, completion)
+static void pagecache_write_sg_internal(pagecache_node pn, sg_list sg, range q,
+                                        status_handler completion, context ctx, boolean throttle);
+
+#ifdef KERNEL
+closure_function(5, 1, void, pagecache_write_sg_resume,
+                 pagecache_node, pn, sg_list, sg, range, q, status_handler, completion, context, ctx,
+                 status, s)
+{
+    /* don't throttle again, so that a resumed write makes progress */
+    pagecache_write_sg_internal(bound(pn), bound(sg), bound(q), bound(completion), bound(ctx),
+                                false);
+    closure_finish();
+}
+#endif
+
+static void pagecache_write_sg_internal(pagecache_node pn, sg_list sg, range q,
+                                        status_handler completion, context ctx, boolean throttle)
 {
-    pagecache_node pn = bound(pn);
     pagecache_volume pv = pn->pv;
     pagecache pc = pv->pc;
     pagecache_debug("%s: node %p, q %R, sg %p, completion %F, from %p\n", __func__,
@@ -676,6 +998,28 @@ closure_function(1, 3, void, pagecache_write_sg,
         return;
     }
 
+#ifdef KERNEL
+    /* Above the dirty limit, defer the write until writeback catches up. */
+    if (throttle && (pagecache_dirty_total(pc) > pc->dirty_limit_pages)) {
+        page_completion c = allocate(pc->completions, sizeof(*c));
+        if (c != INVALID_ADDRESS) {
+            c->sh = closure(pc->h, pagecache_write_sg_resume, pn, sg, q, completion, ctx);
+            if (c->sh != INVALID_ADDRESS) {
+                pagecache_debug("   throttled, dirty %ld, writing %ld\n", pc->dirty_pages,
+                                pc->writing.pages);
+                pagecache_lock_state(pc);
+                list_push_back(&pc->throttled_writes, &c->l);
+                pc->throttled++;
+                pagecache_unlock_state(pc);
+                pagecache_start_writeback(pc, false);
+                pagecache_release_throttled_writes(pc);
+                return;
+            }
+            deallocate(pc->completions, c, sizeof(*c));
+        }
+    }
+#endif
+
     u64 start_offset = q.start & MASK(pc->page_order);
     u64 end_offset = q.end & MASK(pc->page_order);
     range r = range_rshift(q, pc->page_order);
@@ -688,13 +1032,6 @@ closure_function(1, 3, void, pagecache_write_sg,
         }
     }
 
-    context ctx;
-#ifdef KERNEL
-    ctx = get_current_context(current_cpu());
-#else
-    ctx = 0;
-#endif
-
     /* prepare pages for writing */
     merge m = allocate_merge(pc->h, closure(pc->h, pagecache_write_sg_finish, pn, q,
                                             q.start >> pc->page_order, sg, completion, ctx));
@@ -719,7 +1056,7 @@ closure_function(1, 3, void, pagecache_write_sg,
     for (u64 pi = r.start; pi < r.end; pi++) {
         pagecache_page pp = page_lookup_nodelocked(pn, pi);
         if (pp == INVALID_ADDRESS) {
-            pp = allocate_page_nodelocked(pn, pi);
+            pp = allocate_page_nodelocked(pn, pi, r);
             if (pp == INVALID_ADDRESS) {
                 pagecache_unlock_node(pn);
                 const char *err = "failed to allocate pagecache_page";
@@ -742,7 +1079,7 @@ closure_function(1, 3, void, pagecache_write_sg,
         pagecache_lock_state(pc);
         if (page_state(pp) == PAGECACHE_PAGESTATE_FREE)
             realloc_pagelocked(pc, pp);
-        pp->refcount++;
+        page_ref(pp);
         if (page_state(pp) == PAGECACHE_PAGESTATE_READING)
             enqueue_page_completion_statelocked(pc, pp, apply_merge(m));
         pagecache_unlock_state(pc);
@@ -756,6 +1093,19 @@ closure_function(1, 3, void, pagecache_write_sg,
     apply(sh, STATUS_OK);
 }
 
+closure_function(1, 3, void, pagecache_write_sg,
+                 pagecache_node, pn,
+                 sg_list, sg, range, q, status_handler, completion)
+{
+    context ctx;
+#ifdef KERNEL
+    ctx = get_current_context(current_cpu());
+#else
+    ctx = 0;
+#endif
+    pagecache_write_sg_internal(bound(pn), sg, q, completion, ctx, true);
+}
+
 /* evict pages from new and active lists, then rebalance */
 static u64 evict_pages_locked(pagecache pc, u64 pages)
 {
@@ -766,6 +1116,7 @@ static u64 evict_pages_locked(pagecache pc, u64 pages)
            active list. */
         evicted += evict_from_list_locked(pc, &pc->active, pages - evicted);
     }
+    trim_ghost_pages_locked(pc);
     return evicted;
 }
 
@@ -784,9 +1135,14 @@ u64 pagecache_drain(u64 drain_bytes)
 
     pagecache_lock_state(pc);
     do {
+        u64 folios_released = pc->folios_released;
         u64 evicted = evict_pages_locked(pc, pages);
-        drained += cache_drain((caching_heap)pc->contiguous, drain_bytes - drained,
-                               PAGECACHE_PAGES_RETAIN * cache_pagesize(pc));
+
+        /* folio memory goes straight back to its heap */
+        drained += (pc->folios_released - folios_released) * PAGECACHE_FOLIO_SIZE;
+        if (drained < drain_bytes)
+            drained += cache_drain((caching_heap)pc->contiguous, drain_bytes - drained,
+                                   PAGECACHE_PAGES_RETAIN * cache_pagesize(pc));
         if (evicted < pages)
             break;
         pages *= 2;
@@ -865,11 +1221,12 @@ closure_function(5, 1, void, pagecache_commit_complete,
         if (is_ok(s) || (page_state(pp) != PAGECACHE_PAGESTATE_DIRTY))
             pagecache_page_release_locked(pc, pp, false);
 
-        pp = (pagecache_page)rbnode_get_next((rbnode)pp);
+        pp = page_next_nodelocked(pp->node, pp);
     } while (--page_count > 0);
     pagecache_unlock_state(pc);
     deallocate_sg_list(sg);
 #ifdef KERNEL
+    pagecache_release_throttled_writes(pc);
     async_apply_status_handler(bound(sh), s);
 #else
     apply(bound(sh), s);
@@ -967,13 +1324,13 @@ closure_function(3, 1, void, pagecache_commit_dirty_ranges,
             /* Reserve the page, unless it is in DIRTY state (in which case it has been reserved
              * when switching to DIRTY state). */
             if (page_state(pp) != PAGECACHE_PAGESTATE_DIRTY)
-                pp->refcount++;
+                page_ref(pp);
             change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_WRITING);
             pp->write_count++;
             pagecache_unlock_state(pc);
             page_count++;
             start += len;
-            pp = (pagecache_page)rbnode_get_next((rbnode)pp);
+            pp = page_next_nodelocked(pn, pp);
             if (committing >= COMMIT_LIMIT && start < r.end) {
                 r.end = start;
                 break;
@@ -992,30 +1349,50 @@ closure_function(3, 1, void, pagecache_commit_dirty_ranges,
     apply(sh, s);
 }
 
-closure_function(2, 1, boolean, dirty_range_handler,
-                 rangemap, rm, buffer, b,
+closure_function(3, 1, boolean, dirty_range_handler,
+                 pagecache_node, pn, buffer, b, u64 *, limit,
                  rmnode, n)
 {
-    buffer b = bound(b);
-    assert(buffer_write(b, &n->r, sizeof(n->r)));
-    rangemap_remove_range(bound(rm), n);
-    return true;
+    pagecache_node pn = bound(pn);
+    u64 *limit = bound(limit);
+    range r = n->r;
+    rangemap_remove_range(&pn->dirty, n);
+    if (range_span(r) > *limit) {
+        /* leave the rest of the range, from the next page boundary on, for a later commit */
+        int page_order = pn->pv->pc->page_order;
+        u64 split = (r.start + *limit + MASK(page_order)) & ~MASK(page_order);
+        if (split < r.end) {
+            assert(rangemap_insert_range(&pn->dirty, irange(split, r.end)));
+            r.end = split;
+        }
+    }
+    assert(buffer_write(bound(b), &r, sizeof(r)));
+    *limit -= MIN(*limit, range_span(r));
+    return *limit > 0;
 }
 
-static void pagecache_commit_dirty_node(pagecache_node pn, status_handler complete)
+/* Commit up to limit bytes of the dirty ranges of the node which intersect q; returns the number
+ * of bytes taken. A node with dirty ranges left over is moved to the tail of the volume dirty
+ * list. */
+static u64 pagecache_commit_dirty_node(pagecache_node pn, range q, u64 limit,
+                                       status_handler complete)
 {
-    pagecache_debug("committing dirty node %p\n", pn);
+    pagecache_debug("committing dirty node %p, q %R, limit 0x%lx\n", pn, q, limit);
     pagecache_lock_node(pn);
     heap h = pn->pv->pc->h;
     buffer b = allocate_buffer(h, sizeof(range));
     assert(b != INVALID_ADDRESS);
-    if (rangemap_range_lookup(&pn->dirty, irange(0, infinity), stack_closure(dirty_range_handler, &pn->dirty, b)) != RM_MATCH) {
+    u64 remain = limit;
+    if (rangemap_range_lookup(&pn->dirty, q,
+                              stack_closure(dirty_range_handler, pn, b, &remain)) == RM_NOMATCH) {
         deallocate_buffer(b);
         b = 0;
     }
     pagecache_lock_volume(pn->pv);
     if (list_inserted(&pn->l))
         list_delete(&pn->l);
+    if (rangemap_first_node(&pn->dirty) != INVALID_ADDRESS)
+        list_insert_before(&pn->pv->dirty_nodes, &pn->l);
     pagecache_unlock_volume(pn->pv);
     status_handler sh;
     if (b) {
@@ -1032,35 +1409,38 @@ static void pagecache_commit_dirty_node(pagecache_node pn, status_handler comple
     pagecache_unlock_node(pn);
     if (!busy && sh)
         apply(sh, STATUS_OK);
+    return limit - remain;
 }
 
-static void pagecache_commit_dirty_pages(pagecache pc)
+/* Commit dirty nodes in volume list order until limit bytes have been taken; with a merge, each
+ * node commit completes into it. Returns the number of bytes taken. */
+static u64 pagecache_commit_dirty_pages(pagecache pc, u64 limit, merge m)
 {
-    pagecache_debug("%s\n", __func__);
+    pagecache_debug("%s: limit 0x%lx\n", __func__, limit);
+    u64 taken = 0;
 
     pagecache_lock(pc);
     list_foreach(&pc->volumes, l) {
         pagecache_volume pv = struct_from_list(l, pagecache_volume, l);
-        pagecache_node pn = 0;
-        do {
+        while (taken < limit) {
             pagecache_lock_volume(pv);
             list l = list_get_next(&pv->dirty_nodes);
             pagecache_unlock_volume(pv);
-            if (l) {
-                pn = struct_from_list(l, pagecache_node, l);
-                pagecache_commit_dirty_node(pn, 0);
-            } else {
-                pn = 0;
-            }
-        } while (pn);
+            if (!l)
+                break;
+            pagecache_node pn = struct_from_list(l, pagecache_node, l);
+            taken += pagecache_commit_dirty_node(pn, irange(0, infinity), limit - taken,
+                                                 m ? apply_merge(m) : 0);
+        }
     }
     pagecache_unlock(pc);
+    return taken;
 }
 
 static void pagecache_scan(pagecache pc)
 {
     pagecache_scan_shared_mappings(pc);
-    pagecache_commit_dirty_pages(pc);
+    pagecache_commit_dirty_pages(pc, infinity, 0);
 }
 
 void pagecache_sync_volume(pagecache_volume pv, status_handler complete)
@@ -1081,7 +1461,7 @@ void pagecache_sync_node(pagecache_node pn, status_handler complete)
 {
     pagecache_debug("%s: pn %p, complete %p (%F)\n", __func__, pn, complete, complete);
     pagecache_scan_node(pn);
-    pagecache_commit_dirty_node(pn, complete);
+    pagecache_commit_dirty_node(pn, irange(0, infinity), infinity, complete);
 }
 
 closure_function(1, 1, boolean, purge_range_handler,
@@ -1101,7 +1481,7 @@ closure_function(1, 1, boolean, purge_range_handler,
             refcount_release(&pn->refcount);
         }
         node_offset += page_size;
-        pp = (pagecache_page)rbnode_get_next((rbnode)pp);
+        pp = page_next_nodelocked(pn, pp);
     } while (node_offset < n->r.end);
     rangemap_remove_range(&pn->dirty, n);
     return true;
@@ -1146,7 +1526,7 @@ closure_function(5, 1, void, pagecache_node_fetch_complete,
             is_ok(s) ? PAGECACHE_PAGESTATE_NEW : PAGECACHE_PAGESTATE_ALLOC);
         pagecache_page_queue_completions_locked(pc, pp, s);
         pagecache_page_release_locked(pc, pp, false);
-        pp = (pagecache_page)rbnode_get_next((rbnode)pp);
+        pp = page_next_nodelocked(pp->node, pp);
     }
     pagecache_unlock_state(pc);
     sg_list_release(sg);
@@ -1170,80 +1550,93 @@ static boolean pagecache_node_fetch_sg(pagecache pc, pagecache_node pn, range r,
     return true;
 }
 
+/* If stream is set, the range is part of a sequential stream, which is expected to go on past its
+   end: a folio is then started for any group that begins within the range. */
 static void pagecache_node_fetch_internal(pagecache_node pn, range q, pp_handler ph,
-                                          status_handler completion)
+                                          status_handler completion, boolean stream)
 {
     pagecache pc = pn->pv->pc;
     merge m = allocate_merge(pc->h, completion);
     status_handler sh = apply_merge(m);
-    struct pagecache_page k;
     if (q.end > pn->length)
         q.end = pn->length;
     u64 read_limit = pad(pn->length, U64_FROM_BIT(pn->pv->block_order));
-    k.state_offset = q.start >> pc->page_order;
+    u64 start = q.start >> pc->page_order;
     u64 end = (q.end + MASK(pc->page_order)) >> pc->page_order;
+    range fill = irange(start, stream ? pad(end, folio_pages(pc)) : end);
     pagecache_lock_node(pn);
-    pagecache_page pp = (pagecache_page)rbtree_lookup(&pn->pages, &k.rbnode);
+    u64 pi = start;
+    pagecache_page pp = radix_lookup_next(&pn->pages, &pi);
     sg_list read_sg = 0;
     pagecache_page read_pp = 0;
     range read_r;
     sg_buf sgb = 0;
-    pagecache_lock_state(pc);
-    for (u64 pi = k.state_offset; pi < end; pi++) {
+    for (pi = start; pi < end; pi++) {
         if (pp == INVALID_ADDRESS || page_offset(pp) > pi) {
-            pp = allocate_page_nodelocked(pn, pi);
+            pp = allocate_page_nodelocked(pn, pi, fill);
             if (pp == INVALID_ADDRESS) {
                 apply(apply_merge(m), timm("result", "failed to allocate pagecache_page"));
                 break;
             }
         }
-        if (touch_page_locked(pn, pp, m)) {
-            /* This page does not need to be fetched: fetch pages accumulated so far in read_sg. */
-            if (read_sg) {
-                pagecache_unlock_state(pc);
-                boolean success = pagecache_node_fetch_sg(pc, pn, read_r, read_sg, read_pp, m);
-                pagecache_lock_state(pc);
-                if (!success)
-                    break;
-                read_sg = 0;
-                sgb = 0;
-            }
+        boolean cached;
+        if (!ph && page_filled(pp)) {
+            /* readahead of a cached page: don't count it as a hit */
+            cached = true;
+        } else if (page_get_if_filled(pp)) {
+            if (ph)
+                apply(ph, pp);
+            pagecache_page_put(pc, pp);
+            cached = true;
         } else {
-            /* This page needs to be fetched: add it to read_sg. */
-            if (page_state(pp) == PAGECACHE_PAGESTATE_FREE) {
-                apply(apply_merge(m), timm("result", "failed to allocate page"));
-                break;
-            }
-            if (!read_sg) {
-                read_sg = allocate_sg_list();
-                if (read_sg == INVALID_ADDRESS) {
-                    apply(apply_merge(m), timm("result", "failed to allocate read SG list"));
-                    read_sg = 0;
+            pagecache_lock_state(pc);
+            cached = touch_page_locked(pn, pp, m);
+            if (!cached) {
+                /* This page needs to be fetched: add it to read_sg. */
+                if (page_state(pp) == PAGECACHE_PAGESTATE_FREE) {
+                    pagecache_unlock_state(pc);
+                    apply(apply_merge(m), timm("result", "failed to allocate page"));
                     break;
                 }
-                read_pp = pp;
-                read_r = range_lshift(irangel(page_offset(pp), 0), pc->page_order);
-            }
-            u64 read_max = read_limit - (pi << pc->page_order);
-            u64 read_size = cache_pagesize(pc);
-            if (read_size > read_max) {
-                zero(pp->kvirt + read_max, read_size - read_max);
-                read_size = read_max;
-            }
-            if (sgb && (sgb->buf + sgb->size == pp->kvirt)) {
-                sgb->size += read_size;
-                read_sg->count += read_size;
-            } else {
-                sgb = pagecache_add_sgb(pp, read_sg, read_size);
+                if (!read_sg) {
+                    read_sg = allocate_sg_list();
+                    if (read_sg == INVALID_ADDRESS) {
+                        pagecache_unlock_state(pc);
+                        apply(apply_merge(m), timm("result", "failed to allocate read SG list"));
+                        read_sg = 0;
+                        break;
+                    }
+                    read_pp = pp;
+                    read_r = range_lshift(irangel(page_offset(pp), 0), pc->page_order);
+                }
+                u64 read_max = read_limit - (pi << pc->page_order);
+                u64 read_size = cache_pagesize(pc);
+                if (read_size > read_max) {
+                    zero(pp->kvirt + read_max, read_size - read_max);
+                    read_size = read_max;
+                }
+                if (sgb && (sgb->buf + sgb->size == pp->kvirt)) {
+                    sgb->size += read_size;
+                    read_sg->count += read_size;
+                } else {
+                    sgb = pagecache_add_sgb(pp, read_sg, read_size);
+                }
+                page_ref(pp);
+                read_r.end += read_size;
             }
-            pp->refcount++;
-            read_r.end += read_size;
+            if (ph)
+                apply(ph, pp);
+            pagecache_unlock_state(pc);
         }
-        if (ph)
-            apply(ph, pp);
-        pp = (pagecache_page)rbnode_get_next((rbnode)pp);
+        if (cached && read_sg) {
+            /* This page does not need to be fetched: fetch pages accumulated so far in read_sg. */
+            if (!pagecache_node_fetch_sg(pc, pn, read_r, read_sg, read_pp, m))
+                break;
+            read_sg = 0;
+            sgb = 0;
+        }
+        pp = page_next_nodelocked(pn, pp);
     }
-    pagecache_unlock_state(pc);
     pagecache_unlock_node(pn);
     if (read_sg && !pagecache_node_fetch_sg(pc, pn, read_r, read_sg, read_pp, m)) {
         sg_list_release(read_sg);
@@ -1268,7 +1661,7 @@ closure_function(3, 1, void, pagecache_read_pp_handler,
     sgb->offset = 0;
     sgb->refcount = &pp->read_refcount;
     if (fetch_and_add(&pp->read_refcount.c, 1) == 0)
-        pp->refcount++;
+        page_ref(pp);
 }
 
 closure_function(1, 3, void, pagecache_read_sg,
@@ -1280,7 +1673,7 @@ closure_function(1, 3, void, pagecache_read_sg,
     pagecache_debug("%s: node %p, q %R, sg %p, completion %F\n", __func__, pn, q, sg, completion);
     q = range_intersection(q, irangel(0, pn->length));
     pagecache_node_fetch_internal(pn, q, stack_closure(pagecache_read_pp_handler, pc, q, sg),
-                                  completion);
+                                  completion, false);
 }
 
 
@@ -1295,19 +1688,22 @@ closure_function(3, 3, boolean, pagecache_check_dirty_page,
     if (pte_is_present(old_entry) &&
         pte_is_mapping(level, old_entry) &&
         pte_is_dirty(old_entry)) {
-        range r = irangel(sm->node_offset + (vaddr - sm->n.r.start), cache_pagesize(pc));
-        u64 pi = r.start >> pc->page_order;
-        pagecache_debug("   dirty: vaddr 0x%lx, pi 0x%lx\n", vaddr, pi);
+        /* a folio mapping dirties all of its pages */
+        range r = irangel(sm->node_offset + (vaddr - sm->n.r.start),
+                          pte_map_size(level, old_entry));
+        pagecache_debug("   dirty: vaddr 0x%lx, r %R\n", vaddr, r);
         pt_pte_clean(entry);
         page_invalidate(bound(fe), vaddr);
         pagecache_node pn = sm->pn;
         pagecache_lock_node(pn);
-        pagecache_page pp = page_lookup_nodelocked(pn, pi);
-        assert(pp != INVALID_ADDRESS);
         pagecache_lock_state(pc);
-        if (page_state(pp) != PAGECACHE_PAGESTATE_DIRTY) {
-            change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_DIRTY);
-            pp->refcount++;
+        for (u64 pi = r.start >> pc->page_order; pi < (r.end >> pc->page_order); pi++) {
+            pagecache_page pp = page_lookup_nodelocked(pn, pi);
+            assert(pp != INVALID_ADDRESS);
+            if (page_state(pp) != PAGECACHE_PAGESTATE_DIRTY) {
+                change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_DIRTY);
+                page_ref(pp);
+            }
         }
         pagecache_unlock_state(pc);
         pagecache_set_dirty(pn, r);
@@ -1351,18 +1747,56 @@ define_closure_function(1, 2, void, pagecache_scan_timer,
                         u64, expiry, u64, overruns)
 {
     pagecache pc = bound(pc);
-    if ((overruns != timer_disabled) && !pc->writeback_in_progress) {
-        pagecache_scan(pc);
-        pc->writeback_in_progress = true;
-        pagecache_finish_pending_writes(pc, 0, 0, (status_handler)&pc->writeback_complete);
+    if (overruns != timer_disabled) {
+        if (!pc->writeback_in_progress)
+            pagecache_scan_shared_mappings(pc);
+        pagecache_start_writeback(pc, true);
     }
 }
 
+/* Writeback is paced to the storage device: each pass commits a chunk of dirty data, sized after
+   the measured write bandwidth, and the next pass starts only after the previous one has
+   completed. This keeps the amount of in-flight writes (and the latency they add to other I/O)
+   bounded instead of committing all dirty data at once. */
+define_closure_function(0, 1, void, pagecache_writeback_pass,
+                        status, s)
+{
+    pagecache pc = struct_from_field(closure_self(), pagecache, writeback_pass);
+    u64 chunk = pc->writeback_rate * PAGECACHE_WRITEBACK_CHUNK_MS / THOUSAND;
+    chunk = MIN(MAX(chunk, PAGECACHE_WRITEBACK_CHUNK_MIN), PAGECACHE_WRITEBACK_CHUNK_MAX);
+    merge m = allocate_merge(pc->h, (status_handler)&pc->writeback_complete);
+    status_handler sh = apply_merge(m);
+    pc->pass_limit = chunk;
+    pc->pass_start = now(CLOCK_ID_MONOTONIC);
+    pc->pass_bytes = pagecache_commit_dirty_pages(pc, chunk, m);
+    pagecache_debug("%s: chunk 0x%lx, committing 0x%lx\n", __func__, chunk, pc->pass_bytes);
+    apply(sh, STATUS_OK);
+}
+
 define_closure_function(0, 1, void, pagecache_writeback_complete,
                         status, s)
 {
     pagecache pc = struct_from_field(closure_self(), pagecache, writeback_complete);
-    pc->writeback_in_progress = false;
+    u64 bytes = pc->pass_bytes;
+    u64 ms = msec_from_timestamp(now(CLOCK_ID_MONOTONIC) - pc->pass_start);
+    pagecache_lock_state(pc);
+    pc->written_bytes += bytes;
+
+    /* small passes don't give a meaningful bandwidth sample */
+    if (bytes >= PAGECACHE_WRITEBACK_CHUNK_MIN) {
+        u64 rate = bytes * THOUSAND / MAX(ms, 1);
+        pc->writeback_rate = pc->writeback_rate ? (pc->writeback_rate * 3 + rate) / 4 : rate;
+    }
+    boolean more = (bytes >= pc->pass_limit) &&
+        (pc->writeback_flush || (pc->dirty_pages > pc->dirty_background_pages));
+    if (!more) {
+        pc->writeback_flush = false;
+        pc->writeback_in_progress = false;
+    }
+    pagecache_unlock_state(pc);
+    pagecache_release_throttled_writes(pc);
+    if (more)
+        async_apply_status_handler((status_handler)&pc->writeback_pass, STATUS_OK);
 }
 
 void pagecache_node_add_shared_map(pagecache_node pn, range q /* bytes */, u64 node_offset)
@@ -1443,7 +1877,7 @@ void pagecache_node_scan_and_commit_shared_pages(pagecache_node pn, range q /* b
     flush_entry fe = get_page_flush_entry();
     rangemap_range_lookup(pn->shared_maps, q,
                           stack_closure(scan_shared_pages_intersection, pn->pv->pc, fe));
-    pagecache_commit_dirty_node(pn, 0);
+    pagecache_commit_dirty_node(pn, irange(0, infinity), infinity, 0);
     page_invalidate_sync(fe, 0);
 }
 
@@ -1475,14 +1909,217 @@ boolean pagecache_node_do_page_cow(pagecache_node pn, u64 node_offset, u64 vaddr
 void pagecache_node_fetch_pages(pagecache_node pn, range r)
 {
     pagecache_debug("%s: node %p, r %R\n", __func__, pn, r);
-    pagecache_node_fetch_internal(pn, r, 0, ignore_status);
+    pagecache_node_fetch_internal(pn, r, 0, ignore_status, false);
+}
+
+void pagecache_node_readahead(pagecache_node pn, range r)
+{
+    pagecache_debug("%s: node %p, r %R\n", __func__, pn, r);
+    pagecache_node_fetch_internal(pn, r, 0, ignore_status, true);
+}
+
+closure_function(3, 2, boolean, pagecache_drop_page,
+                 pagecache, pc, u64, end, boolean, deactivate,
+                 u64, index, void *, p)
+{
+    if (index >= bound(end))
+        return false;
+    pagecache pc = bound(pc);
+    pagecache_page pp = p;
+    int state = page_state(pp);
+    if (((state != PAGECACHE_PAGESTATE_NEW) && (state != PAGECACHE_PAGESTATE_ACTIVE)) ||
+        pp->evicted)
+        return true;
+    if (bound(deactivate)) {
+        if (state == PAGECACHE_PAGESTATE_ACTIVE)
+            change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_NEW);
+        pp->referenced = false;
+        /* move to the cold end of the new list, to be evicted first */
+        list_delete(&pp->l);
+        list_insert_after(&pc->new.l, &pp->l);
+    } else if (pp->refcount == 1) {
+        /* Not mapped nor being read: evict it. The page has been dropped on purpose, so don't keep
+           refault data which would activate it if it is loaded again. */
+        pp->evicted = true;
+        pagecache_page_release_locked(pc, pp, false);
+        pp->eviction = 0;
+    }
+    return true;
+}
+
+static void pagecache_node_drop_internal(pagecache_node pn, range r, boolean deactivate)
+{
+    pagecache pc = pn->pv->pc;
+    int order = pc->page_order;
+    pagecache_lock_node(pn);
+    r = range_intersection(r, irange(0, pn->length));
+    range pr;
+    if (deactivate) {
+        pr = range_rshift_pad(r, order);
+    } else {
+        /* drop only pages entirely in the range, or the partial page at the end of the node */
+        pr.start = pad(r.start, U64_FROM_BIT(order)) >> order;
+        pr.end = ((r.end == pn->length) ? pad(r.end, U64_FROM_BIT(order)) : r.end) >> order;
+    }
+    pagecache_lock_state(pc);
+    radix_traverse(&pn->pages, pr.start, stack_closure(pagecache_drop_page, pc, pr.end, deactivate));
+    pagecache_unlock_state(pc);
+    pagecache_unlock_node(pn);
+}
+
+/* Evict clean, unused pages in the range, and start writeback of dirty ones, which can be dropped
+   once written. */
+void pagecache_node_drop_pages(pagecache_node pn, range r /* bytes */)
+{
+    pagecache_debug("%s: node %p, r %R\n", __func__, pn, r);
+    pagecache_commit_dirty_node(pn, r, infinity, 0);
+    pagecache_node_drop_internal(pn, r, false);
+}
+
+/* Move cached pages in the range to the cold end of the LRU. */
+void pagecache_node_deactivate_pages(pagecache_node pn, range r /* bytes */)
+{
+    pagecache_debug("%s: node %p, r %R\n", __func__, pn, r);
+    pagecache_node_drop_internal(pn, r, true);
+}
+
+int pagecache_node_get_block_order(pagecache_node pn)
+{
+    return pn->pv->block_order;
+}
+
+/* copy length bytes, starting at offset into the sg list, without consuming the list */
+static void sg_peek_copy(void *dest, sg_list sg, u64 offset, u64 length)
+{
+    for (u64 i = 0; length > 0; i++) {
+        sg_buf sgb = sg_list_peek_at(sg, i);
+        assert(sgb != INVALID_ADDRESS);
+        u64 len = sg_buf_len(sgb);
+        if (offset >= len) {
+            offset -= len;
+            continue;
+        }
+        len = MIN(len - offset, length);
+        runtime_memcpy(dest, sgb->buf + sgb->offset + offset, len);
+        dest += len;
+        length -= len;
+        offset = 0;
+    }
+}
+
+closure_function(4, 2, boolean, pagecache_direct_write_page,
+                 pagecache, pc, range, q, sg_list, sg, u64, end,
+                 u64, index, void *, p)
+{
+    if (index >= bound(end))
+        return false;
+    pagecache pc = bound(pc);
+    pagecache_page pp = p;
+    if (!page_filled(pp))
+        return true;
+    range r = byte_range_from_page(pc, pp);
+    range i = range_intersection(r, bound(q));
+    sg_peek_copy(pp->kvirt + (i.start - r.start), bound(sg), i.start - bound(q).start,
+                 range_span(i));
+    return true;
+}
+
+closure_function(3, 1, void, pagecache_direct_write_complete,
+                 pagecache_node, pn, range, q, status_handler, completion,
+                 status, s)
+{
+    /* drop pages which have been loaded while the write was in progress */
+    if (is_ok(s))
+        pagecache_node_drop_internal(bound(pn), bound(q), false);
+    apply(bound(completion), s);
+    closure_finish();
+}
+
+closure_function(4, 1, void, pagecache_direct_write_issue,
+                 pagecache_node, pn, sg_list, sg, range, q, status_handler, completion,
+                 status, s)
+{
+    pagecache_node pn = bound(pn);
+    pagecache pc = pn->pv->pc;
+    sg_list sg = bound(sg);
+    range q = bound(q);
+    status_handler completion = bound(completion);
+    closure_finish();
+    if (!is_ok(s)) {
+        apply(completion, s);
+        return;
+    }
+    status_handler sh = closure(pc->h, pagecache_direct_write_complete, pn, q, completion);
+    if (sh == INVALID_ADDRESS) {
+        apply(completion, timm("result", "failed to allocate completion"));
+        return;
+    }
+
+    /* Evict the cached pages of the range which can be dropped, and update the remaining ones
+       (partially written, mapped or in use) with the data being written. */
+    pagecache_node_drop_internal(pn, q, false);
+    range pr = range_rshift_pad(q, pc->page_order);
+    pagecache_lock_node(pn);
+    pagecache_lock_state(pc);
+    radix_traverse(&pn->pages, pr.start,
+                   stack_closure(pagecache_direct_write_page, pc, q, sg, pr.end));
+    pagecache_unlock_state(pc);
+    pagecache_unlock_node(pn);
+    apply(pn->fs_write, sg, q, sh);
+}
+
+closure_function(4, 1, void, pagecache_direct_read_issue,
+                 pagecache_node, pn, sg_list, sg, range, q, status_handler, completion,
+                 status, s)
+{
+    if (is_ok(s))
+        apply(bound(pn)->fs_read, bound(sg), bound(q), bound(completion));
+    else
+        apply(bound(completion), s);
+    closure_finish();
+}
+
+/* Direct I/O goes straight between the sg buffers and the filesystem, after dirty pages
+   (including those dirtied through shared mappings) in the range have been written back. */
+static void pagecache_node_direct_io(pagecache_node pn, status_handler issue, range q,
+                                     status_handler completion)
+{
+    if (issue == INVALID_ADDRESS) {
+        apply(completion, timm("result", "failed to allocate completion"));
+        return;
+    }
+    pagecache_scan_node(pn);
+    pagecache_commit_dirty_node(pn, q, infinity, issue);
+}
+
+void pagecache_node_direct_read(pagecache_node pn, sg_list sg, range q /* bytes */,
+                                status_handler completion)
+{
+    pagecache_debug("%s: node %p, q %R, sg %p\n", __func__, pn, q, sg);
+    pagecache_node_direct_io(pn, closure(pn->pv->pc->h, pagecache_direct_read_issue, pn, sg, q,
+                                         completion),
+                             q, completion);
+}
+
+void pagecache_node_direct_write(pagecache_node pn, sg_list sg, range q /* bytes */,
+                                 status_handler completion)
+{
+    pagecache_debug("%s: node %p, q %R, sg %p\n", __func__, pn, q, sg);
+    pagecache_node_direct_io(pn, closure(pn->pv->pc->h, pagecache_direct_write_issue, pn, sg, q,
+                                         completion),
+                             q, completion);
 }
 
 static void map_page(pagecache pc, pagecache_page pp, u64 vaddr, pageflags flags, status_handler complete)
 {
     assert(pp->refcount != 0);
     assert(pp->kvirt != INVALID_ADDRESS);
-    map_with_complete(vaddr, pp->phys, cache_pagesize(pc), flags, complete);
+    /* if the address has been mapped in the meantime (e.g. as part of a folio), the existing
+       mapping holds its own reference */
+    if (!map_block(vaddr, pp->phys, cache_pagesize(pc), flags))
+        pagecache_page_put(pc, pp);
+    if (complete)
+        apply(complete, STATUS_OK);
 }
 
 closure_function(5, 1, void, map_page_finish,
@@ -1540,6 +2177,127 @@ boolean pagecache_map_page_if_filled(pagecache_node pn, u64 node_offset, u64 vad
     return mapped;
 }
 
+boolean pagecache_node_folio_capable(pagecache_node pn, u64 node_offset)
+{
+    return node_folio_capable(pn, node_offset >> pn->pv->pc->page_order);
+}
+
+/* Drop the references on count consecutive pages starting at pp. */
+static void folio_pages_put(pagecache_node pn, pagecache_page pp, u64 count)
+{
+    pagecache pc = pn->pv->pc;
+    while (count-- > 0) {
+        pagecache_page next = count ? page_next_nodelocked(pn, pp) : 0;
+        pagecache_page_put(pc, pp);
+        pp = next;
+    }
+}
+
+/* Consumes the references on count consecutive pages starting at first, which are filled. If
+   they are all the pages of a single folio, the folio is mapped with one large page entry at the
+   folio-aligned address of vaddr; otherwise (or if part of that range is already mapped), only
+   the page at vaddr is mapped. */
+static void map_folio_pages(pagecache_node pn, pagecache_page first, u64 count, u64 vaddr,
+                            pageflags flags, status_handler complete)
+{
+    pagecache pc = pn->pv->pc;
+    u64 folio_vaddr = vaddr & ~(PAGECACHE_FOLIO_SIZE - 1);
+    pagecache_folio f = count ? first->folio : 0;
+    boolean block = f && (count == folio_pages(pc));
+    pagecache_page pp = first;
+    for (u64 i = 1; block && (i < count); i++) {
+        pp = page_next_nodelocked(pn, pp);
+        block = (pp->folio == f);
+    }
+    pagecache_debug("%s: pn %p, first %p, count %ld, vaddr 0x%lx, folio %p\n", __func__, pn,
+                    first, count, vaddr, block ? f : 0);
+    if (block && map_block(folio_vaddr, f->phys, PAGECACHE_FOLIO_SIZE, flags)) {
+        apply(complete, STATUS_OK);
+        return;
+    }
+    u64 pi = count ? page_offset(first) + ((vaddr - folio_vaddr) >> pc->page_order) : 0;
+    if (!count || (pi < page_offset(first)) || (pi >= page_offset(first) + count)) {
+        folio_pages_put(pn, first, count);
+        apply(complete, timm("result", "%s: page not available", __func__));
+        return;
+    }
+    u64 n = pi - page_offset(first);
+    pp = first;
+    for (u64 i = 0; i < n; i++)
+        pp = page_next_nodelocked(pn, pp);
+    pagecache_page next = (n + 1 < count) ? page_next_nodelocked(pn, pp) : 0;
+    folio_pages_put(pn, first, n);
+    map_page(pc, pp, vaddr, flags, 0);
+    folio_pages_put(pn, next, count - n - 1);
+    apply(complete, STATUS_OK);
+}
+
+closure_function(6, 1, void, map_folio_finish,
+                 pagecache_node, pn, pagecache_page, first, u64, count, u64, vaddr, pageflags, flags, status_handler, complete,
+                 status, s)
+{
+    if (is_ok(s)) {
+        map_folio_pages(bound(pn), bound(first), bound(count), bound(vaddr), bound(flags),
+                        bound(complete));
+    } else {
+        folio_pages_put(bound(pn), bound(first), bound(count));
+        apply(bound(complete), s);
+    }
+    closure_finish();
+}
+
+closure_function(1, 1, void, map_folio_ref_page,
+                 status_handler, finish,
+                 pagecache_page, pp)
+{
+    status_handler finish = bound(finish);
+    page_ref(pp);
+    if (closure_member(map_folio_finish, finish, count)++ == 0)
+        closure_member(map_folio_finish, finish, first) = pp;
+}
+
+/* not context restoring */
+void pagecache_map_folio(pagecache_node pn, u64 node_offset, u64 vaddr, pageflags flags,
+                         status_handler complete)
+{
+    pagecache pc = pn->pv->pc;
+    range r = irangel(node_offset & ~(PAGECACHE_FOLIO_SIZE - 1), PAGECACHE_FOLIO_SIZE);
+    pagecache_debug("%s: pn %p, node_offset 0x%lx, vaddr 0x%lx, flags 0x%lx, complete %F\n",
+                    __func__, pn, node_offset, vaddr, flags.w, complete);
+    status_handler finish = closure(pc->h, map_folio_finish, pn, 0, 0, vaddr, flags, complete);
+    if (finish == INVALID_ADDRESS) {
+        apply(complete, timm("result", "%s: unable to allocate completion", __func__));
+        return;
+    }
+    pagecache_node_fetch_internal(pn, r, stack_closure(map_folio_ref_page, finish), finish, false);
+}
+
+/* no-alloc / no-fill path */
+boolean pagecache_map_folio_if_filled(pagecache_node pn, u64 node_offset, u64 vaddr, pageflags flags,
+                                      status_handler complete)
+{
+    pagecache pc = pn->pv->pc;
+    u64 pi = (node_offset & ~(PAGECACHE_FOLIO_SIZE - 1)) >> pc->page_order;
+    u64 count = 0;
+    pagecache_lock_node(pn);
+    pagecache_page first = page_lookup_nodelocked(pn, pi);
+    pagecache_page pp = first;
+    while ((count < folio_pages(pc)) && (pp != INVALID_ADDRESS) &&
+           (page_offset(pp) == pi + count) && page_get_if_filled(pp)) {
+        count++;
+        pp = page_next_nodelocked(pn, pp);
+    }
+    pagecache_unlock_node(pn);
+    pagecache_debug("%s: pn %p, node_offset 0x%lx, vaddr 0x%lx, filled %ld\n", __func__, pn,
+                    node_offset, vaddr, count);
+    if (count < folio_pages(pc)) {
+        folio_pages_put(pn, first, count);
+        return false;
+    }
+    map_folio_pages(pn, first, count, vaddr, flags, complete);
+    return true;
+}
+
 closure_function(4, 3, boolean, pagecache_unmap_page_nodelocked,
                  pagecache_node, pn, u64, vaddr_base, u64, node_offset, flush_entry, fe,
                  int, level, u64, vaddr, pteptr, entry)
@@ -1551,52 +2309,44 @@ closure_function(4, 3, boolean, pagecache_unmap_page_nodelocked,
         pagecache_debug("   vaddr 0x%lx, pi 0x%lx\n", vaddr, pi);
         pte_set(entry, 0);
         page_invalidate(bound(fe), vaddr);
-        pagecache_page pp = page_lookup_nodelocked(bound(pn), pi);
-        assert(pp != INVALID_ADDRESS);
-        u64 phys = page_from_pte(old_entry);
         pagecache pc = bound(pn)->pv->pc;
-        if (phys == pp->phys) {
-            /* shared or cow */
-            assert(pp->refcount >= 1);
-            pagecache_lock_state(pc);
-            pagecache_page_release_locked(pc, pp, false);
-            pagecache_unlock_state(pc);
-        } else {
-            /* private copy: free physical page */
-            deallocate_u64(pc->physical, phys, cache_pagesize(pc));
+        u64 phys = page_from_pte(old_entry);
+        u64 end = phys + pte_map_size(level, old_entry);    /* more than one page if a folio */
+        for (; phys < end; phys += cache_pagesize(pc), pi++) {
+            pagecache_page pp = page_lookup_nodelocked(bound(pn), pi);
+            assert(pp != INVALID_ADDRESS);
+            if (phys == pp->phys) {
+                /* shared or cow */
+                assert(pp->refcount >= 1);
+                pagecache_lock_state(pc);
+                pagecache_page_release_locked(pc, pp, false);
+                pagecache_unlock_state(pc);
+            } else {
+                /* private copy: free physical page */
+                deallocate_u64(pc->physical, phys, cache_pagesize(pc));
+            }
         }
     }
     return true;
 }
 
-void pagecache_node_unmap_pages(pagecache_node pn, range v /* bytes */, u64 node_offset)
+boolean pagecache_node_unmap_pages(pagecache_node pn, range v /* bytes */, u64 node_offset)
 {
     pagecache_debug("%s: pn %p, v %R, node_offset 0x%lx\n", __func__, pn, v, node_offset);
     flush_entry fe = get_page_flush_entry();
+    if (!split_block_mappings(v.start, range_span(v), fe)) {
+        page_invalidate_sync(fe, 0);
+        return false;
+    }
     pagecache_node_close_shared_pages(pn, v, fe);
     pagecache_lock_node(pn);
     traverse_ptes(v.start, range_span(v), stack_closure(pagecache_unmap_page_nodelocked, pn,
                                                         v.start, node_offset, fe));
     pagecache_unlock_node(pn);
     page_invalidate_sync(fe, 0);
-}
-#endif
-
-define_closure_function(1, 1, boolean, pagecache_page_print_key,
-                 pagecache, pc,
-                 rbnode, n)
-{
-    rprintf(" 0x%lx", page_offset((pagecache_page)n) << cache_pagesize(bound(pc)));
     return true;
 }
-
-define_closure_function(0, 2, int, pagecache_page_compare,
-                 rbnode, a, rbnode, b)
-{
-    u64 oa = page_offset((pagecache_page)a);
-    u64 ob = page_offset((pagecache_page)b);
-    return oa == ob ? 0 : (oa < ob ? -1 : 1);
-}
+#endif
 
 void pagecache_set_node_length(pagecache_node pn, u64 length)
 {
@@ -1608,18 +2358,20 @@ u64 pagecache_get_node_length(pagecache_node pn)
     return pn->length;
 }
 
-closure_function(1, 1, boolean, pagecache_page_release,
+closure_function(1, 2, boolean, pagecache_page_release,
                  pagecache, pc,
-                 rbnode, n)
+                 u64, index, void *, p)
 {
     pagecache pc = bound(pc);
-    pagecache_page pp = struct_from_list(n, pagecache_page, rbnode);
+    pagecache_page pp = p;
     pagecache_lock_state(pc);
     if (!pp->evicted)
         pagecache_page_release_locked(pc, pp, false);
     /* a pagecache node being released means no outstanding page references are possible */
     assert(page_state(pp) == PAGECACHE_PAGESTATE_FREE);
     pagelist_remove(&pc->free, pp);
+    if (pp->folio)
+        folio_put_locked(pc, pp->folio);
     pagecache_unlock_state(pc);
     deallocate(pc->pp_heap, pp, sizeof(*pp));
     return true;
@@ -1648,7 +2400,7 @@ define_closure_function(1, 0, void, pagecache_node_free,
     deallocate_closure(pn->cache_write);
 #endif
     pagecache pc = pn->pv->pc;
-    destruct_rbtree(&pn->pages, stack_closure(pagecache_page_release, pc));
+    destruct_radix_tree(&pn->pages, stack_closure(pagecache_page_release, pc));
     deallocate_rangemap(pn->shared_maps, stack_closure(pagecache_node_assert));
     deallocate(pc->h, pn, sizeof(*pn));
 }
@@ -1697,8 +2449,7 @@ pagecache_node pagecache_allocate_node(pagecache_volume pv, sg_io fs_read, sg_io
 #endif
     list_init_member(&pn->l);
     init_rangemap(&pn->dirty, h);
-    init_rbtree(&pn->pages, (rb_key_compare)&pv->pc->page_compare,
-                (rbnode_handler)&pv->pc->page_print_key);
+    init_radix_tree(&pn->pages, h);
     pn->length = 0;
     pn->cache_read = closure(h, pagecache_read_sg, pn);
 #ifndef PAGECACHE_READ_ONLY
@@ -1770,6 +2521,14 @@ static inline void page_list_init(struct pagelist *pl)
     pl->pages = 0;
 }
 
+/* called with state lock held, except at init */
+static void pagecache_update_dirty_limits(pagecache pc)
+{
+    pc->dirty_limit_pages = pc->memory_pages / 100 * pc->dirty_ratio;
+    pc->dirty_background_pages = MIN(pc->memory_pages / 100 * pc->dirty_background_ratio,
+                                     pc->dirty_limit_pages);
+}
+
 void init_pagecache(heap general, heap contiguous, heap physical, u64 pagesize)
 {
     pagecache pc = allocate(general, sizeof(struct pagecache));
@@ -1788,6 +2547,11 @@ void init_pagecache(heap general, heap contiguous, heap physical, u64 pagesize)
     pc->contiguous = contiguous;
 #endif
     pc->physical = physical;
+#ifdef KERNEL
+    pc->folio_heap = is_low_memory_machine() ? 0 : contiguous;
+#else
+    pc->folio_heap = 0;
+#endif
     pc->zero_page = allocate_zero(contiguous, pagesize);
     assert(pc->zero_page != INVALID_ADDRESS);
 
@@ -1810,14 +2574,125 @@ void init_pagecache(heap general, heap contiguous, heap physical, u64 pagesize)
     page_list_init(&pc->writing);
     list_init(&pc->volumes);
     list_init(&pc->shared_maps);
-    init_closure(&pc->page_compare, pagecache_page_compare);
-    init_closure(&pc->page_print_key, pagecache_page_print_key, pc);
+    pc->evictions = 0;
+    pc->refaults = 0;
+    pc->refault_activations = 0;
+    pc->active_target = PAGECACHE_ACTIVE_TARGET_DEFAULT;
+    pc->active_min = PAGECACHE_ACTIVE_MIN_DEFAULT;
+    pc->folios = 0;
+    pc->folios_released = 0;
+    pc->dirty_pages = 0;
+    u64 memory = physical ? heap_total(physical) : INVALID_PHYSICAL;
+    pc->memory_pages = (memory == INVALID_PHYSICAL) ? infinity : memory >> pc->page_order;
+    pc->dirty_background_ratio = PAGECACHE_DIRTY_BACKGROUND_RATIO_DEFAULT;
+    pc->dirty_ratio = PAGECACHE_DIRTY_RATIO_DEFAULT;
+    pagecache_update_dirty_limits(pc);
+    list_init(&pc->throttled_writes);
+    pc->throttled = 0;
+    pc->written_bytes = 0;
+    pc->writeback_rate = 0;
+    pc->pass_limit = pc->pass_bytes = 0;
+    pc->pass_start = 0;
+    pc->writeback_flush = false;
 
 #ifdef KERNEL
     pc->writeback_in_progress = false;
     init_timer(&pc->scan_timer);
     init_closure(&pc->do_scan_timer, pagecache_scan_timer, pc);
     init_closure(&pc->writeback_complete, pagecache_writeback_complete);
+    init_closure(&pc->writeback_pass, pagecache_writeback_pass);
 #endif
     global_pagecache = pc;
 }
+
+#ifdef KERNEL
+closure_function(0, 1, boolean, pagecache_active_min_notify,
+                 value, v)
+{
+    pagecache pc = global_pagecache;
+    u64 active_min;
+    if (!v || !u64_from_value(v, &active_min))
+        active_min = PAGECACHE_ACTIVE_MIN_DEFAULT;
+    else if (active_min > PAGECACHE_ACTIVE_MAX)
+        active_min = PAGECACHE_ACTIVE_MAX;
+    pagecache_lock_state(pc);
+    pc->active_min = active_min;
+    if (pc->active_target < active_min)
+        pc->active_target = active_min;
+    pagecache_unlock_state(pc);
+    return true;
+}
+
+closure_function(2, 1, boolean, pagecache_dirty_ratio_notify,
+                 u64 *, ratio, u64, dflt,
+                 value, v)
+{
+    pagecache pc = global_pagecache;
+    u64 ratio;
+    if (!v || !u64_from_value(v, &ratio))
+        ratio = bound(dflt);
+    else if (ratio > 100)
+        ratio = 100;
+    pagecache_lock_state(pc);
+    *bound(ratio) = ratio;
+    pagecache_update_dirty_limits(pc);
+    pagecache_unlock_state(pc);
+    pagecache_release_throttled_writes(pc);
+    return true;
+}
+
+closure_function(2, 0, value, pagecache_get_stat,
+                 value, v, u64 *, stat)
+{
+    return value_rewrite_u64(bound(v), *bound(stat));
+}
+
+#define register_pagecache_stat(h, n, t, name, stat)                    \
+    v = value_from_u64(0);                                              \
+    s = sym(name);                                                      \
+    set(t, s, v);                                                       \
+    tuple_notifier_register_get_notify(n, s, closure(h, pagecache_get_stat, v, stat));
+
+/* The pagecache_active_min option in the root tuple sets the lowest share (in percent) of
+   resident pages which the replacement policy keeps on the active list; the
+   pagecache_dirty_background_ratio and pagecache_dirty_ratio options set the dirty page limits
+   (in percent of physical memory). List sizes, refault and writeback statistics are exported in
+   /pagecache. */
+void init_pagecache_management(tuple root)
+{
+    pagecache pc = global_pagecache;
+    heap h = heap_locked(get_kernel_heaps());
+    register_root_notify(sym(pagecache_active_min), closure(h, pagecache_active_min_notify));
+    register_root_notify(sym(pagecache_dirty_background_ratio),
+                         closure(h, pagecache_dirty_ratio_notify, &pc->dirty_background_ratio,
+                                 PAGECACHE_DIRTY_BACKGROUND_RATIO_DEFAULT));
+    register_root_notify(sym(pagecache_dirty_ratio),
+                         closure(h, pagecache_dirty_ratio_notify, &pc->dirty_ratio,
+                                 PAGECACHE_DIRTY_RATIO_DEFAULT));
+
+    value v;
+    symbol s;
+    tuple t = allocate_tuple();
+    assert(t != INVALID_ADDRESS);
+    tuple_notifier n = tuple_notifier_wrap(t);
+    assert(n != INVALID_ADDRESS);
+    register_pagecache_stat(h, n, t, total_pages, (u64 *)&pc->total_pages);
+    register_pagecache_stat(h, n, t, new_pages, &pc->new.pages);
+    register_pagecache_stat(h, n, t, active_pages, &pc->active.pages);
+    register_pagecache_stat(h, n, t, ghost_pages, &pc->free.pages);
+    register_pagecache_stat(h, n, t, evictions, &pc->evictions);
+    register_pagecache_stat(h, n, t, refaults, &pc->refaults);
+    register_pagecache_stat(h, n, t, refault_activations, &pc->refault_activations);
+    register_pagecache_stat(h, n, t, active_target, &pc->active_target);
+    register_pagecache_stat(h, n, t, folios, &pc->folios);
+    register_pagecache_stat(h, n, t, dirty_pages, &pc->dirty_pages);
+    register_pagecache_stat(h, n, t, writeback_pages, &pc->writing.pages);
+    register_pagecache_stat(h, n, t, dirty_background_pages, &pc->dirty_background_pages);
+    register_pagecache_stat(h, n, t, dirty_limit_pages, &pc->dirty_limit_pages);
+    register_pagecache_stat(h, n, t, throttled_writes, &pc->throttled);
+    register_pagecache_stat(h, n, t, written_bytes, &pc->written_bytes);
+    register_pagecache_stat(h, n, t, writeback_rate, &pc->writeback_rate);
+    set(t, sym(no_encode), null_value);
+    set(root, sym(pagecache), n);
+}
+#endif
@@ -1,3 +1,5 @@
+#define PAGECACHE_FOLIO_SIZE    PAGESIZE_2M
+
 typedef struct pagecache_volume *pagecache_volume;
 
 typedef struct pagecache_node *pagecache_node;
@@ -42,13 +44,40 @@ boolean pagecache_node_do_page_cow(pagecache_node pn, u64 node_offset, u64 vaddr
 
 void pagecache_node_fetch_pages(pagecache_node pn, range r /* bytes */);
 
+/* Like pagecache_node_fetch_pages(), for a readahead window of a sequential stream */
+void pagecache_node_readahead(pagecache_node pn, range r /* bytes */);
+
+void pagecache_node_drop_pages(pagecache_node pn, range r /* bytes */);
+
+void pagecache_node_deactivate_pages(pagecache_node pn, range r /* bytes */);
+
+/* Direct I/O bypassing the cache: the range must be aligned to the volume block size, and each
+   sg buffer must be physically contiguous. Cached pages of the range are kept coherent. */
+int pagecache_node_get_block_order(pagecache_node pn);
+
+void pagecache_node_direct_read(pagecache_node pn, sg_list sg, range q /* bytes */,
+                                status_handler completion);
+
+void pagecache_node_direct_write(pagecache_node pn, sg_list sg, range q /* bytes */,
+                                 status_handler completion);
+
 void pagecache_map_page(pagecache_node pn, u64 node_offset, u64 vaddr, pageflags flags,
                         status_handler complete);
 
 boolean pagecache_map_page_if_filled(pagecache_node pn, u64 node_offset, u64 vaddr, pageflags flags,
                                      status_handler complete);
 
-void pagecache_node_unmap_pages(pagecache_node pn, range v /* bytes */, u64 node_offset);
+boolean pagecache_node_unmap_pages(pagecache_node pn, range v /* bytes */, u64 node_offset);
+
+boolean pagecache_node_folio_capable(pagecache_node pn, u64 node_offset);
+
+void pagecache_map_folio(pagecache_node pn, u64 node_offset, u64 vaddr, pageflags flags,
+                         status_handler complete);
+
+boolean pagecache_map_folio_if_filled(pagecache_node pn, u64 node_offset, u64 vaddr, pageflags flags,
+                                      status_handler complete);
+
+void init_pagecache_management(tuple root);
 #endif
 
 
@@ -8,12 +8,8 @@ declare_closure_struct(1, 2, void, pagecache_scan_timer,
                        u64, expiry, u64, overruns);
 declare_closure_struct(0, 1, void, pagecache_writeback_complete,
                        status, s);
-
-declare_closure_struct(0, 2, int, pagecache_page_compare,
-                       rbnode, a, rbnode, b);
-declare_closure_struct(1, 1, boolean, pagecache_page_print_key,
-                       struct pagecache *, pc,
-                       rbnode, n);
+declare_closure_struct(0, 1, void, pagecache_writeback_pass,
+                       status, s);
 
 typedef struct page_completion {
     struct list l;
@@ -23,6 +19,16 @@ typedef struct page_completion {
     };
 } *page_completion;
 
+/* A folio is a naturally aligned, physically contiguous chunk of PAGECACHE_FOLIO_SIZE bytes
+   backing a group of consecutive pages of a node, so that they can be mapped with a single
+   large page entry. Covered by the state lock. */
+typedef struct pagecache_folio {
+    void *kvirt;                /* INVALID_ADDRESS once no page is backed by the folio */
+    u64 phys;
+    int backed;                 /* pages using folio memory */
+    int members;                /* pages referring to the folio */
+} *pagecache_folio;
+
 typedef struct pagecache {
     word total_pages;
     int page_order;
@@ -31,11 +37,13 @@ typedef struct pagecache {
     heap physical;
     heap completions;
     heap pp_heap;
+    heap folio_heap;            /* zero if folios are disabled */
 
     void *zero_page;            /* for zero-fill dma */
 
     /* state_lock covers list access, page state changes and
-       alterations to page completion vecs */
+       alterations to page completion vecs; cache hits on filled pages
+       don't take it (see page_get_if_filled()) */
 #ifdef KERNEL
     struct spinlock state_lock;
     struct spinlock global_lock;
@@ -47,12 +55,36 @@ typedef struct pagecache {
     struct list volumes;
     struct list shared_maps;
 
+    /* replacement policy; see balance_page_lists_locked() */
+    u64 evictions;              /* eviction clock, advanced on each release of a filled page */
+    u64 refaults;               /* reloads of pages with eviction data */
+    u64 refault_activations;    /* refaults close enough to be activated on reload */
+    u64 active_target;          /* percent of resident pages to keep on the active list */
+    u64 active_min;
+    u64 folios;                 /* folios with memory allocated */
+    u64 folios_released;        /* folios whose memory has been freed, under state lock */
+
+    /* dirty limits and writeback pacing; see pagecache_writeback_pass() */
+    u64 dirty_pages;            /* pages in DIRTY state */
+    u64 memory_pages;           /* physical memory the dirty ratios refer to */
+    u64 dirty_background_ratio;
+    u64 dirty_ratio;
+    u64 dirty_background_pages;
+    u64 dirty_limit_pages;      /* writers are throttled above this many dirty and writing pages */
+    struct list throttled_writes;   /* page_completions resuming deferred writes */
+    u64 throttled;              /* writes deferred since boot */
+    u64 written_bytes;          /* bytes committed by writeback passes */
+    u64 writeback_rate;         /* estimated device bandwidth, in bytes per second */
+    u64 pass_limit;             /* current writeback pass */
+    u64 pass_bytes;
+    timestamp pass_start;
+    boolean writeback_flush;    /* periodic writeback: keep going until no dirty data is left */
+
     boolean writeback_in_progress;
     struct timer scan_timer;
     closure_struct(pagecache_scan_timer, do_scan_timer);
     closure_struct(pagecache_writeback_complete, writeback_complete);
-    closure_struct(pagecache_page_compare, page_compare);
-    closure_struct(pagecache_page_print_key, page_print_key);
+    closure_struct(pagecache_writeback_pass, writeback_pass);
 } *pagecache;
 
 typedef struct pagecache_volume {
@@ -80,7 +112,7 @@ typedef struct pagecache_node {
 #ifdef KERNEL
     struct spinlock pages_lock;
 #endif
-    struct rbtree pages;
+    struct radix_tree pages;    /* indexed by page offset */
     rangemap shared_maps;       /* shared mappings associated with this node */
     struct rangemap dirty;
     queue dirty_commits;
@@ -106,7 +138,7 @@ typedef struct pagecache_shared_map {
 
 #define PAGECACHE_PAGESTATE_SHIFT   61
 
-#define PAGECACHE_PAGESTATE_FREE    0 /* evicted, yet remains in search tree and retains refault data */
+#define PAGECACHE_PAGESTATE_FREE    0 /* evicted, yet remains in search tree and retains refault data (ghost) */
 #define PAGECACHE_PAGESTATE_EVICTED 1 /* evicted, awaiting release by user (not on list) */
 #define PAGECACHE_PAGESTATE_ALLOC   2 /* allocated, request not issued (not on list) */
 #define PAGECACHE_PAGESTATE_READING 3 /* block reads issued (not on list) */
@@ -121,19 +153,22 @@ declare_closure_struct(2, 0, void, pagecache_page_read_release,
                        pagecache, pc, pagecache_page, pp);
 
 struct pagecache_page {
-    struct rbnode rbnode;
-    struct refcount read_refcount;  /* 24 */
-    u64 state_offset;           /* 40 - state and offset in pages */
-    void *kvirt;                /* 48 */
-    int write_count;            /* 56 */
-    int refcount;               /* 60 */
+    struct refcount read_refcount;  /* 0 */
+    u64 state_offset;           /* 16 - state and offset in pages */
+    void *kvirt;                /* 24 */
+    int write_count;            /* 32 */
+    int refcount;               /* 36 - atomic */
+    pagecache_node node;        /* 40 */
+    struct list l;              /* 48 */
     /* end of first cacheline */
 
-    pagecache_node node;
-    struct list l;
     u64 phys;                   /* physical address */
     struct list bh_completions; /* default for non-kernel use */
 
     closure_struct(pagecache_page_read_release, read_release);
     boolean evicted;
+    boolean referenced;         /* hit since last LRU scan, set without state lock */
+    boolean evicted_active;     /* page was on the active list when released */
+    u64 eviction;               /* eviction clock at release; zero if no refault data */
+    pagecache_folio folio;      /* zero if not part of a folio */
 };
@@ -19,6 +19,21 @@ BSS_RO_AFTER_INIT static vector devices;
 BSS_RO_AFTER_INIT static vector drivers;
 static struct spinlock pci_lock;
 BSS_RO_AFTER_INIT static heap virtual_page;
+BSS_RO_AFTER_INIT static heap pci_heap;
+
+/* MSI-X interrupt affinity */
+typedef struct pci_msix_irq {
+    pci_dev dev;
+    int slot;
+    u64 vector;
+    const char *name;
+    u32 target_cpu;
+    boolean masked;
+} *pci_msix_irq;
+
+BSS_RO_AFTER_INIT static table msix_irqs;   /* interrupt vector -> pci_msix_irq */
+static tuple irq_affinity;                  /* interrupt name -> CPU overrides */
+static u32 next_irq_cpu;
 
 static u32 pci_bar_len(pci_dev dev, int bar)
 {
@@ -163,34 +178,160 @@ u64 pci_msix_table_slot_addr(pci_dev dev, int msi_slot)
     return pci_msix_table_addr(dev) + (msi_slot * sizeof(u32) * 4);
 }
 
-u64 pci_setup_msix(pci_dev dev, int msi_slot, thunk h, const char *name)
+static void pci_msix_write_entry(pci_dev dev, int msi_slot, u32 address, u32 data,
+                                 boolean masked)
 {
-    pci_debug("%s: msi %d: %s\n", __func__, msi_slot, name);
-
-    u32 address, data;
-    u64 vector = pci_platform_allocate_msi(dev, h, name, &address, &data);
-    if (vector == INVALID_PHYSICAL)
-        return vector;
-
     u64 slot_addr = pci_msix_table_slot_addr(dev, msi_slot);
-    pci_debug("   vector %d, address 0x%x, data 0x%x, table slot addr 0x%lx\n",
-              vector, address, data, slot_addr);
+    pci_debug("   msi %d: address 0x%x, data 0x%x, table slot addr 0x%lx\n",
+              msi_slot, address, data, slot_addr);
+    /* mask the entry while it is being updated */
+    mmio_write_32(slot_addr + (sizeof(u32) * 3), 1);
     mmio_write_32(slot_addr + (sizeof(u32) * 0), address);
     mmio_write_32(slot_addr + (sizeof(u32) * 1), 0);
     mmio_write_32(slot_addr + (sizeof(u32) * 2), data);
-    mmio_write_32(slot_addr + (sizeof(u32) * 3), 0);
+    if (!masked)
+        mmio_write_32(slot_addr + (sizeof(u32) * 3), 0);
+}
+
+/* An irq_affinity entry for the interrupt name, if any, overrides the CPU
+   requested by the driver. */
+static u32 pci_msix_override_cpu(const char *name, u32 target_cpu)
+{
+    u64 cpu;
+    if (irq_affinity && get_u64(irq_affinity, sym_this(name), &cpu)) {
+        if (cpu < total_processors)
+            return cpu;
+        msg_err("invalid CPU %ld for interrupt \"%s\"\n", cpu, name);
+    }
+    return target_cpu;
+}
+
+/* Default interrupt placement: spread vectors round-robin across CPUs. */
+static u32 pci_msix_next_cpu(void)
+{
+    return fetch_and_add_32(&next_irq_cpu, 1) % total_processors;
+}
+
+u64 pci_setup_msix_cpu(pci_dev dev, int msi_slot, thunk h, const char *name, u32 target_cpu)
+{
+    target_cpu = pci_msix_override_cpu(name, target_cpu);
+    pci_debug("%s: msi %d: %s, cpu %d\n", __func__, msi_slot, name, target_cpu);
+
+    pci_msix_irq mi = allocate(pci_heap, sizeof(*mi));
+    if (mi == INVALID_ADDRESS)
+        return INVALID_PHYSICAL;
+    u32 address, data;
+    u64 vector = pci_platform_allocate_msi(dev, h, name, target_cpu, &address, &data);
+    if (vector == INVALID_PHYSICAL) {
+        deallocate(pci_heap, mi, sizeof(*mi));
+        return vector;
+    }
+    pci_msix_write_entry(dev, msi_slot, address, data, false);
+    mi->dev = dev;
+    mi->slot = msi_slot;
+    mi->vector = vector;
+    mi->name = name;
+    mi->target_cpu = target_cpu;
+    mi->masked = false;
+    spin_lock(&pci_lock);
+    table_set(msix_irqs, pointer_from_u64(vector), mi);
+    spin_unlock(&pci_lock);
     return vector;
 }
 
+u64 pci_setup_msix(pci_dev dev, int msi_slot, thunk h, const char *name)
+{
+    return pci_setup_msix_cpu(dev, msi_slot, h, name, pci_msix_next_cpu());
+}
+
+static void pci_msix_retarget(pci_msix_irq mi, u32 target_cpu)
+{
+    u32 address, data;
+    pci_debug("%s: %s (vector %d) to cpu %d\n", __func__, mi->name, mi->vector, target_cpu);
+    msi_format(&address, &data, mi->vector, target_cpu);
+    pci_msix_write_entry(mi->dev, mi->slot, address, data, mi->masked);
+    mi->target_cpu = target_cpu;
+}
+
+/* Called with pci_lock held. */
+static pci_msix_irq pci_msix_lookup(pci_dev dev, int msi_slot)
+{
+    table_foreach(msix_irqs, v, p) {
+        (void)v;
+        pci_msix_irq mi = p;
+        if ((mi->dev == dev) && (mi->slot == msi_slot))
+            return mi;
+    }
+    return 0;
+}
+
+boolean pci_set_msix_target(pci_dev dev, int msi_slot, u32 target_cpu)
+{
+    if (target_cpu >= total_processors)
+        return false;
+    spin_lock(&pci_lock);
+    pci_msix_irq mi = pci_msix_lookup(dev, msi_slot);
+    if (mi)
+        pci_msix_retarget(mi, target_cpu);
+    spin_unlock(&pci_lock);
+    return (mi != 0);
+}
+
+/* A masked vector does not generate interrupts; an interrupt raised by the device while the vector
+ * is masked is delivered when the vector is unmasked. */
+boolean pci_mask_msix(pci_dev dev, int msi_slot, boolean mask)
+{
+    spin_lock(&pci_lock);
+    pci_msix_irq mi = pci_msix_lookup(dev, msi_slot);
+    if (mi) {
+        mi->masked = mask;
+        mmio_write_32(pci_msix_table_slot_addr(dev, msi_slot) + (sizeof(u32) * 3), mask ? 1 : 0);
+    }
+    spin_unlock(&pci_lock);
+    return (mi != 0);
+}
+
 void pci_teardown_msix(pci_dev dev, int msi_slot)
 {
     u64 slot_addr = pci_msix_table_slot_addr(dev, msi_slot);
     int v = msi_get_vector(mmio_read_32(slot_addr + sizeof(u32) * 2));
     pci_debug("%s: table slot addr 0x%lx, msi %d: int %d\n", __func__, slot_addr, msi_slot, v);
     mmio_write_32(slot_addr + (sizeof(u32) * 3), 1); /* set Masked bit to 1 */
+    spin_lock(&pci_lock);
+    pci_msix_irq mi = table_remove(msix_irqs, pointer_from_u64((u64)v));
+    spin_unlock(&pci_lock);
+    if (mi)
+        deallocate(pci_heap, mi, sizeof(*mi));
     pci_platform_deallocate_msi(dev, v);
 }
 
+closure_function(0, 1, boolean, irq_affinity_notify,
+                 value, v)
+{
+    if (v && !is_tuple(v)) {
+        msg_err("irq_affinity must be a tuple\n");
+        return false;
+    }
+    spin_lock(&pci_lock);
+    irq_affinity = v;
+    table_foreach(msix_irqs, vec, p) {
+        (void)vec;
+        pci_msix_irq mi = p;
+        u32 target_cpu = pci_msix_override_cpu(mi->name, mi->target_cpu);
+        if (target_cpu != mi->target_cpu)
+            pci_msix_retarget(mi, target_cpu);
+    }
+    spin_unlock(&pci_lock);
+    return true;
+}
+
+/* The irq_affinity tuple in the root maps interrupt names to CPU numbers, and
+   can be changed at runtime to move MSI-X interrupts between CPUs. */
+void pci_config_irq_affinity(tuple root)
+{
+    register_root_notify(sym(irq_affinity), closure(pci_heap, irq_affinity_notify));
+}
+
 void pci_disable_msix(pci_dev dev)
 {
     u32 cp = pci_find_cap(dev, PCIY_MSIX);
@@ -442,6 +583,9 @@ void init_pci(kernel_heaps kh)
 {
     // should use the global node space
     virtual_page = (heap)heap_virtual_page(kh);
+    pci_heap = heap_locked(kh);
+    msix_irqs = allocate_table(pci_heap, identity_key, pointer_equal);
+    assert(msix_irqs != INVALID_ADDRESS);
     pci_bridges = allocate_rangemap(heap_general(kh));
     assert(pci_bridges != INVALID_ADDRESS);
     devices = allocate_vector(heap_general(kh), 8);
@@ -20,11 +20,10 @@ BSS_RO_AFTER_INIT static int wakeup_vector;
 BSS_RO_AFTER_INIT int shutdown_vector;
 boolean shutting_down;
 
-BSS_RO_AFTER_INIT queue bhqueue;                  /* kernel from interrupt */
-BSS_RO_AFTER_INIT queue runqueue;
-BSS_RO_AFTER_INIT queue async_queue_1;            /* queue of async 1 arg completions */
 BSS_RO_AFTER_INIT bitmap idle_cpu_mask;
 
+static timestamp haltpoll_max;    /* zero if halt polling is disabled */
+
 BSS_RO_AFTER_INIT timerqueue kernel_timers;
 BSS_RO_AFTER_INIT thunk timer_interrupt_handler;
 
@@ -34,6 +33,9 @@ NOTRACE void __attribute__((noreturn)) kernel_sleep(void)
     // handler...we shouldn't return here if we do get interrupted
     cpuinfo ci = current_cpu();
     sched_debug("sleep\n");
+    /* if coming from halt polling, the idle period started when polling did */
+    if (haltpoll_max && !ci->idle_start)
+        ci->idle_start = now(CLOCK_ID_MONOTONIC_RAW);
     ci->state = cpu_idle;
     bitmap_set_atomic(idle_cpu_mask, ci->id, 1);
 
@@ -61,6 +63,20 @@ static void wakeup_cpu(u64 cpu)
     }
 }
 
+/* Hand off a bottom half to another CPU; the target CPU is woken up if idle
+   or interrupted if running a user thread, so that it enters the runloop. */
+void async_apply_bh_cpu(u64 cpu, thunk t)
+{
+    cpuinfo ci = cpuinfo_from_id(cpu);
+    assert(enqueue_irqsafe(ci->bhqueue, t));
+    if (cpu == current_cpu()->id)
+        return;
+    if (bitmap_test_and_set_atomic(idle_cpu_mask, cpu, 0) || (ci->state == cpu_user)) {
+        sched_debug("bh handoff to CPU %d\n", cpu);
+        send_ipi(cpu, wakeup_vector);
+    }
+}
+
 static sched_task migrate_to_self(sched_task t, u64 first_cpu, u64 ncpus)
 {
     u64 cpu;
@@ -68,11 +84,13 @@ static sched_task migrate_to_self(sched_task t, u64 first_cpu, u64 ncpus)
             ((cpu = bitmap_range_get_first(idle_cpu_mask, first_cpu, ncpus)) != INVALID_PHYSICAL)) {
         cpuinfo cpui = cpuinfo_from_id(cpu);
         if (t == INVALID_ADDRESS) {
-            t = sched_dequeue(&cpui->thread_queue);
+            t = sched_dequeue_for_cpu(&cpui->thread_queue, current_cpu()->id);
             if (t != INVALID_ADDRESS)
                 sched_debug("migrating thread from idle CPU %d to self\n", cpu);
         }
-        if ((t != INVALID_ADDRESS) && !sched_queue_empty(&cpui->thread_queue))
+        /* Tasks left in the queue are either in excess or cannot run on this
+           CPU due to their affinity. */
+        if (!sched_queue_empty(&cpui->thread_queue))
             wakeup_cpu(cpu);
         ncpus -= cpu - first_cpu + 1;
         first_cpu = cpu + 1;
@@ -89,9 +107,9 @@ static void migrate_from_self(cpuinfo ci, u64 first_cpu, u64 ncpus)
         sched_task task;
         if (!sched_queue_empty(&cpui->thread_queue)) {
             wakeup_cpu(cpu);
-        } else if ((task = sched_dequeue(&ci->thread_queue)) != INVALID_ADDRESS) {
+        } else if ((task = sched_dequeue_for_cpu(&ci->thread_queue, cpu)) != INVALID_ADDRESS) {
             sched_debug("migrating thread from self to idle CPU %d\n", cpu);
-            sched_enqueue(&cpui->thread_queue, task);
+            sched_thread_enqueue(cpui, task);
             wakeup_cpu(cpu);
         }
         ncpus -= cpu - first_cpu + 1;
@@ -124,24 +142,35 @@ closure_function(0, 0, void, timer_interrupt_handler_fn)
     schedule_timer_service();
 }
 
+static inline void run_thunk(thunk t)
+{
+    context c = context_from_closure(t);
+    sched_debug(" run: %F state: %s context: %p\n", t, state_strings[current_cpu()->state], c);
+    if (c)
+        context_apply(c, t);
+    else
+        apply(t);
+}
+
 static inline void service_thunk_queue(queue q)
 {
     thunk t;
-    context c;
-    while ((t = dequeue(q)) != INVALID_ADDRESS) {
-        c = context_from_closure(t);
-        sched_debug(" run: %F state: %s context: %p\n", t, state_strings[current_cpu()->state], c);
-        if (c)
-            context_apply(c, t);
-        else
-            apply(t);
-    }
+    while ((t = dequeue_single(q)) != INVALID_ADDRESS)
+        run_thunk(t);
+}
+
+/* Items re-enqueued while the queue is being serviced are left for the next pass. */
+static inline void service_poll_queue(queue q)
+{
+    thunk t;
+    for (u64 n = queue_length(q); (n > 0) && ((t = dequeue_single(q)) != INVALID_ADDRESS); n--)
+        run_thunk(t);
 }
 
 static inline void service_async_1(queue q)
 {
     struct applied_async_1 aa;
-    while (dequeue_n_irqsafe(q, (void **)&aa, sizeof(aa) / sizeof(u64))) {
+    while (dequeue_n_single(q, (void **)&aa, sizeof(aa) / sizeof(u64))) {
         sched_debug(" run: %F arg0: 0x%lx\n", aa.a, aa.arg0);
         context c = context_from_closure(aa.a);
         if (c)
@@ -151,15 +180,89 @@ static inline void service_async_1(queue q)
     }
 }
 
+static inline boolean cpu_has_work(cpuinfo ci)
+{
+    return (queue_length(ci->cpu_queue) || queue_length(ci->async_queue_1) ||
+            queue_length(ci->bhqueue) || queue_length(ci->runqueue) ||
+            queue_length(ci->pollqueue) ||
+            (!shutting_down && !sched_queue_empty(&ci->thread_queue)));
+}
+
+/* Halt polling, modeled after the Linux guest haltpoll governor: before going
+   to sleep, an idle CPU spins on its queues for an interval that adapts to
+   recent idle periods. The interval grows when the CPU is woken up shortly
+   after it stopped polling, and shrinks when the CPU stays idle longer than the
+   maximum interval, in which case polling would have been wasted. */
+static void haltpoll_adjust(cpuinfo ci, timestamp idle)
+{
+    timestamp interval = ci->haltpoll_interval;
+    if (idle > haltpoll_max) {
+        interval /= HALTPOLL_SHRINK_FACTOR;
+        if (interval < nanoseconds(HALTPOLL_GROW_START_NS))
+            interval = 0;
+    } else if (idle > interval) {
+        interval = interval ? interval * HALTPOLL_GROW_FACTOR : nanoseconds(HALTPOLL_GROW_START_NS);
+        interval = MIN(interval, haltpoll_max);
+    }
+    ci->haltpoll_interval = interval;
+}
+
+/* Called with interrupts disabled; returns true if work is found before the
+   polling interval expires. Interrupts are enabled while polling, and an
+   interrupt re-enters the runloop as it would during kernel_sleep(). */
+static boolean haltpoll(cpuinfo ci)
+{
+    timestamp interval = ci->haltpoll_interval;
+    if (interval == 0)
+        return false;
+    timestamp start = now(CLOCK_ID_MONOTONIC_RAW);
+    timestamp elapsed;
+    ci->idle_start = start;
+    ci->haltpolling = true;
+    ci->state = cpu_idle;
+    enable_interrupts();
+    do {
+        kern_pause();
+        if (cpu_has_work(ci)) {
+            disable_interrupts();
+            ci->haltpolling = false;
+            ci->idle_start = 0;
+            ci->state = cpu_kernel;
+            ci->haltpoll_success++;
+            ci->haltpoll_time += now(CLOCK_ID_MONOTONIC_RAW) - start;
+            return true;
+        }
+        elapsed = now(CLOCK_ID_MONOTONIC_RAW) - start;
+    } while (elapsed < interval);
+    disable_interrupts();
+    ci->haltpolling = false;
+    ci->state = cpu_kernel;
+    ci->haltpoll_fail++;
+    ci->haltpoll_time += elapsed;
+    return false;
+}
+
 NOTRACE void __attribute__((noreturn)) runloop_internal(void)
 {
     cpuinfo ci = current_cpu();
 
     disable_interrupts();
+    if (ci->idle_start) {
+        /* woken up from halt polling or sleep */
+        timestamp idle = now(CLOCK_ID_MONOTONIC_RAW) - ci->idle_start;
+        if (ci->haltpolling) {
+            ci->haltpolling = false;
+            ci->haltpoll_success++;
+            ci->haltpoll_time += idle;
+        } else if (haltpoll_max) {
+            haltpoll_adjust(ci, idle);
+        }
+        ci->idle_start = 0;
+    }
     sched_debug("runloop from %s c: %d  a1: %d b:%d  r:%d  t:%d\n",
                 state_strings[ci->state], queue_length(ci->cpu_queue),
-                queue_length(async_queue_1), queue_length(bhqueue),
-                queue_length(runqueue), sched_queue_length(&ci->thread_queue));
+                queue_length(ci->async_queue_1), queue_length(ci->bhqueue),
+                queue_length(ci->runqueue), sched_queue_length(&ci->thread_queue));
     ci->state = cpu_kernel;
     /* Make sure TLB entries are appropriately flushed before doing any work */
     page_invalidate_flush();
@@ -169,12 +272,15 @@ NOTRACE void __attribute__((noreturn)) runloop_internal(void)
     service_thunk_queue(ci->cpu_queue);
 
     /* bhqueue is for deferred operations, enqueued by interrupt handlers */
-    service_thunk_queue(bhqueue);
+    service_thunk_queue(ci->bhqueue);
 
     /* serve deferred status_handlers, some of which may not return */
-    service_async_1(async_queue_1);
+    service_async_1(ci->async_queue_1);
 
-    service_thunk_queue(runqueue);
+    service_thunk_queue(ci->runqueue);
+
+    /* device pollers, one pass */
+    service_poll_queue(ci->pollqueue);
 
     /* should be a list of per-runloop checks - also low-pri background */
     mm_service();
@@ -202,7 +308,7 @@ NOTRACE void __attribute__((noreturn)) runloop_internal(void)
                         break;
                     cpuinfo cpui = cpuinfo_from_id(cpu);
                     if (cpui->state == cpu_user) {
-                        t = sched_dequeue(&cpui->thread_queue);
+                        t = sched_dequeue_for_cpu(&cpui->thread_queue, ci->id);
                         if (t != INVALID_ADDRESS) {
                             sched_debug("migrating thread from CPU %d to self\n", cpu);
                             break;
@@ -237,12 +343,10 @@ NOTRACE void __attribute__((noreturn)) runloop_internal(void)
     }
 
     /* We want to pick up items that were enqueued during this last pass, else
-       runnable items may get stuck waiting for the next interrupt.
-
-       Find cost of sleep / wakeup and consider spinning this check for that interval. */
-    if (queue_length(ci->cpu_queue) || queue_length(async_queue_1) ||
-        queue_length(bhqueue) || queue_length(runqueue) ||
-        (!shutting_down && !sched_queue_empty(&ci->thread_queue)))
+       runnable items may get stuck waiting for the next interrupt. If enabled,
+       keep polling for new items for an interval that approximates the cost of
+       sleep / wakeup. */
+    if (cpu_has_work(ci) || (haltpoll_max && !shutting_down && haltpoll(ci)))
         goto retry;
 
     kernel_sleep();
@@ -275,14 +379,75 @@ void init_scheduler(heap h)
     shutdown_vector = allocate_ipi_interrupt();
     register_interrupt(shutdown_vector, closure(h, global_shutdown), "shutdown ipi");
     assert(wakeup_vector != INVALID_PHYSICAL);
-
-    /* scheduling queues init */
-    bhqueue = allocate_queue(h, BHQUEUE_SIZE);
-    runqueue = allocate_queue(h, RUNQUEUE_SIZE);
-    async_queue_1 = allocate_queue(h, ASYNC_QUEUE_1_SIZE);
     shutting_down = false;
 }
 
+closure_function(0, 1, boolean, halt_poll_ns_notify,
+                 value, v)
+{
+    u64 ns;
+    if (!v || !u64_from_value(v, &ns))
+        ns = 0;
+    haltpoll_max = nanoseconds(ns);
+    if (!haltpoll_max) {
+        for (int i = 0; i < total_processors; i++)
+            cpuinfo_from_id(i)->haltpoll_interval = 0;
+    }
+    return true;
+}
+
+#define haltpoll_stat_sum(field) ({                     \
+    u64 __sum = 0;                                      \
+    for (int i = 0; i < total_processors; i++)          \
+        __sum += cpuinfo_from_id(i)->field;             \
+    __sum;                                              \
+})
+
+closure_function(1, 0, value, haltpoll_get_success,
+                 value, v)
+{
+    return value_rewrite_u64(bound(v), haltpoll_stat_sum(haltpoll_success));
+}
+
+closure_function(1, 0, value, haltpoll_get_fail,
+                 value, v)
+{
+    return value_rewrite_u64(bound(v), haltpoll_stat_sum(haltpoll_fail));
+}
+
+closure_function(1, 0, value, haltpoll_get_poll_time_ns,
+                 value, v)
+{
+    return value_rewrite_u64(bound(v), nsec_from_timestamp(haltpoll_stat_sum(haltpoll_time)));
+}
+
+#define register_haltpoll_stat(h, n, t, name)                           \
+    v = value_from_u64(0);                                              \
+    s = sym(name);                                                      \
+    set(t, s, v);                                                       \
+    tuple_notifier_register_get_notify(n, s, closure(h, haltpoll_get_ ##name, v));
+
+/* The halt_poll_ns option in the root tuple sets the maximum halt polling
+   interval, and can be changed at runtime via the management interface;
+   polling statistics (summed across CPUs) are exported in /haltpoll. */
+void init_scheduler_config(tuple root)
+{
+    heap h = heap_locked(get_kernel_heaps());
+    register_root_notify(sym(halt_poll_ns), closure(h, halt_poll_ns_notify));
+
+    value v;
+    symbol s;
+    tuple t = allocate_tuple();
+    assert(t != INVALID_ADDRESS);
+    tuple_notifier n = tuple_notifier_wrap(t);
+    assert(n != INVALID_ADDRESS);
+    register_haltpoll_stat(h, n, t, success);
+    register_haltpoll_stat(h, n, t, fail);
+    register_haltpoll_stat(h, n, t, poll_time_ns);
+    set(t, sym(no_encode), null_value);
+    set(root, sym(haltpoll), n);
+}
+
 void init_scheduler_cpus(heap h)
 {
     idle_cpu_mask = allocate_bitmap(h, h, present_processors);
@@ -306,6 +471,21 @@ boolean sched_queue_init(sched_queue sq, heap h)
     return true;
 }
 
+/* Find a CPU that the task is allowed to run on, preferring idle CPUs. */
+static u64 sched_task_select_cpu(sched_task task)
+{
+    u64 allowed = INVALID_PHYSICAL;
+    for (u64 cpu = 0; cpu < total_processors; cpu++) {
+        if (!bitmap_get(task->affinity, cpu))
+            continue;
+        if (bitmap_get(idle_cpu_mask, cpu))
+            return cpu;
+        if (allowed == INVALID_PHYSICAL)
+            allowed = cpu;
+    }
+    return allowed;
+}
+
 void sched_enqueue(sched_queue sq, sched_task task)
 {
     spin_lock(&sq->lock);
@@ -315,16 +495,70 @@ void sched_enqueue(sched_queue sq, sched_task task)
     spin_unlock(&sq->lock);
 }
 
+/* The task is enqueued on the thread queue of the given CPU unless its
+   affinity excludes that CPU, in which case it is moved to an allowed CPU. */
+void sched_thread_enqueue(cpuinfo ci, sched_task task)
+{
+    u64 target = INVALID_PHYSICAL;
+    if (!sched_task_cpu_allowed(task, ci->id)) {
+        target = sched_task_select_cpu(task);
+        if (target != INVALID_PHYSICAL) {
+            sched_debug("task %p not allowed on CPU %d, moving to CPU %d\n", task, ci->id, target);
+            ci = cpuinfo_from_id(target);
+        }
+    }
+    sched_enqueue(&ci->thread_queue, task);
+    if ((target != INVALID_PHYSICAL) && (target != current_cpu()->id))
+        wakeup_cpu(target);
+}
+
+static void sched_task_dequeued(sched_queue sq, sched_task task)
+{
+    sched_debug("sq %p, dequeued task %p, runtime %T\n", sq, task,
+                task->runtime - sq->min_runtime);
+    sq->min_runtime = task->runtime;
+    task->runtime = 0;
+}
+
 sched_task sched_dequeue(sched_queue sq)
 {
     spin_lock(&sq->lock);
     sched_task task = pqueue_pop(sq->q);
-    if (task != INVALID_ADDRESS) {
-        sched_debug("sq %p, dequeued task %p, runtime %T\n", sq, task,
-                    task->runtime - sq->min_runtime);
-        sq->min_runtime = task->runtime;
-        task->runtime = 0;
+    if (task != INVALID_ADDRESS)
+        sched_task_dequeued(sq, task);
+    spin_unlock(&sq->lock);
+    return task;
+}
+
+closure_function(2, 1, boolean, sched_find_for_cpu,
+                 u64, cpu, sched_task *, found,
+                 void *, v)
+{
+    sched_task task = v;
+    sched_task *found = bound(found);
+    if (sched_task_cpu_allowed(task, bound(cpu)) &&
+        ((*found == INVALID_ADDRESS) || (task->runtime < (*found)->runtime)))
+        *found = task;
+    return true;
+}
+
+/* Dequeue the task with the lowest runtime among those allowed to run on the
+   given CPU, skipping over tasks pinned to other CPUs; used when migrating
+   tasks between CPUs. */
+sched_task sched_dequeue_for_cpu(sched_queue sq, u64 cpu)
+{
+    spin_lock(&sq->lock);
+    sched_task task = pqueue_peek(sq->q);
+    if ((task != INVALID_ADDRESS) && sched_task_cpu_allowed(task, cpu)) {
+        pqueue_pop(sq->q);
+    } else if (task != INVALID_ADDRESS) {
+        task = INVALID_ADDRESS;
+        pqueue_walk(sq->q, stack_closure(sched_find_for_cpu, cpu, &task));
+        if (task != INVALID_ADDRESS)
+            assert(pqueue_remove(sq->q, task));
     }
+    if (task != INVALID_ADDRESS)
+        sched_task_dequeued(sq, task);
     spin_unlock(&sq->lock);
     return task;
 }
@@ -20,6 +20,7 @@ typedef struct volume {
     boolean mounting;
     filesystem fs;
     inode mount_dir;
+    symbol stats_name;
 } *volume;
 
 static struct {
@@ -32,6 +33,7 @@ static struct {
     struct spinlock lock;
     u64 mount_generation;
     vector mounts_watchers;
+    tuple iostats;
 } storage;
 
 #define storage_lock()      u64 _irqflags = spin_lock_irq(&storage.lock)
@@ -130,15 +132,21 @@ closure_function(2, 2, void, volume_link,
         storage_check_if_ready();
 }
 
+/* Mount point options are appended to the mount path, e.g. "/mnt:ro:poll". */
 static void volume_mount(volume v, buffer mount_point)
 {
-    boolean readonly = false;
+    boolean readonly = false, poll = false;
     char *cmount_point = buffer_to_cstring(mount_point);
     int i = buffer_strstr(mount_point, ":ro");
     if (i > 0) {
         cmount_point[i] = 0;
         readonly = true;
     }
+    i = buffer_strstr(mount_point, ":poll");
+    if (i > 0) {
+        cmount_point[i] = 0;
+        poll = true;
+    }
     filesystem fs = storage.root_fs;
     tuple root = filesystem_getroot(storage.root_fs);
     tuple mount_dir_t;
@@ -162,6 +170,8 @@ static void volume_mount(volume v, buffer mount_point)
         return;
     }
     storage_debug("mounting volume%s at %s", readonly ? " readonly" : "", cmount_point);
+    if (poll)
+        storage_set_polling(v->priv, true);
     v->mounting = true;
     apply(v->init_handler, readonly, complete);
 }
@@ -201,6 +211,8 @@ define_closure_function(2, 1, void, storage_simple_req_handler,
     case STORAGE_OP_WRITE:
         apply(bound(write), req->data, req->blocks, req->completion);
         break;
+    default:
+        apply(req->completion, timm("result", "operation not supported"));
     }
 }
 
@@ -221,11 +233,16 @@ void init_volumes(heap h)
     storage.mount_generation = 0;
     storage.mounts_watchers = allocate_vector(h, 1);
     assert(storage.mounts_watchers != INVALID_ADDRESS);
+    storage.iostats = allocate_tuple();
+    assert(storage.iostats != INVALID_ADDRESS);
+    set(storage.iostats, sym(no_encode), null_value);
 }
 
+/* I/O statistics of each volume that supports them are exported in /iostats. */
 void storage_set_root_fs(filesystem root_fs)
 {
     storage.root_fs = root_fs;
+    set(filesystem_getroot(root_fs), sym(iostats), storage.iostats);
     fs_set_path_helper(get_root_fs, storage_get_mountpoint);
 }
 
@@ -282,6 +299,14 @@ boolean volume_add(u8 *uuid, char *label, void *priv, fs_init_handler init_handl
     v->mounting = false;
     v->fs = 0;
     v->mount_dir = 0;
+    if (label[0]) {
+        v->stats_name = sym_this(label);
+    } else {
+        buffer b = little_stack_buffer(2 * UUID_LEN + 4);
+        print_uuid(b, uuid);
+        v->stats_name = intern(b);
+    }
+    storage_register_stats(priv, v->stats_name);
     storage_lock();
     list_push_back(&storage.volumes, &v->l);
     if (storage.mounts) {
@@ -376,6 +401,7 @@ void storage_detach(void *priv, thunk complete)
     storage_unlock();
     if (vol) {
         storage_debug("  detaching volume %p, filesystem %p", vol, vol->fs);
+        set(storage.iostats, vol->stats_name, 0);
         if (vol->fs)
             filesystem_unmount(storage.root_fs, vol->mount_dir, vol->fs, complete);
         else
@@ -411,3 +437,329 @@ static void notify_mount_change_locked(void)
     vector_foreach(storage.mounts_watchers, nh)
         apply(nh, storage.mount_generation);
 }
+
+closure_function(1, 1, void, storage_sync_req_complete,
+                 status *, result,
+                 status, s)
+{
+    *bound(result) = s;
+}
+
+/* Issues a request that is completed before the request handler returns. */
+static boolean storage_sync_req(storage_req_handler req_handler, u8 op, void *data)
+{
+    status s = STATUS_OK;
+    struct storage_req req = {
+        .op = op,
+        .blocks = irange(0, 0),
+        .data = data,
+        .completion = stack_closure(storage_sync_req_complete, &s),
+    };
+    apply(req_handler, &req);
+    if (is_ok(s))
+        return true;
+    storage_debug("request %d failed: %v", op, s);
+    timm_dealloc(s);
+    return false;
+}
+
+boolean storage_set_polling(storage_req_handler req_handler, boolean enable)
+{
+    storage_debug("%s polled completions (%F)", enable ? "enabling" : "disabling", req_handler);
+    if (storage_sync_req(req_handler, STORAGE_OP_SETPOLL, pointer_from_u64((u64)enable)))
+        return true;
+    msg_err("polled completions not supported by storage device\n");
+    return false;
+}
+
+/* Request plugging: SG reads and writes are held until deferred work runs on the submitting CPU
+ * (or until too many are held), then issued in order of starting block, with contiguous requests
+ * of the same type merged into a single request. If the device supports it, the whole batch is
+ * submitted with a single notification. */
+#define STORAGE_PLUG_MAX_REQS   64
+#define STORAGE_PLUG_MAX_BLOCKS ((1 * MB) >> SECTOR_OFFSET)
+
+typedef struct storage_plug_req {
+    struct list l;
+    struct storage_plug_req *next;  /* merged requests */
+    u8 op;
+    range blocks;
+    sg_list sg;
+    status_handler completion;
+} *storage_plug_req;
+
+declare_closure_struct(0, 1, void, storage_plug_req_handler,
+                       storage_req, req);
+declare_closure_struct(0, 0, void, storage_plug_unplug);
+
+typedef struct storage_plug {
+    heap h;
+    storage_req_handler req_handler;
+    struct list reqs;               /* sorted by starting block */
+    u64 count;
+    boolean unplug_scheduled;
+    boolean no_device_plug;         /* STORAGE_OP_PLUG not supported by the device */
+    struct spinlock lock;
+    closure_struct(storage_plug_req_handler, handler);
+    closure_struct(storage_plug_unplug, unplug);
+} *storage_plug;
+
+static void storage_plug_submit(storage_plug p, u8 op, range blocks, void *data,
+                                status_handler completion)
+{
+    struct storage_req req = {
+        .op = op,
+        .blocks = blocks,
+        .data = data,
+        .completion = completion,
+    };
+    apply(p->req_handler, &req);
+}
+
+closure_function(3, 1, void, storage_plug_merged_complete,
+                 storage_plug, p, storage_plug_req, first, sg_list, sg,
+                 status, s)
+{
+    storage_plug p = bound(p);
+    sg_list sg = bound(sg);
+    sg_list_release(sg);
+    deallocate_sg_list(sg);
+    boolean ok = is_ok(s);
+    storage_plug_req r = bound(first);
+    do {
+        storage_plug_req next = r->next;
+        apply(r->completion, s);
+        deallocate(p->h, r, sizeof(*r));
+        if (!ok && next)
+            s = timm("result", "merged storage request failed");
+        r = next;
+    } while (r);
+    closure_finish();
+}
+
+/* Issues the requests chained from first as a single request; the buffers of each request are
+ * moved to the sg list of the merged request. */
+static void storage_plug_issue_merged(storage_plug p, storage_plug_req first, range blocks)
+{
+    sg_list sg = allocate_sg_list();
+    status_handler completion = INVALID_ADDRESS;
+    if (sg != INVALID_ADDRESS) {
+        completion = closure(p->h, storage_plug_merged_complete, p, first, sg);
+        if (completion == INVALID_ADDRESS)
+            deallocate_sg_list(sg);
+    }
+    if (completion == INVALID_ADDRESS) {
+        /* issue the requests individually */
+        storage_plug_req r = first;
+        do {
+            storage_plug_req next = r->next;
+            storage_plug_submit(p, r->op, r->blocks, r->sg, r->completion);
+            deallocate(p->h, r, sizeof(*r));
+            r = next;
+        } while (r);
+        return;
+    }
+    for (storage_plug_req r = first; r; r = r->next)
+        sg_move(sg, r->sg, range_span(r->blocks) << SECTOR_OFFSET);
+    storage_plug_submit(p, first->op, blocks, sg, completion);
+}
+
+static void storage_plug_flush(storage_plug p)
+{
+    struct list reqs;
+    u64 irqflags = spin_lock_irq(&p->lock);
+    list_move(&reqs, &p->reqs);
+    p->count = 0;
+    spin_unlock_irq(&p->lock, irqflags);
+    if (list_empty(&reqs))
+        return;
+    boolean device_plug = !p->no_device_plug;
+    if (device_plug && !storage_sync_req(p->req_handler, STORAGE_OP_PLUG, 0)) {
+        p->no_device_plug = true;
+        device_plug = false;
+    }
+    list l;
+    while ((l = list_get_next(&reqs))) {
+        list_delete(l);
+        storage_plug_req first = struct_from_list(l, storage_plug_req, l);
+        storage_plug_req last = first;
+        range blocks = first->blocks;
+        while ((l = list_get_next(&reqs))) {
+            storage_plug_req r = struct_from_list(l, storage_plug_req, l);
+            if ((r->op != first->op) || (r->blocks.start != blocks.end) ||
+                (range_span(blocks) + range_span(r->blocks) > STORAGE_PLUG_MAX_BLOCKS))
+                break;
+            list_delete(l);
+            last->next = r;
+            last = r;
+            blocks.end = r->blocks.end;
+        }
+        storage_debug("plug: issuing %s %R%s", first->op == STORAGE_OP_WRITESG ? "write" : "read",
+                      blocks, first->next ? " (merged)" : "");
+        if (first->next) {
+            storage_plug_issue_merged(p, first, blocks);
+        } else {
+            storage_plug_submit(p, first->op, first->blocks, first->sg, first->completion);
+            deallocate(p->h, first, sizeof(*first));
+        }
+    }
+    if (device_plug)
+        storage_sync_req(p->req_handler, STORAGE_OP_UNPLUG, 0);
+}
+
+define_closure_function(0, 0, void, storage_plug_unplug)
+{
+    storage_plug p = struct_from_field(closure_self(), storage_plug, unplug);
+    u64 irqflags = spin_lock_irq(&p->lock);
+    p->unplug_scheduled = false;
+    spin_unlock_irq(&p->lock, irqflags);
+    storage_plug_flush(p);
+}
+
+/* Called with the lock held. Returns false if the request cannot be reordered with respect to
+ * the plugged requests. */
+static boolean storage_plug_insert(storage_plug p, storage_plug_req pr)
+{
+    list pos = &p->reqs;
+    list_foreach(&p->reqs, l) {
+        storage_plug_req r = struct_from_list(l, storage_plug_req, l);
+        if (((r->op == STORAGE_OP_WRITESG) || (pr->op == STORAGE_OP_WRITESG)) &&
+            ranges_intersect(r->blocks, pr->blocks))
+            return false;
+        if ((pos == &p->reqs) && (r->blocks.start > pr->blocks.start))
+            pos = l;
+    }
+    list_insert_before(pos, &pr->l);
+    p->count++;
+    return true;
+}
+
+define_closure_function(0, 1, void, storage_plug_req_handler,
+                        storage_req, req)
+{
+    storage_plug p = struct_from_field(closure_self(), storage_plug, handler);
+    switch (req->op) {
+    case STORAGE_OP_READSG:
+    case STORAGE_OP_WRITESG: {
+        storage_plug_req pr = allocate(p->h, sizeof(*pr));
+        if (pr == INVALID_ADDRESS)
+            break;  /* pass the request through */
+        pr->next = 0;
+        pr->op = req->op;
+        pr->blocks = req->blocks;
+        pr->sg = req->data;
+        pr->completion = req->completion;
+        boolean flush, schedule = false;
+        u64 irqflags = spin_lock_irq(&p->lock);
+        while (!storage_plug_insert(p, pr)) {
+            spin_unlock_irq(&p->lock, irqflags);
+            storage_plug_flush(p);
+            irqflags = spin_lock_irq(&p->lock);
+        }
+        flush = (p->count >= STORAGE_PLUG_MAX_REQS);
+        if (!flush && !p->unplug_scheduled) {
+            p->unplug_scheduled = schedule = true;
+        }
+        spin_unlock_irq(&p->lock, irqflags);
+        if (flush)
+            storage_plug_flush(p);
+        else if (schedule)
+            async_apply_bh((thunk)&p->unplug);
+        return;
+    }
+    case STORAGE_OP_FLUSH:
+    case STORAGE_OP_DISCARD:
+        /* plugged writes must reach the device first */
+        storage_plug_flush(p);
+        break;
+    }
+    apply(p->req_handler, req);
+}
+
+/* Returns a request handler that plugs and merges SG requests before passing them to
+ * req_handler. */
+storage_req_handler storage_plug_handler(heap h, storage_req_handler req_handler)
+{
+    storage_plug p = allocate(h, sizeof(*p));
+    if (p == INVALID_ADDRESS)
+        return req_handler;
+    p->h = h;
+    p->req_handler = req_handler;
+    list_init(&p->reqs);
+    p->count = 0;
+    p->unplug_scheduled = false;
+    p->no_device_plug = false;
+    spin_lock_init(&p->lock);
+    init_closure(&p->unplug, storage_plug_unplug);
+    return init_closure(&p->handler, storage_plug_req_handler);
+}
+
+enum storage_stat {
+    STORAGE_STAT_READS,
+    STORAGE_STAT_READ_AVG,
+    STORAGE_STAT_READ_MAX,
+    STORAGE_STAT_WRITES,
+    STORAGE_STAT_WRITE_AVG,
+    STORAGE_STAT_WRITE_MAX,
+};
+
+closure_function(3, 0, value, storage_stat_get,
+                 storage_req_handler, req_handler, int, stat, value, v)
+{
+    struct storage_stats stats;
+    zero(&stats, sizeof(stats));
+    storage_sync_req(bound(req_handler), STORAGE_OP_GETSTATS, &stats);
+    u64 val;
+    switch (bound(stat)) {
+    case STORAGE_STAT_READS:
+        val = stats.reads;
+        break;
+    case STORAGE_STAT_READ_AVG:
+        val = stats.reads ? nsec_from_timestamp(stats.read_time / stats.reads) : 0;
+        break;
+    case STORAGE_STAT_READ_MAX:
+        val = nsec_from_timestamp(stats.read_max);
+        break;
+    case STORAGE_STAT_WRITES:
+        val = stats.writes;
+        break;
+    case STORAGE_STAT_WRITE_AVG:
+        val = stats.writes ? nsec_from_timestamp(stats.write_time / stats.writes) : 0;
+        break;
+    case STORAGE_STAT_WRITE_MAX:
+        val = nsec_from_timestamp(stats.write_max);
+        break;
+    default:
+        val = 0;
+    }
+    return value_rewrite_u64(bound(v), val);
+}
+
+#define register_storage_stat(n, t, name, stat)                                 \
+    v = value_from_u64(0);                                                      \
+    s = sym(name);                                                              \
+    set(t, s, v);                                                               \
+    tuple_notifier_register_get_notify(n, s, closure(storage.h, storage_stat_get, \
+                                                     req_handler, stat, v));
+
+/* Exports the I/O statistics (request counts, average and maximum latency) of a storage device, if
+ * supported by its driver. */
+void storage_register_stats(storage_req_handler req_handler, symbol name)
+{
+    struct storage_stats stats;
+    if (!storage_sync_req(req_handler, STORAGE_OP_GETSTATS, &stats))
+        return;
+    value v;
+    symbol s;
+    tuple t = allocate_tuple();
+    assert(t != INVALID_ADDRESS);
+    tuple_notifier n = tuple_notifier_wrap(t);
+    assert(n != INVALID_ADDRESS);
+    register_storage_stat(n, t, reads, STORAGE_STAT_READS);
+    register_storage_stat(n, t, read_avg_ns, STORAGE_STAT_READ_AVG);
+    register_storage_stat(n, t, read_max_ns, STORAGE_STAT_READ_MAX);
+    register_storage_stat(n, t, writes, STORAGE_STAT_WRITES);
+    register_storage_stat(n, t, write_avg_ns, STORAGE_STAT_WRITE_AVG);
+    register_storage_stat(n, t, write_max_ns, STORAGE_STAT_WRITE_MAX);
+    set(storage.iostats, name, n);
+}
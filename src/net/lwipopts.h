@@ -58,6 +58,9 @@
 
 #define LWIP_CHKSUM_ALGORITHM   3
 
+/* Allows drivers to offload checksum generation to the device. */
+#define LWIP_CHECKSUM_CTRL_PER_NETIF    1
+
 #define LWIP_WND_SCALE 1
 #define TCP_MSS 1460            /* Assuming ethernet; may want to derive this */
 #define TCP_WND 0x34000         /* For maximum throughput should be the same as TCP_SND_BUF */
@@ -1831,7 +1831,7 @@ closure_function(6, 1, void, sendmmsg_complete,
     }
     bound(index)++;
     if (bound(index) < bound(vlen)) {
-        enqueue(runqueue, &bound(next));
+        async_apply((thunk)&bound(next));
         return;
     }
   out:
@@ -1970,7 +1970,7 @@ closure_function(6, 1, void, recvmmsg_complete,
     if (bound(index) < bound(vlen)) {
         if (bound(flags) & MSG_WAITFORONE)
             bound(flags) = (bound(flags) & ~MSG_WAITFORONE) | MSG_DONTWAIT;
-        enqueue(runqueue, &bound(next));
+        async_apply((thunk)&bound(next));
         return;
     }
   out:
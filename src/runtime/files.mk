@@ -17,6 +17,7 @@ RUNTIME=$(SRCDIR)/runtime/bitmap.c \
 	$(SRCDIR)/runtime/queue.c \
 	$(SRCDIR)/runtime/random.c \
 	$(SRCDIR)/runtime/range.c \
+	$(SRCDIR)/runtime/radix.c \
 	$(SRCDIR)/runtime/rbtree.c \
 	$(SRCDIR)/runtime/ringbuf.c \
 	$(SRCDIR)/runtime/runtime_init.c \
@@ -0,0 +1,205 @@
+#include <runtime.h>
+
+//#define RADIX_DEBUG
+#ifdef RADIX_DEBUG
+#define radix_debug(x, ...) do {rprintf("RADIX %s: " x, __func__, ##__VA_ARGS__);} while(0)
+#else
+#define radix_debug(x, ...)
+#endif
+
+#define RADIX_MAX_DEPTH ((64 + RADIX_SHIFT - 1) / RADIX_SHIFT)
+
+static inline boolean radix_node_covers(radix_node n, u64 index)
+{
+    int bits = n->shift + RADIX_SHIFT;
+    return (bits >= 64) || ((index >> bits) == 0);
+}
+
+static inline u64 radix_slot(radix_node n, u64 index)
+{
+    return (index >> n->shift) & (RADIX_SLOTS - 1);
+}
+
+/* index of the first entry that can be stored below slot i of n */
+static inline u64 radix_slot_base(radix_node n, u64 index, u64 i)
+{
+    int bits = n->shift + RADIX_SHIFT;
+    u64 prefix = (bits >= 64) ? 0 : (index & ~MASK(bits));
+    return prefix | (i << n->shift);
+}
+
+static radix_node radix_node_alloc(radix_tree t, int shift)
+{
+    radix_node n = allocate(t->h, sizeof(struct radix_node));
+    if (n == INVALID_ADDRESS)
+        return n;
+    zero(n, sizeof(*n));
+    n->shift = shift;
+    return n;
+}
+
+boolean radix_insert(radix_tree t, u64 index, void *p)
+{
+    radix_debug("tree %p, index 0x%lx, p %p\n", t, index, p);
+    assert(p);
+    radix_node n = t->root;
+    if (!n) {
+        n = radix_node_alloc(t, 0);
+        if (n == INVALID_ADDRESS)
+            return false;
+        write_barrier();
+        t->root = n;
+    }
+    while (!radix_node_covers(n, index)) {
+        radix_node r = radix_node_alloc(t, n->shift + RADIX_SHIFT);
+        if (r == INVALID_ADDRESS)
+            return false;
+        r->slots[0] = n;
+        r->bitmap = 1;
+        write_barrier();
+        t->root = n = r;
+    }
+    while (n->shift) {
+        u64 s = radix_slot(n, index);
+        radix_node c = n->slots[s];
+        if (!c) {
+            c = radix_node_alloc(t, n->shift - RADIX_SHIFT);
+            if (c == INVALID_ADDRESS)
+                return false;
+            write_barrier();
+            n->slots[s] = c;
+            n->bitmap |= U64_FROM_BIT(s);
+        }
+        n = c;
+    }
+    u64 s = radix_slot(n, index);
+    if (n->bitmap & U64_FROM_BIT(s))
+        return false;
+    write_barrier();
+    n->slots[s] = p;
+    n->bitmap |= U64_FROM_BIT(s);
+    t->count++;
+    return true;
+}
+
+void *radix_lookup(radix_tree t, u64 index)
+{
+    radix_node n = t->root;
+    if (!n || !radix_node_covers(n, index))
+        return INVALID_ADDRESS;
+    while (1) {
+        void *c = n->slots[radix_slot(n, index)];
+        if (!c)
+            return INVALID_ADDRESS;
+        if (n->shift == 0)
+            return c;
+        n = c;
+    }
+}
+
+void *radix_remove(radix_tree t, u64 index)
+{
+    radix_debug("tree %p, index 0x%lx\n", t, index);
+    radix_node path[RADIX_MAX_DEPTH];
+    int depth = 0;
+    radix_node n = t->root;
+    if (!n || !radix_node_covers(n, index))
+        return INVALID_ADDRESS;
+    while (n->shift) {
+        path[depth++] = n;
+        n = n->slots[radix_slot(n, index)];
+        if (!n)
+            return INVALID_ADDRESS;
+    }
+    u64 s = radix_slot(n, index);
+    void *p = n->slots[s];
+    if (!p)
+        return INVALID_ADDRESS;
+    n->slots[s] = 0;
+    n->bitmap &= ~U64_FROM_BIT(s);
+    t->count--;
+
+    /* free emptied nodes below the root */
+    while (!n->bitmap && (depth > 0)) {
+        radix_node parent = path[--depth];
+        s = radix_slot(parent, index);
+        parent->slots[s] = 0;
+        parent->bitmap &= ~U64_FROM_BIT(s);
+        deallocate(t->h, n, sizeof(*n));
+        n = parent;
+    }
+    return p;
+}
+
+static void *radix_node_next(radix_node n, u64 index, u64 *found)
+{
+    u64 s = radix_slot(n, index);
+    u64 bits = n->bitmap & ~MASK(s);
+    while (bits) {
+        u64 i = lsb(bits);
+        bits &= ~U64_FROM_BIT(i);
+        void *c = n->slots[i];
+        if (!c)     /* being removed */
+            continue;
+        u64 child_index = (i == s) ? index : radix_slot_base(n, index, i);
+        if (n->shift == 0) {
+            *found = child_index;
+            return c;
+        }
+        void *p = radix_node_next(c, child_index, found);
+        if (p != INVALID_ADDRESS)
+            return p;
+    }
+    return INVALID_ADDRESS;
+}
+
+void *radix_lookup_next(radix_tree t, u64 *index)
+{
+    radix_node n = t->root;
+    if (!n || !radix_node_covers(n, *index))
+        return INVALID_ADDRESS;
+    return radix_node_next(n, *index, index);
+}
+
+boolean radix_traverse(radix_tree t, u64 start, radix_handler h)
+{
+    u64 index = start;
+    void *p;
+    while ((p = radix_lookup_next(t, &index)) != INVALID_ADDRESS) {
+        if (!apply(h, index, p))
+            return false;
+        if (++index == 0)
+            break;
+    }
+    return true;
+}
+
+static void radix_node_destruct(radix_tree t, radix_node n, u64 base, radix_handler destructor)
+{
+    u64 bits = n->bitmap;
+    while (bits) {
+        u64 i = lsb(bits);
+        bits &= ~U64_FROM_BIT(i);
+        u64 index = base | (i << n->shift);
+        if (n->shift)
+            radix_node_destruct(t, n->slots[i], index, destructor);
+        else if (destructor)
+            apply(destructor, index, n->slots[i]);
+    }
+    deallocate(t->h, n, sizeof(*n));
+}
+
+void destruct_radix_tree(radix_tree t, radix_handler destructor)
+{
+    if (t->root)
+        radix_node_destruct(t, t->root, 0, destructor);
+    t->root = 0;
+    t->count = 0;
+}
+
+void init_radix_tree(radix_tree t, heap h)
+{
+    t->root = 0;
+    t->count = 0;
+    t->h = h;
+}
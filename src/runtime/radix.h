@@ -0,0 +1,48 @@
+/* Radix tree mapping u64 indices to pointers, with 64 slots per node.
+
+   Writers must be serialized by the caller. A lookup of an entry which cannot be removed
+   concurrently (e.g. because the caller holds a reference to it) is safe without taking the
+   writer lock: nodes are published only after being initialized, the tree only grows in height,
+   and a node is freed only when it becomes empty. */
+
+#define RADIX_SHIFT 6
+#define RADIX_SLOTS U64_FROM_BIT(RADIX_SHIFT)
+
+typedef struct radix_node {
+    u64 bitmap;                 /* occupied slots */
+    int shift;                  /* index bits below this level; zero for leaf nodes */
+    void *slots[RADIX_SLOTS];
+} *radix_node;
+
+typedef struct radix_tree {
+    radix_node root;
+    u64 count;
+    heap h;
+} *radix_tree;
+
+typedef closure_type(radix_handler, boolean, u64 index, void *p);
+
+void init_radix_tree(radix_tree t, heap h);
+
+/* p must not be null. Returns false if the index is already occupied or on allocation failure. */
+boolean radix_insert(radix_tree t, u64 index, void *p);
+
+/* Returns INVALID_ADDRESS if not found. */
+void *radix_lookup(radix_tree t, u64 index);
+void *radix_remove(radix_tree t, u64 index);
+
+/* Returns the first entry at or after *index and stores its index in *index, or
+   INVALID_ADDRESS if there is none. */
+void *radix_lookup_next(radix_tree t, u64 *index);
+
+/* Visits entries in index order, from the first entry at or after start; stops if the handler
+   returns false, in which case false is returned. */
+boolean radix_traverse(radix_tree t, u64 start, radix_handler h);
+
+/* Calls the destructor (if any) on each entry and frees all nodes. */
+void destruct_radix_tree(radix_tree t, radix_handler destructor);
+
+static inline u64 radix_get_count(radix_tree t)
+{
+    return t->count;
+}
@@ -216,6 +216,7 @@ typedef closure_type(thunk, void);
 #include <status.h>
 #include <pqueue.h>
 #include <rbtree.h>
+#include <radix.h>
 #include <range.h>
 #include <queue.h>
 #include <refcount.h>
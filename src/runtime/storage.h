@@ -77,6 +77,11 @@ enum storage_op {
     STORAGE_OP_READSG,
     STORAGE_OP_WRITESG,
     STORAGE_OP_FLUSH,
+    STORAGE_OP_SETPOLL,     /* data: non-zero to reap completions by polling instead of interrupts */
+    STORAGE_OP_GETSTATS,    /* data: storage_stats, filled in before the request handler returns */
+    STORAGE_OP_PLUG,        /* defer device notification of requests submitted from this CPU */
+    STORAGE_OP_UNPLUG,      /* notify the device of deferred requests (completes synchronously) */
+    STORAGE_OP_DISCARD,     /* blocks: range whose contents are no longer needed */
 };
 
 typedef struct storage_req {
@@ -86,6 +91,38 @@ typedef struct storage_req {
     status_handler completion;
 } *storage_req;
 
+/* I/O statistics; latencies are measured from request submission to completion. */
+typedef struct storage_stats {
+    u64 reads, writes;
+    timestamp read_time, write_time;    /* cumulative */
+    timestamp read_max, write_max;
+} *storage_stats;
+
+static inline void storage_stats_account(storage_stats s, boolean write, timestamp latency)
+{
+    if (write) {
+        s->writes++;
+        s->write_time += latency;
+        if (latency > s->write_max)
+            s->write_max = latency;
+    } else {
+        s->reads++;
+        s->read_time += latency;
+        if (latency > s->read_max)
+            s->read_max = latency;
+    }
+}
+
+static inline void storage_stats_merge(storage_stats dest, storage_stats src)
+{
+    dest->reads += src->reads;
+    dest->writes += src->writes;
+    dest->read_time += src->read_time;
+    dest->write_time += src->write_time;
+    dest->read_max = MAX(dest->read_max, src->read_max);
+    dest->write_max = MAX(dest->write_max, src->write_max);
+}
+
 declare_closure_struct(2, 1, void, storage_simple_req_handler,
                        block_io, read, block_io, write,
                        storage_req, req);
@@ -109,6 +146,9 @@ typedef closure_type(volume_handler, void, u8 *, const char *, struct filesystem
 void storage_iterate(volume_handler vh);
 
 void storage_detach(void *priv, thunk complete);
+storage_req_handler storage_plug_handler(heap h, storage_req_handler req_handler);
+boolean storage_set_polling(storage_req_handler req_handler, boolean enable);
+void storage_register_stats(storage_req_handler req_handler, symbol name);
 typedef closure_type(mount_notification_handler, void, u64);
 void storage_register_mount_notify(mount_notification_handler nh);
 void storage_unregister_mount_notify(mount_notification_handler nh);
@@ -53,22 +53,61 @@ sysreturn sysreturn_from_fs_status_value(status s)
     return rv;
 }
 
+void file_ra_update(struct file_ra *ra, pagecache_node pn, int fadv, u64 offset, u64 len,
+                    u64 limit)
+{
+    if (fadv == POSIX_FADV_RANDOM)  /* no read-ahead */
+        return;
+    u64 init_size, max_size;
+    if (fadv == POSIX_FADV_SEQUENTIAL) {
+        init_size = 2 * FILE_READAHEAD_DEFAULT;
+        max_size = 2 * FILE_READAHEAD_MAX;
+    } else {
+        init_size = FILE_READAHEAD_DEFAULT;
+        max_size = FILE_READAHEAD_MAX;
+    }
+    u64 end = offset + len;
+    u64 prev_pos = ra->prev_pos;
+    ra->prev_pos = end;
+    u64 marker = ra->start + ra->size - ra->async_size;
+    if (ra->size && (offset <= marker) && (marker < end)) {
+        /* The stream reached the lookahead marker: fetch the following window while the current
+         * one is being consumed. */
+        ra->start += ra->size;
+        ra->size = MIN(2 * ra->size, max_size);
+        ra->async_size = ra->size;
+    } else if (ra->size && (offset >= ra->start) && (end <= ra->start + ra->size)) {
+        return;     /* within the current window, already requested */
+    } else if (offset == prev_pos) {
+        /* Sequential access outside of the window: start a new one right after this access, with
+         * the marker halfway through it. */
+        ra->start = end;
+        ra->size = ra->size ? MIN(2 * ra->size, max_size) : init_size;
+        ra->async_size = ra->size / 2;
+    } else {
+        /* random access: shrink the window, and stop reading ahead when it gets too small */
+        ra->size /= 2;
+        if (ra->size < FILE_READAHEAD_MIN) {
+            ra->size = 0;
+            return;
+        }
+        ra->start = end;
+        ra->async_size = ra->size / 2;
+    }
+    range r = irange(ra->start, MIN(ra->start + ra->size, limit));
+    if (range_valid(r) && range_span(r))
+        pagecache_node_readahead(pn, r);
+}
+
 void file_readahead(file f, u64 offset, u64 len)
 {
-    u64 ra_size = 0;
-    switch (f->fadv) {
-    case POSIX_FADV_NORMAL:
-        ra_size = FILE_READAHEAD_DEFAULT;
-        break;
-    case POSIX_FADV_RANDOM: /* no read-ahead */
-        break;
-    case POSIX_FADV_SEQUENTIAL:
-        ra_size = 2 * FILE_READAHEAD_DEFAULT;
-        break;
-    }
-    if (ra_size > 0)
-        pagecache_node_fetch_pages(fsfile_get_cachenode(f->fsf),
-            irangel(offset + len, ra_size));
+    file_ra_update(&f->ra, fsfile_get_cachenode(f->fsf), f->fadv, offset, len, infinity);
+}
+
+void file_read_noreuse(file f, u64 offset, u64 len)
+{
+    if (f->fadv_noreuse && len)
+        pagecache_node_deactivate_pages(fsfile_get_cachenode(f->fsf), irangel(offset, len));
 }
 
 fs_status filesystem_chdir(process p, const char *path)
@@ -415,21 +454,24 @@ sysreturn fadvise64(int fd, s64 off, u64 len, int advice)
         goto out;
     }
     file f = (file)desc;
+    pagecache_node pn = fsfile_get_cachenode(f->fsf);
+    range r = (len != 0) ? irangel(off, len) : irange(off, pagecache_get_node_length(pn));
     switch (advice) {
     case POSIX_FADV_NORMAL:
+        f->fadv_noreuse = false;
+        /* fall through */
     case POSIX_FADV_RANDOM:
     case POSIX_FADV_SEQUENTIAL:
         f->fadv = advice;
         break;
-    case POSIX_FADV_WILLNEED: {
-        pagecache_node pn = fsfile_get_cachenode(f->fsf);
-        range r = (len != 0) ? irangel(off, len) :
-                irange(off, pagecache_get_node_length(pn));
+    case POSIX_FADV_WILLNEED:
         pagecache_node_fetch_pages(pn, r);
         break;
-    }
     case POSIX_FADV_DONTNEED:
+        pagecache_node_drop_pages(pn, r);
+        break;
     case POSIX_FADV_NOREUSE:
+        f->fadv_noreuse = true;
         break;
     default:
         rv = -EINVAL;
@@ -30,6 +30,15 @@ sysreturn sysreturn_from_fs_status_value(status s);
  * not to the range to be read ahead. */
 void file_readahead(file f, u64 offset, u64 len);
 
+/* Called on completion of a userspace read of [offset, offset + len); with POSIX_FADV_NOREUSE
+ * advice, the pages read are moved to the cold end of the LRU. */
+void file_read_noreuse(file f, u64 offset, u64 len);
+
+/* Update the stream state with an access to [offset, offset + len) and fetch the next readahead
+ * window, if any, without going past limit. */
+void file_ra_update(struct file_ra *ra, pagecache_node pn, int fadv, u64 offset, u64 len,
+                    u64 limit);
+
 fs_status filesystem_chdir(process p, const char *path);
 
 void filesystem_update_relatime(filesystem fs, tuple md);
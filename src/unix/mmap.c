@@ -1,4 +1,5 @@
 #include <unix_internal.h>
+#include <filesystem.h>
 
 //#define VMAP_PARANOIA
 
@@ -29,6 +30,7 @@
 
 #define vmap_lock(p) u64 _savedflags = spin_lock_irq(&(p)->vmap_lock)
 #define vmap_unlock(p) spin_unlock_irq(&(p)->vmap_lock, _savedflags)
+#define vmap_wait_unpinned(p, q) vmap_wait_unpinned_locked(p, q, &_savedflags)
 
 typedef struct vmap_heap {
     struct heap h;  /* must be first */
@@ -168,21 +170,57 @@ static status demand_anonymous_page(pending_fault pf, vmap vm, u64 vaddr)
     return STATUS_OK;
 }
 
+/* Faults on a file mapping feed the same stream detection as file reads, so that posix_fadvise()
+ * advice on the mapped file also applies here. */
+static int vmap_fadv(vmap vm)
+{
+    fdesc fd = vm->fd;
+    return (fd && (fd->type == FDESC_TYPE_REGULAR)) ? ((file)fd)->fadv : POSIX_FADV_NORMAL;
+}
+
+/* A fault that maps a whole folio accounts for an access to the whole folio, so that the next
+ * fault in a sequential scan (one folio further) is seen as contiguous with it. */
+static void vmap_readahead(vmap vm, u64 node_offset, boolean folio)
+{
+    u64 len = PAGESIZE;
+    if (folio) {
+        node_offset &= ~(PAGECACHE_FOLIO_SIZE - 1);
+        len = PAGECACHE_FOLIO_SIZE;
+    }
+    file_ra_update(&vm->ra, vm->cache_node, vmap_fadv(vm), node_offset, len,
+                   vm->node_offset + range_span(vm->node.r));
+}
+
+/* Reading in a whole folio on a major fault only pays off if the mapping is being accessed
+   sequentially, i.e. if a readahead window is open, or if sequential access has been advised. */
+static boolean vmap_sequential(vmap vm)
+{
+    int fadv = vmap_fadv(vm);
+    return (fadv == POSIX_FADV_SEQUENTIAL) || ((fadv != POSIX_FADV_RANDOM) && vm->ra.size);
+}
+
 static void demand_file_page(pending_fault pf, vmap vm, u64 node_offset, u64 page_addr,
-                             pageflags flags)
+                             pageflags flags, boolean folio)
 {
     pagecache_node pn = vm->cache_node;
-    pf_debug("%s: pending_fault %p, node_offset 0x%lx, page_addr 0x%lx\n",
-             __func__, pf, node_offset, pf->addr);
-    pagecache_map_page(pn, node_offset, pf->addr, flags,
-                       (status_handler)&pf->complete);
-    range ra = irange(node_offset + PAGESIZE,
-        vm->node_offset + range_span(vm->node.r));
-    if (range_valid(ra)) {
-        if (range_span(ra) > FILE_READAHEAD_DEFAULT)
-            ra.end = ra.start + FILE_READAHEAD_DEFAULT;
-        pagecache_node_fetch_pages(pn, ra);
-    }
+    pf_debug("%s: pending_fault %p, node_offset 0x%lx, page_addr 0x%lx, folio %d\n",
+             __func__, pf, node_offset, pf->addr, folio);
+    if (folio)
+        pagecache_map_folio(pn, node_offset, pf->addr, flags, (status_handler)&pf->complete);
+    else
+        pagecache_map_page(pn, node_offset, pf->addr, flags,
+                           (status_handler)&pf->complete);
+    vmap_readahead(vm, node_offset, folio);
+}
+
+/* A fault can map a whole pagecache folio if the folio-aligned virtual block around the page
+   lies within the vmap at the same alignment as the file offset. */
+static boolean vmap_folio_mappable(vmap vm, u64 page_addr, u64 node_offset)
+{
+    u64 block = page_addr & ~(PAGECACHE_FOLIO_SIZE - 1);
+    return ((page_addr - node_offset) & (PAGECACHE_FOLIO_SIZE - 1)) == 0 &&
+        block >= vm->node.r.start && block + PAGECACHE_FOLIO_SIZE <= vm->node.r.end &&
+        pagecache_node_folio_capable(vm->cache_node, node_offset);
 }
 
 static void demand_page_suspend_context(pending_fault pf, context ctx)
@@ -216,8 +254,12 @@ static status demand_filebacked_page(process p, context ctx, vmap vm, u64 vaddr,
         return timm("result", "out of range page");
     }
 
-    if (pagecache_map_page_if_filled(vm->cache_node, node_offset, page_addr, flags, completion)) {
+    boolean folio = vmap_folio_mappable(vm, page_addr, node_offset);
+    if (folio ?
+        pagecache_map_folio_if_filled(vm->cache_node, node_offset, page_addr, flags, completion) :
+        pagecache_map_page_if_filled(vm->cache_node, node_offset, page_addr, flags, completion)) {
         pf_debug("   immediate completion\n");
+        vmap_readahead(vm, node_offset, folio);
         count_minor_fault();
         return STATUS_OK;
     }
@@ -229,7 +271,7 @@ static status demand_filebacked_page(process p, context ctx, vmap vm, u64 vaddr,
     spin_unlock_irq(&p->faulting_lock, saved_flags);
 
     /* no need to reserve context; we're on exception/int stack */
-    demand_file_page(pf, vm, node_offset, page_addr, flags);
+    demand_file_page(pf, vm, node_offset, page_addr, flags, folio && vmap_sequential(vm));
     count_major_fault();
     kern_yield();
 }
@@ -329,6 +371,97 @@ boolean vmap_validate_range(process p, range q, u32 flags)
     return res == RM_MATCH;
 }
 
+/* A device transfers to or from a pinned range without going through the page tables, so the
+ * pages backing it must not be unmapped and freed until the transfer completes. Only anonymous
+ * memory can be pinned, since its pages are released only by removing the mapping; unmapping,
+ * remapping or replacing a pinned range waits for the pin to be released. */
+struct vmap_pin {
+    struct list l;
+    process p;
+    range r;
+};
+
+struct vmap_pin_waiter {
+    struct list l;
+    context ctx;
+};
+
+closure_function(0, 1, boolean, vmap_pin_node,
+                 rmnode, n)
+{
+    return !(((vmap)n)->flags & (VMAP_MMAP_TYPE_FILEBACKED | VMAP_MMAP_TYPE_CUSTOM));
+}
+
+vmap_pin vmap_pin_range(process p, range q)
+{
+    vmap_pin pin = allocate(mmap_info.h, sizeof(*pin));
+    if (pin == INVALID_ADDRESS)
+        return pin;
+    pin->p = p;
+    pin->r = q;
+    vmap_lock(p);
+    int res = rangemap_range_lookup_with_gaps(p->vmaps, q, stack_closure(vmap_pin_node),
+                                              stack_closure(vmap_validate_gap));
+    if (res == RM_MATCH)
+        list_push_back(&p->vmap_pins, &pin->l);
+    vmap_unlock(p);
+    if (res != RM_MATCH) {
+        deallocate(mmap_info.h, pin, sizeof(*pin));
+        return INVALID_ADDRESS;
+    }
+    return pin;
+}
+
+void vmap_unpin(vmap_pin pin)
+{
+    process p = pin->p;
+    vmap_lock(p);
+    list_delete(&pin->l);
+    list_foreach(&p->vmap_pin_waiters, l) {
+        list_delete(l);
+        context_schedule_return(struct_from_list(l, struct vmap_pin_waiter *, l)->ctx);
+    }
+    vmap_unlock(p);
+    deallocate(mmap_info.h, pin, sizeof(*pin));
+}
+
+static boolean vmap_pinned_locked(process p, range q)
+{
+    list_foreach(&p->vmap_pins, l) {
+        if (ranges_intersect(struct_from_list(l, vmap_pin, l)->r, q))
+            return true;
+    }
+    return false;
+}
+
+/* Must be called from a context that can be suspended; the vmap lock is dropped while waiting.
+ * Returns true if it waited, in which case any state looked up under the lock is stale. */
+static boolean vmap_wait_unpinned_locked(process p, range q, u64 *saved_flags)
+{
+    boolean waited = false;
+    while (vmap_pinned_locked(p, q)) {
+        struct vmap_pin_waiter w;
+        w.ctx = get_current_context(current_cpu());
+        list_push_back(&p->vmap_pin_waiters, &w.l);
+        context_pre_suspend(w.ctx);
+        spin_unlock_irq(&p->vmap_lock, *saved_flags);
+        context_suspend();
+        *saved_flags = spin_lock_irq(&p->vmap_lock);
+        waited = true;
+    }
+    return waited;
+}
+
+/* Demote block mappings straddling the ends of a range before its vmaps are changed, so that the
+ * page table update that follows cannot fail midway for lack of a page table page. */
+static boolean vmap_split_blocks(range q)
+{
+    flush_entry fe = get_page_flush_entry();
+    boolean split = split_block_mappings(q.start, range_span(q), fe);
+    page_invalidate_sync(fe, 0);
+    return split;
+}
+
 closure_function(0, 1, boolean, vmap_dump_node,
                  rmnode, n)
 {
@@ -460,6 +593,7 @@ static vmap allocate_vmap_locked(rangemap rm, range q, struct vmap k)
     vm->node_offset = k.node_offset;
     vm->cache_node = k.cache_node;
     vm->fd = k.fd;
+    zero(&vm->ra, sizeof(vm->ra));
     if (!rangemap_insert(rm, &vm->node)) {
         deallocate(rm->h, vm, sizeof(struct vmap));
         return INVALID_ADDRESS;
@@ -551,6 +685,8 @@ void *process_map_physical(process p, u64 phys_addr, u64 size, u64 vmflags)
 boolean adjust_process_heap(process p, range new)
 {
     vmap_lock(p);
+    if (new.end < p->heap_map->node.r.end)
+        vmap_wait_unpinned(p, irange(new.end, p->heap_map->node.r.end));
     boolean inserted = rangemap_reinsert(p->vmaps, &p->heap_map->node, new);
     vmap_unlock(p);
     return inserted;
@@ -574,6 +710,9 @@ sysreturn mremap(void *old_address, u64 old_size, u64 new_size, int flags, void
 
     /* begin locked portion...no direct returns */
     vmap_lock(p);
+    range fixed = (flags & MREMAP_FIXED) ?
+        irangel(u64_from_pointer(new_address), pad(new_size, PAGESIZE)) : irange(0, 0);
+    while (vmap_wait_unpinned(p, old) || vmap_wait_unpinned(p, fixed));
     vmap old_vmap = (vmap)rangemap_lookup(p->vmaps, old.start);
     if (old_vmap == INVALID_ADDRESS || !range_contains(old_vmap->node.r, old)) {
         vmap_debug("no match, old_vmap %p, old %R\n", old_vmap, old);
@@ -639,6 +778,10 @@ sysreturn mremap(void *old_address, u64 old_size, u64 new_size, int flags, void
             if (new_size < old_size) {
                 range delta = irange(old.start + new_size, old.end);
                 vmap_debug("shrinking: remove %R, new %R\n", delta, irangel(old.start, new_size));
+                if (!vmap_split_blocks(delta)) {
+                    rv = -ENOMEM;
+                    goto unlock_out;
+                }
                 process_remove_range_locked(p, delta, true);
             }
             rv = sysreturn_from_pointer(old.start);
@@ -646,6 +789,11 @@ sysreturn mremap(void *old_address, u64 old_size, u64 new_size, int flags, void
         }
     }
 
+    if ((remap_old && !vmap_split_blocks(old)) ||
+        ((flags & MREMAP_FIXED) && !vmap_split_blocks(new))) {
+        rv = -ENOMEM;
+        goto unlock_out;
+    }
     process_remove_range_locked(p, old, false);
 
     /* remove mappings under fixed area */
@@ -664,7 +812,8 @@ sysreturn mremap(void *old_address, u64 old_size, u64 new_size, int flags, void
         /* remap existing portion */
         thread_log(current, "   remapping existing portion at 0x%lx (old %R)",
                    new.start, old);
-        remap_pages(new.start, old.start, range_span(old));
+        if (!remap_pages(new.start, old.start, range_span(old)))
+            msg_err("failed to move pages from %R to 0x%lx\n", old, new.start);
     }
   unlock_out:
     vmap_unlock(p);
@@ -857,6 +1006,9 @@ static sysreturn vmap_update_protections_locked(heap h, rangemap pvmap, range q,
     else if (res == RM_ABORT)
         return -EACCES;
 
+    if (!vmap_split_blocks(q))
+        return -ENOMEM;
+
     /* updating protections can lead to merging of nodes, so we cannot traverse */
     range r = q;
     while (range_span(r)) {
@@ -1019,7 +1171,8 @@ void truncate_file_maps(process p, fsfile f, u64 new_length)
         u64 node_offset = vm->node_offset + (v.start - n->r.start);
         pf_debug("%s: vmap %p, %R, delta 0x%lx, remove v %R, node_offset 0x%lx\n",
                  __func__, vm, n->r, delta, v, node_offset);
-        pagecache_node_unmap_pages(pn, v, node_offset);
+        if (!pagecache_node_unmap_pages(pn, v, node_offset))
+            msg_err("failed to unmap truncated pages at %R\n", v);
     }
     vmap_unlock(p);
 }
@@ -1147,6 +1300,11 @@ static sysreturn mmap(void *addr, u64 length, int prot, int flags, int fd, u64 o
 	    thread_log(current, "   requested fixed range %R is out of bounds", q);
             goto out_unlock;
         }
+        vmap_wait_unpinned(p, q);
+        if (!vmap_split_blocks(q)) {
+            ret = -ENOMEM;
+            goto out_unlock;
+        }
         if ((flags & MAP_FIXED_NOREPLACE) &&
             rangemap_range_intersects(p->vmaps, q)) {
             thread_log(current, "   MAP_FIXED_NOREPLACE and collision in range %R", q);
@@ -1267,8 +1425,14 @@ static sysreturn munmap(void *addr, u64 length)
     if ((where & MASK(PAGELOG)) || length == 0)
         return -EINVAL;
 
+    range q = irangel(where, pad(length, PAGESIZE));
     vmap_lock(p);
-    process_remove_range_locked(p, irangel(where, pad(length, PAGESIZE)), true);
+    vmap_wait_unpinned(p, q);
+    if (!vmap_split_blocks(q)) {
+        vmap_unlock(p);
+        return -ENOMEM;
+    }
+    process_remove_range_locked(p, q, true);
     vmap_unlock(p);
     return 0;
 }
@@ -1383,6 +1547,8 @@ void mmap_process_init(process p, tuple root)
     mmap_info.physical = heap_physical(kh);
     mmap_info.linear_backed = reserve_heap_wrapper(h, (heap)heap_linear_backed(kh), USER_MEMORY_RESERVE);
     spin_lock_init(&p->vmap_lock);
+    list_init(&p->vmap_pins);
+    list_init(&p->vmap_pin_waiters);
     u64 min_addr;
     if (get_u64(root, sym(mmap_min_addr), &min_addr))
         p->mmap_min_addr = min_addr;
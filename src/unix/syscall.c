@@ -518,8 +518,119 @@ static void begin_file_read(file f, u64 length)
     }
 }
 
-closure_function(6, 1, void, file_read_complete,
-                 sg_list, sg, void *, dest, u64, limit, file, f, boolean, is_file_offset, io_completion, completion,
+/* O_DIRECT transfers go straight between the user buffer and storage; they need the buffer,
+ * offset and length to be aligned to the filesystem block size, and the buffer to be pinned for
+ * the duration of the transfer. They fall back to cached I/O otherwise, including for buffers
+ * that cannot be pinned. Returns the pin, or INVALID_ADDRESS to use cached I/O. */
+static vmap_pin file_direct_io_pin(file f, void *buf, u64 length, u64 offset)
+{
+    if (!(f->f.flags & O_DIRECT) || (length == 0))
+        return INVALID_ADDRESS;
+    u64 mask = MASK(pagecache_node_get_block_order(fsfile_get_cachenode(f->fsf)));
+    if ((u64_from_pointer(buf) | length | offset) & mask)
+        return INVALID_ADDRESS;
+    return vmap_pin_range(current->p, irangel(u64_from_pointer(buf), length));
+}
+
+/* Fault in a pinned user buffer for direct I/O and build an sg list over it, split at page
+ * boundaries so that each sg buffer is physically contiguous. A buffer that storage writes to is
+ * faulted in for writing, so that it is not backed by a shared (e.g. copy-on-write) page. */
+static sg_list file_direct_sg(void *buf, u64 length, boolean writable, sysreturn *rv)
+{
+    if (!fault_in_user_memory(buf, length, writable))
+        goto fault;
+    u64 addr = u64_from_pointer(buf);
+    u64 end = addr + length;
+    if (writable) {
+        context ctx = get_current_context(current_cpu());
+        if (context_set_err(ctx))
+            goto fault;
+        for (u64 a = addr; a < end; a = (a & ~PAGEMASK) + PAGESIZE)
+            fetch_and_add_32(pointer_from_u64(a), 0);
+        context_clear_err(ctx);
+    }
+    sg_list sg = allocate_sg_list();
+    if (sg == INVALID_ADDRESS)
+        goto no_mem;
+    while (addr < end) {
+        u64 len = MIN((addr & ~PAGEMASK) + PAGESIZE, end) - addr;
+        sg_buf sgb = sg_list_tail_add(sg, len);
+        if (sgb == INVALID_ADDRESS) {
+            deallocate_sg_list(sg);
+            goto no_mem;
+        }
+        sgb->buf = pointer_from_u64(addr);
+        sgb->size = len;
+        sgb->offset = 0;
+        sgb->refcount = 0;
+        addr += len;
+    }
+    return sg;
+  fault:
+    *rv = -EFAULT;
+    return INVALID_ADDRESS;
+  no_mem:
+    *rv = -ENOMEM;
+    return INVALID_ADDRESS;
+}
+
+closure_function(6, 1, void, file_direct_read_complete,
+                 file, f, sg_list, sg, vmap_pin, pin, u64, count, boolean, is_file_offset,
+                 io_completion, completion,
+                 status, s)
+{
+    thread_log(current, "%s: status %v", __func__, s);
+    sysreturn rv;
+    sg_list sg = bound(sg);
+    sg_list_release(sg);
+    deallocate_sg_list(sg);
+    vmap_unpin(bound(pin));
+    if (is_ok(s)) {
+        if (bound(is_file_offset))
+            bound(f)->offset += bound(count);
+        rv = bound(count);
+    } else {
+        rv = sysreturn_from_fs_status_value(s);
+        timm_dealloc(s);
+    }
+    apply(bound(completion), rv);
+    closure_finish();
+}
+
+static sysreturn file_direct_read(file f, vmap_pin pin, void *dest, u64 length, u64 offset,
+                                  boolean is_file_offset, context ctx, boolean bh,
+                                  io_completion completion)
+{
+    thread t = current;
+    u64 file_length = fsfile_get_length(f->fsf);
+    sysreturn rv;
+    if (offset >= file_length) {
+        rv = 0;
+        goto out_unpin;
+    }
+    u64 count = MIN(length, file_length - offset);
+    sg_list sg = file_direct_sg(dest, length, true, &rv);
+    if (sg == INVALID_ADDRESS)
+        goto out_unpin;
+    status_handler sh = closure_from_context(ctx, file_direct_read_complete, f, sg, pin, count,
+                                             is_file_offset, completion);
+    if (sh == INVALID_ADDRESS) {
+        deallocate_sg_list(sg);
+        rv = -ENOMEM;
+        goto out_unpin;
+    }
+    thread_log(t, "   direct read, count %ld", count);
+    begin_file_read(f, count);
+    pagecache_node_direct_read(fsfile_get_cachenode(f->fsf), sg, irangel(offset, count), sh);
+    return bh ? SYSRETURN_CONTINUE_BLOCKING : thread_maybe_sleep_uninterruptible(t);
+  out_unpin:
+    vmap_unpin(pin);
+    return io_complete(completion, rv);
+}
+
+closure_function(7, 1, void, file_read_complete,
+                 sg_list, sg, void *, dest, u64, limit, file, f, u64, offset, boolean, is_file_offset,
+                 io_completion, completion,
                  status, s)
 {
     thread t = current;
@@ -535,6 +646,7 @@ closure_function(6, 1, void, file_read_complete,
         thread_log(t, "   read count %ld", count);
         if (bound(is_file_offset)) /* vs specified offset (pread) */
             f->offset += count;
+        file_read_noreuse(f, bound(offset), count);
         rv = count;
     } else {
         sg_list_release(sg);
@@ -563,13 +675,16 @@ closure_function(2, 6, sysreturn, file_read,
     sysreturn rv;
     if (!check_file_read(f, offset, &rv))
         return io_complete(completion, rv);
+    vmap_pin pin = file_direct_io_pin(f, dest, length, offset);
+    if (pin != INVALID_ADDRESS)
+        return file_direct_read(f, pin, dest, length, offset, is_file_offset, ctx, bh, completion);
     sg_list sg = allocate_sg_list();
     if (sg == INVALID_ADDRESS) {
         thread_log(t, "   unable to allocate sg list");
         return io_complete(completion, -ENOMEM);
     }
     status_handler sh = closure_from_context(ctx, file_read_complete, sg, dest, length, f,
-                                             is_file_offset, completion);
+                                             offset, is_file_offset, completion);
     if (sh == INVALID_ADDRESS) {
         deallocate_sg_list(sg);
         return io_complete(completion, -ENOMEM);
@@ -581,8 +696,8 @@ closure_function(2, 6, sysreturn, file_read,
     return bh ? SYSRETURN_CONTINUE_BLOCKING : thread_maybe_sleep_uninterruptible(t);
 }
 
-closure_function(4, 1, void, file_sg_read_complete,
-                 file, f, sg_list, sg, boolean, is_file_offset, io_completion, completion,
+closure_function(5, 1, void, file_sg_read_complete,
+                 file, f, sg_list, sg, u64, offset, boolean, is_file_offset, io_completion, completion,
                  status, s)
 {
     thread_log(current, "%s: status %v", __func__, s);
@@ -592,6 +707,7 @@ closure_function(4, 1, void, file_sg_read_complete,
        file f = bound(f);
         if (bound(is_file_offset)) /* vs specified offset (pread) */
             f->offset += length;
+        file_read_noreuse(f, bound(offset), length);
         rv = length;
     } else {
         rv = -EIO;
@@ -618,7 +734,8 @@ closure_function(2, 6, sysreturn, file_sg_read,
         return io_complete(completion, rv);
     begin_file_read(f, length);
     apply(f->fs_read, sg, irangel(offset, length),
-          closure_from_context(ctx, file_sg_read_complete, f, sg, is_file_offset, completion));
+          closure_from_context(ctx, file_sg_read_complete, f, sg, offset, is_file_offset,
+                               completion));
     file_readahead(f, offset, length);
 
     /* possible direct return in top half */
@@ -653,8 +770,8 @@ static void file_write_complete_internal(file f, u64 len,
     apply(completion, rv);
 }
 
-closure_function(6, 1, void, file_write_complete,
-                 file, f, sg_list, sg, u64, length, boolean, is_file_offset, io_completion, completion, boolean, flush,
+closure_function(7, 1, void, file_write_complete,
+                 file, f, sg_list, sg, vmap_pin, pin, u64, length, boolean, is_file_offset, io_completion, completion, boolean, flush,
                  status, s)
 {
     if (!bound(flush)) {
@@ -662,6 +779,8 @@ closure_function(6, 1, void, file_write_complete,
                    __func__, bound(f), bound(sg), bound(completion), s);
         sg_list_release(bound(sg));
         deallocate_sg_list(bound(sg));
+        if (bound(pin) != INVALID_ADDRESS)
+            vmap_unpin(bound(pin));
         file f = bound(f);
         if (f->f.flags & O_DSYNC) {
             bound(flush) = true;
@@ -688,31 +807,48 @@ closure_function(2, 6, sysreturn, file_write,
 
     if (!f->fsf)
         return io_complete(completion, -EBADF);
-    sg_list sg = allocate_sg_list();
-    if (sg == INVALID_ADDRESS) {
-        thread_log(t, "   unable to allocate sg list");
-        return io_complete(completion, -ENOMEM);
-    }
-    sg_buf sgb = sg_list_tail_add(sg, length);
-    if (sgb == INVALID_ADDRESS) {
-        thread_log(t, "   unable to allocate sg buf");
-        goto no_mem;
+    vmap_pin pin = file_direct_io_pin(f, src, length, offset);
+    boolean direct = pin != INVALID_ADDRESS;
+    sg_list sg;
+    if (direct) {
+        sysreturn rv;
+        sg = file_direct_sg(src, length, false, &rv);
+        if (sg == INVALID_ADDRESS) {
+            vmap_unpin(pin);
+            return io_complete(completion, rv);
+        }
+    } else {
+        sg = allocate_sg_list();
+        if (sg == INVALID_ADDRESS) {
+            thread_log(t, "   unable to allocate sg list");
+            return io_complete(completion, -ENOMEM);
+        }
+        sg_buf sgb = sg_list_tail_add(sg, length);
+        if (sgb == INVALID_ADDRESS) {
+            thread_log(t, "   unable to allocate sg buf");
+            goto no_mem;
+        }
+        sgb->buf = src;
+        sgb->size = length;
+        sgb->offset = 0;
+        sgb->refcount = 0;
     }
-    sgb->buf = src;
-    sgb->size = length;
-    sgb->offset = 0;
-    sgb->refcount = 0;
 
-    status_handler sh = closure_from_context(ctx, file_write_complete, f, sg, length,
+    status_handler sh = closure_from_context(ctx, file_write_complete, f, sg, pin, length,
                                              is_file_offset, completion, false);
     if (sh == INVALID_ADDRESS)
         goto no_mem;
     begin_file_write(f, length);
-    apply(f->fs_write, sg, irangel(offset, length), sh);
+    if (direct)
+        pagecache_node_direct_write(fsfile_get_cachenode(f->fsf), sg, irangel(offset, length), sh);
+    else
+        apply(f->fs_write, sg, irangel(offset, length), sh);
     /* possible direct return in top half */
     return bh ? SYSRETURN_CONTINUE_BLOCKING : thread_maybe_sleep_uninterruptible(t);
   no_mem:
     deallocate_sg_list(sg);
+    if (direct)
+        vmap_unpin(pin);
     return io_complete(completion, -ENOMEM);
 }
 
@@ -959,6 +1095,8 @@ sysreturn open_internal(filesystem fs, inode cwd, const char *name, int flags,
         f->fs_write = fsfile_get_writer(fsf);
         assert(f->fs_write);
         f->fadv = POSIX_FADV_NORMAL;
+        f->fadv_noreuse = false;
+        zero(&f->ra, sizeof(f->ra));
     }
     f->n = fs->get_inode(fs, n);
     f->offset = (flags & O_APPEND) ? length : 0;
@@ -2259,12 +2397,25 @@ sysreturn sched_setaffinity(int pid, u64 cpusetsize, u64 *mask)
     if (!(t = lookup_thread(pid)))
             return set_syscall_error(current, EINVAL);                
     u64 cpus = pad(MIN(total_processors, 64 * (cpusetsize / sizeof(u64))), 64);
+    u64 cpu;
+    for (cpu = 0; cpu < MIN(cpus, total_processors); cpu++)
+        if (mask[cpu >> 6] & (1ull << (cpu & 63)))
+            break;
+    if (cpu == MIN(cpus, total_processors)) {
+        thread_release(t);
+        return set_syscall_error(current, EINVAL);
+    }
     thread_lock(t);
     runtime_memcpy(bitmap_base(t->affinity), mask, cpus / 8);
     if (cpus < total_processors)
         bitmap_range_check_and_set(t->affinity, cpus, total_processors - cpus, false, false);
     thread_unlock(t);
     thread_release(t);
+
+    /* If the current CPU is no longer allowed, move to an allowed CPU right
+       away; the scheduler enqueues the thread according to its affinity. */
+    if ((t == current) && !bitmap_get(t->affinity, current_cpu()->id))
+        thread_yield();
     return 0;
 }
 
@@ -75,6 +75,7 @@ static sysreturn clone_internal(struct clone_args_internal *args)
 
      clone_frame_pstate(f, thread_frame(current));
      thread_clone_sigmask(t, current);
+     bitmap_copy(t->affinity, current->affinity);
 
      set_syscall_return(t, 0);
      f[SYSCALL_FRAME_SP] = (u64)stack + stack_size;
@@ -254,7 +255,7 @@ static void thread_schedule_return(context ctx)
 {
     thread t = (thread)ctx;
     thread_cputime_update(t);   /* so that it is scheduled based on how much CPU time it used */
-    sched_enqueue(t->scheduling_queue, &t->task);
+    sched_thread_enqueue(t->scheduling_cpu, &t->task);
 }
 
 define_closure_function(1, 0, void, thread_return,
@@ -278,7 +279,7 @@ define_closure_function(1, 0, void, thread_return,
     t->syscall = 0;
 
     /* If we migrated to a new CPU, remain on its thread queue. */
-    t->scheduling_queue = &ci->thread_queue;
+    t->scheduling_cpu = ci;
     thread_unlock(t);
 
     context_frame f = t->context.frame;
@@ -447,7 +448,7 @@ thread create_thread(process p, u64 tid)
 
     init_thread_fault_handler(t);
     
-    t->scheduling_queue = &current_cpu()->thread_queue;
+    t->scheduling_cpu = current_cpu();
     context_frame f = thread_frame(t);
 #ifdef __x86_64__
     f[FRAME_CS] = 0x2b & ~1; // CS 0x28 + CPL 3 but clear bit 0 to indicate syscall
@@ -466,6 +467,7 @@ thread create_thread(process p, u64 tid)
     if (t->affinity == INVALID_ADDRESS)
         goto fail_affinity;
     bitmap_range_check_and_set(t->affinity, 0, total_processors, false, true);
+    t->task.affinity = t->affinity;
     t->syscall_complete = false;
     init_sigstate(&t->signals);
     t->signal_mask = 0;
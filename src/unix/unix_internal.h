@@ -295,7 +295,7 @@ typedef struct thread {
     char name[16]; /* thread name */
     syscall_context syscall;
     struct sched_task task;
-    sched_queue scheduling_queue;
+    cpuinfo scheduling_cpu;
     process p;
 
     /* Heaps in the unix world are typically found through
@@ -421,6 +421,17 @@ typedef struct fdesc {
 #define IOV_MAX 1024
 
 #define FILE_READAHEAD_DEFAULT  (128 * KB)
+#define FILE_READAHEAD_MIN      (16 * KB)
+#define FILE_READAHEAD_MAX      (2 * MB)
+
+/* Sequential stream detection, kept per open file and per file mapping */
+struct file_ra {
+    u64 start;          /* start of the current readahead window */
+    u64 size;           /* size of the current window, zero if no stream is being tracked */
+    u64 async_size;     /* the next window is fetched when an access reaches
+                           start + size - async_size (lookahead marker) */
+    u64 prev_pos;       /* end of the previous access */
+};
 
 struct file {
     struct fdesc f;             /* must be first */
@@ -430,6 +441,8 @@ struct file {
         sg_io fs_read;
         sg_io fs_write;
         int fadv;           /* posix_fadvise advice */
+        boolean fadv_noreuse;   /* POSIX_FADV_NOREUSE */
+        struct file_ra ra;
     };
     inode n;                /* filesystem inode number */
     u64 offset;
@@ -446,6 +459,7 @@ typedef struct vmap {
     pagecache_node cache_node;
     u64 node_offset;
     fdesc fd;
+    struct file_ra ra;
 } *vmap;
 
 #define ivmap(__f, __af, __o, __c, __fd) (struct vmap) {    \
@@ -457,6 +471,8 @@ typedef struct vmap {
 }
 typedef closure_type(vmap_handler, void, vmap);
 
+typedef struct vmap_pin *vmap_pin;
+
 static inline sysreturn set_syscall_return(thread t, sysreturn val)
 {
     thread_frame(t)[SYSCALL_FRAME_RETVAL1] = val;
@@ -485,6 +501,8 @@ static inline sysreturn blockq_block_required(unix_context t, u64 bq_flags)
 
 vmap allocate_vmap(process p, range r, struct vmap q);
 boolean adjust_process_heap(process p, range new);
+vmap_pin vmap_pin_range(process p, range q);
+void vmap_unpin(vmap_pin pin);
 
 u64 process_get_virt_range(process p, u64 size, range region);
 void *process_map_physical(process p, u64 phys_addr, u64 size, u64 vmflags);
@@ -517,6 +535,8 @@ typedef struct process {
     u64               mmap_min_addr;
     struct spinlock   vmap_lock;
     rangemap          vmaps;    /* process mappings */
+    struct list       vmap_pins;        /* ranges pinned for direct I/O */
+    struct list       vmap_pin_waiters; /* contexts waiting for pins to be released */
     vmap              stack_map;
     vmap              heap_map;
     struct aux        saved_aux[NAUX];
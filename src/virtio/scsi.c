@@ -10,6 +10,8 @@ int scsi_data_len(u8 cmd)
         return sizeof(struct scsi_res_read_capacity_16);
     case SCSI_CMD_REPORT_LUNS:
         return sizeof(struct scsi_res_report_luns);
+    case SCSI_CMD_UNMAP:
+        return sizeof(struct scsi_unmap_param);
     default:
         return 0;
     }
@@ -74,6 +74,7 @@ struct scsi_sense_data_extra {
 #define SCSI_CMD_TEST_UNIT_READY        0x00
 #define SCSI_CMD_INQUIRY                0x12
 #define SCSI_CMD_SYNCHRONIZE_CACHE_10   0x35
+#define SCSI_CMD_UNMAP                  0x42
 #define SCSI_CMD_READ_16                0x88
 #define SCSI_CMD_WRITE_16               0x8a
 #define SCSI_CMD_SERVICE_ACTION         0x9e
@@ -378,6 +379,33 @@ struct scsi_cdb_synchronize_cache_10
     u8 control;
 } __attribute__((packed));
 
+struct scsi_cdb_unmap
+{
+    u8 opcode;
+#define SU_ANCHOR 0x01
+    u8 byte2;
+    u8 reserved[4];
+    u8 group;
+    u16 length;
+    u8 control;
+} __attribute__((packed));
+
+struct scsi_unmap_desc
+{
+    u64 addr;
+    u32 length;
+    u8 reserved[4];
+} __attribute__((packed));
+
+/* parameter list with a single block descriptor */
+struct scsi_unmap_param
+{
+    u16 length;
+    u16 desc_length;
+    u8 reserved[4];
+    struct scsi_unmap_desc desc;
+} __attribute__((packed));
+
 int scsi_data_len(u8 cmd);
 
 void scsi_dump_sense(const u8 *sense, int length);
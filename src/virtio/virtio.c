@@ -106,12 +106,20 @@ void vtdev_set_status(vtdev dev, u8 status)
 }
 
 status virtio_alloc_virtqueue(vtdev dev, const char *name, int idx, struct virtqueue **result)
+{
+    return virtio_alloc_virtqueue_cpu(dev, name, idx, -1, result);
+}
+
+/* Interrupts for the queue are delivered to target_cpu where the transport allows it (i.e. with
+ * MSI-X); a negative value means no preference. */
+status virtio_alloc_virtqueue_cpu(vtdev dev, const char *name, int idx, int target_cpu,
+                                  struct virtqueue **result)
 {
     switch (dev->transport) {
     case VTIO_TRANSPORT_MMIO:
         return vtmmio_alloc_virtqueue((vtmmio)dev, name, idx, result);
     case VTIO_TRANSPORT_PCI:
-        return vtpci_alloc_virtqueue((vtpci)dev, name, idx, result);
+        return vtpci_alloc_virtqueue_cpu((vtpci)dev, name, idx, target_cpu, result);
     default:
         return timm("status", "unknown transport %d", dev->transport);
     }
@@ -59,6 +59,10 @@ typedef closure_type(vqfinish, void, u64);
 /* Modern device */
 #define VIRTIO_F_VERSION_1 U64_FROM_BIT(32)
 
+/* Packed virtqueue layout; only negotiated by drivers that include it in their feature mask, until
+ * the packed ring paths have been exercised with each device type. */
+#define VIRTIO_F_RING_PACKED U64_FROM_BIT(34)
+
 typedef closure_type(vtdev_notify, void, u16 queue_index, bytes notify_offset);
 
 typedef struct vtdev {
@@ -98,6 +102,8 @@ static inline void virtio_attach(heap h, backed_heap page_allocator,
 }
 
 status virtio_alloc_virtqueue(vtdev dev, const char *name, int idx, struct virtqueue **result);
+status virtio_alloc_virtqueue_cpu(vtdev dev, const char *name, int idx, int target_cpu,
+                                  struct virtqueue **result);
 status virtio_register_config_change_handler(vtdev dev, thunk handler);
 
 status virtqueue_alloc(vtdev dev,
@@ -123,6 +129,11 @@ physical virtqueue_avail_paddr(struct virtqueue *vq);
 physical virtqueue_used_paddr(struct virtqueue *vq);
 u16 virtqueue_entries(virtqueue vq);
 void virtqueue_set_polling(virtqueue vq, boolean enable);
+boolean virtqueue_set_indirect(virtqueue vq, u16 max_desc);
+void virtqueue_set_poll_handler(virtqueue vq, thunk handler);
+u64 virtqueue_poll(virtqueue vq, u64 budget);
+void virtqueue_kick(virtqueue vq);
+void virtqueue_plug(virtqueue vq, boolean plug);
 
 typedef struct vqmsg *vqmsg;
 
@@ -130,3 +141,4 @@ vqmsg allocate_vqmsg(virtqueue vq);
 void deallocate_vqmsg(virtqueue vq, vqmsg m);
 void vqmsg_push(virtqueue vq, vqmsg m, u64 phys_addr, u32 len, boolean write);
 void vqmsg_commit(virtqueue vq, vqmsg m, vqfinish completion);
+void vqmsg_queue(virtqueue vq, vqmsg m, vqfinish completion);
@@ -40,6 +40,9 @@
 #include "lwip/snmp.h"
 #include "lwip/ethip6.h"
 #include "lwip/etharp.h"
+#include "lwip/prot/ip4.h"
+#include "lwip/prot/ip6.h"
+#include "lwip/prot/tcp.h"
 #include "lwip/dhcp.h"
 #include "lwip/timeouts.h"
 #include "netif/ethernet.h"
@@ -54,6 +57,35 @@
 # define virtio_net_debug(...) do { } while(0)
 #endif // defined(VIRTIO_NET_DEBUG)
 
+/* TCP segmentation offload (VIRTIO_NET_F_HOST_TSO4/6) is not negotiated: lwIP never emits TCP
+ * segments larger than the MSS, so there would be nothing for the device to segment. Offering it
+ * requires a stack that builds segments of up to 64KB, plus setting gso_type, gso_size and hdr_len
+ * in vnet_tx_offload(). */
+#define VIRTIO_NET_TX_OFFLOAD_FEATURES  VIRTIO_NET_F_CSUM
+#define VIRTIO_NET_RX_OFFLOAD_FEATURES  \
+    (VIRTIO_NET_F_GUEST_CSUM | VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6 | \
+     VIRTIO_NET_F_MRG_RXBUF)
+
+/* With VIRTIO_NET_F_MQ, each CPU gets its own rx/tx queue pair, with the queue interrupts routed
+ * to that CPU. */
+declare_closure_struct(0, 0, void, vnet_rx_poll);
+typedef struct vnet_queue {
+    struct vnet *vn;
+    struct virtqueue *rxq;
+    struct virtqueue *txq;
+    struct pbuf *rx_head;       /* packet being assembled from mergeable rx buffers */
+    struct virtio_net_hdr *rx_hdr;
+    u16 rx_remain;              /* rx buffers still to come for rx_head */
+    u16 rx_refill;              /* rx messages consumed in the current poll */
+    closure_struct(vnet_rx_poll, rx_poll);
+} *vnet_queue;
+
+struct vnet_ctrl_mq_cmd {
+    struct virtio_net_ctrl_hdr hdr;
+    struct virtio_net_ctrl_mq mq;
+    u8 ack;
+} __attribute__((packed));
+
 declare_closure_struct(0, 1, u64, vnet_mem_cleaner,
                        u64, clean_bytes);
 typedef struct vnet {
@@ -64,12 +96,17 @@ typedef struct vnet {
     closure_struct(vnet_mem_cleaner, mem_cleaner);
     bytes net_header_len;
     int rxbuflen;
+    int rxbufs_per_msg;         /* rx buffers chained in each virtqueue message */
+    int rxmsgcount;             /* rx messages posted on each queue */
     struct netif *n;
-    struct virtqueue *txq;
-    struct virtqueue *rxq;
+    struct vnet_queue *queues;
+    u16 num_queues;             /* number of allocated queue pairs */
+    u16 active_queues;          /* number of queue pairs enabled in the device */
     struct virtqueue *ctl;
-    u64 empty_phys;
-    void *empty; // just a mac..fix, from pre-heap days
+    struct vnet_ctrl_mq_cmd *ctl_cmd;
+    u64 ctl_phys;
+    struct spinlock rx_frag_lock;
+    u64 rx_frag_inputs;         /* fragments being input with lwIP TCP checksum checks enabled */
 } *vnet;
 
 declare_closure_struct(0, 1, void, vnet_input,
@@ -78,33 +115,262 @@ typedef struct xpbuf
 {
     struct pbuf_custom p;
     vnet vn;
+    vnet_queue q;
     closure_struct(vnet_input, input);
 } __attribute__((aligned(8))) *xpbuf;
 
 
-closure_function(1, 1, void, tx_complete,
-                 struct pbuf *, p,
-                 u64, len)
+/* Allocated from the contiguous heap, so that the device can read the header. */
+declare_closure_struct(0, 1, void, vnet_tx_complete,
+                       u64, len);
+typedef struct vnet_tx {
+    struct virtio_net_hdr_mrg_rxbuf hdr;
+    vnet vn;
+    struct pbuf *p;
+    closure_struct(vnet_tx_complete, complete);
+} *vnet_tx;
+
+define_closure_function(0, 1, void, vnet_tx_complete,
+                        u64, len)
 {
-    pbuf_free(bound(p));
-    closure_finish();
+    vnet_tx tx = struct_from_field(closure_self(), vnet_tx, complete);
+    pbuf_free(tx->p);
+    deallocate((heap)tx->vn->txhandlers, tx, sizeof(struct vnet_tx));
+}
+
+
+/* The device steers incoming packets of a flow to the rx queue paired with the tx queue on which
+ * the flow was last transmitted, so sending from the pair owned by the current CPU keeps both
+ * directions of a socket on the CPU that handles it. */
+static struct virtqueue *vnet_txq(vnet vn)
+{
+    return vn->queues[current_cpu()->id % vn->active_queues].txq;
+}
+
+static u64 vnet_csum_add(u64 sum, u64 s)
+{
+    sum += s;
+    if (sum < s)
+        sum++;
+    return sum;
+}
+
+/* Returns the (non-inverted) 64-bit ones' complement sum of a buffer. */
+static u64 vnet_csum_partial(u8 *buf, u64 len)
+{
+    u64 sum = 0;
+    while (len >= sizeof(u64)) {
+        sum = vnet_csum_add(sum, *(u64 *)buf);
+        buf += sizeof(u64);
+        len -= sizeof(u64);
+    }
+    if (len >= sizeof(u32)) {
+        sum = vnet_csum_add(sum, *(u32 *)buf);
+        buf += sizeof(u32);
+        len -= sizeof(u32);
+    }
+    if (len >= sizeof(u16)) {
+        sum = vnet_csum_add(sum, *(u16 *)buf);
+        buf += sizeof(u16);
+        len -= sizeof(u16);
+    }
+    if (len)
+        sum = vnet_csum_add(sum, *buf);
+    return sum;
+}
+
+/* Fold down to 16 bits */
+static u16 vnet_csum_fold(u64 sum)
+{
+    u32 s1 = sum;
+    u32 s2 = sum >> 32;
+    s1 += s2;
+    if (s1 < s2)
+        s1++;
+    u16 s3 = s1;
+    u16 s4 = s1 >> 16;
+    s3 += s4;
+    if (s3 < s4)
+        s3++;
+    return s3;
 }
 
+static u16 vnet_csum(u8 *buf, u64 len)
+{
+    return ~vnet_csum_fold(vnet_csum_partial(buf, len));
+}
+
+/* Returns the (non-inverted) 16-bit ones' complement sum of len bytes of a pbuf chain, starting
+ * at offset. */
+static u16 vnet_csum_pbuf(struct pbuf *p, bytes offset, bytes len)
+{
+    u64 sum = 0;
+    bytes summed = 0;
+    for (struct pbuf *q = p; q && (summed < len); q = q->next) {
+        if (offset >= q->len) {
+            offset -= q->len;
+            continue;
+        }
+        bytes n = MIN(q->len - offset, len - summed);
+        u16 s = vnet_csum_fold(vnet_csum_partial(q->payload + offset, n));
+        /* data starting at an odd offset is summed byte-swapped */
+        if (summed & 1)
+            s = (s << 8) | (s >> 8);
+        sum = vnet_csum_add(sum, s);
+        summed += n;
+        offset = 0;
+    }
+    return vnet_csum_fold(sum);
+}
+
+/* Skips the IPv6 extension headers that do not affect the transport pseudo header (hop-by-hop and
+ * destination options), which must be in the first pbuf. Returns the next header value, and
+ * updates offset to point to it. */
+static u8 vnet_ip6_skip_ext(struct pbuf *p, u8 next, bytes *offset)
+{
+    while ((next == IP6_NEXTH_HOPBYHOP) || (next == IP6_NEXTH_DESTOPTS)) {
+        if (p->len < *offset + 2)
+            return IP6_NEXTH_NONE;
+        u8 *ext = p->payload + *offset;
+        next = ext[0];
+        *offset += (ext[1] + 1) * 8;
+    }
+    return next;
+}
+
+/* Locates the transport header of an unfragmented IPv4 or IPv6 packet whose network header is in
+ * the first pbuf, and computes the sum of the transport pseudo header. Returns the transport
+ * protocol, or 0 if the packet cannot be parsed. If the packet is an IP fragment, *fragment is set
+ * (if not null). */
+static u8 vnet_l4_header(struct pbuf *p, bytes *l4_offset, bytes *l4_len, u64 *pseudo_sum,
+                         boolean *fragment)
+{
+    if (p->len < SIZEOF_ETH_HDR)
+        return 0;
+    struct eth_hdr *eth = p->payload;
+    void *l3 = p->payload + SIZEOF_ETH_HDR;
+    if (eth->type == PP_HTONS(ETHTYPE_IP)) {
+        struct ip_hdr *iph = l3;
+        if (p->len < SIZEOF_ETH_HDR + IP_HLEN)
+            return 0;
+        if (IPH_OFFSET(iph) & PP_HTONS(IP_OFFMASK | IP_MF)) {
+            if (fragment)
+                *fragment = true;
+            return 0;
+        }
+        bytes l3_hlen = IPH_HL_BYTES(iph);
+        u16 len = lwip_ntohs(IPH_LEN(iph));
+        if (len < l3_hlen)
+            return 0;
+        struct {
+            ip4_addr_p_t src;
+            ip4_addr_p_t dest;
+            u8 zero;
+            u8 proto;
+            u16 len;
+        } __attribute__((packed)) ph;
+        runtime_memcpy(&ph.src, &iph->src, sizeof(ph.src));
+        runtime_memcpy(&ph.dest, &iph->dest, sizeof(ph.dest));
+        ph.zero = 0;
+        ph.proto = IPH_PROTO(iph);
+        ph.len = lwip_htons(len - l3_hlen);
+        *l4_offset = SIZEOF_ETH_HDR + l3_hlen;
+        *l4_len = len - l3_hlen;
+        *pseudo_sum = vnet_csum_partial((u8 *)&ph, sizeof(ph));
+        return ph.proto;
+    } else if (eth->type == PP_HTONS(ETHTYPE_IPV6)) {
+        struct ip6_hdr *ip6h = l3;
+        if (p->len < SIZEOF_ETH_HDR + IP6_HLEN)
+            return 0;
+        bytes offset = SIZEOF_ETH_HDR + IP6_HLEN;
+        u8 next = vnet_ip6_skip_ext(p, IP6H_NEXTH(ip6h), &offset);
+        if (next == IP6_NEXTH_FRAGMENT) {
+            if (fragment)
+                *fragment = true;
+            return 0;
+        }
+        bytes ext_len = offset - (SIZEOF_ETH_HDR + IP6_HLEN);
+        if (ext_len > IP6H_PLEN(ip6h))
+            return 0;
+        struct {
+            ip6_addr_p_t src;
+            ip6_addr_p_t dest;
+            u32 len;
+            u8 zero[3];
+            u8 next;
+        } __attribute__((packed)) ph;
+        runtime_memcpy(&ph.src, &ip6h->src, sizeof(ph.src));
+        runtime_memcpy(&ph.dest, &ip6h->dest, sizeof(ph.dest));
+        ph.len = lwip_htonl(IP6H_PLEN(ip6h) - ext_len);
+        zero(ph.zero, sizeof(ph.zero));
+        ph.next = next;
+        *l4_offset = offset;
+        *l4_len = IP6H_PLEN(ip6h) - ext_len;
+        *pseudo_sum = vnet_csum_partial((u8 *)&ph, sizeof(ph));
+        return ph.next;
+    }
+    return 0;
+}
+
+/* TCP checksums are not generated by lwIP on this interface when the device can do it (see
+ * virtioif_init): fill in the pseudo-header checksum and let the device complete it. If the TCP
+ * header is not entirely in the first pbuf, the checksum is computed here instead. Returns false
+ * if the packet is malformed. */
+static boolean vnet_tx_offload(struct pbuf *p, struct virtio_net_hdr *hdr)
+{
+    bytes l4_offset, l4_len;
+    u64 pseudo_sum;
+    if (vnet_l4_header(p, &l4_offset, &l4_len, &pseudo_sum, 0) != IP_PROTO_TCP)
+        return true;
+    if (l4_offset + l4_len > p->tot_len)
+        return false;
+    struct tcp_hdr *tcph = p->payload + l4_offset;
+    if ((p->len < l4_offset + TCP_HLEN) || (p->len < l4_offset + TCPH_HDRLEN_BYTES(tcph))) {
+        bytes csum_pos = l4_offset + offsetof(struct tcp_hdr *, chksum);
+        if (csum_pos + sizeof(u16) > l4_offset + l4_len)
+            return false;
+        pbuf_put_at(p, csum_pos, 0);
+        pbuf_put_at(p, csum_pos + 1, 0);
+        u16 csum = ~vnet_csum_fold(vnet_csum_add(pseudo_sum, vnet_csum_pbuf(p, l4_offset, l4_len)));
+        u8 *b = (u8 *)&csum;
+        pbuf_put_at(p, csum_pos, b[0]);
+        pbuf_put_at(p, csum_pos + 1, b[1]);
+        return true;
+    }
+    tcph->chksum = vnet_csum_fold(pseudo_sum);
+    hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr->csum_start = l4_offset;
+    hdr->csum_offset = offsetof(struct tcp_hdr *, chksum);
+    return true;
+}
 
 static err_t low_level_output(struct netif *netif, struct pbuf *p)
 {
     vnet vn = netif->state;
+    struct virtqueue *txq = vnet_txq(vn);
+
+    vnet_tx tx = allocate((heap)vn->txhandlers, sizeof(struct vnet_tx));
+    if (tx == INVALID_ADDRESS)
+        return ERR_MEM;
+    zero(&tx->hdr, sizeof(tx->hdr));
+    if ((vn->dev->features & VIRTIO_NET_F_CSUM) && !vnet_tx_offload(p, &tx->hdr.hdr)) {
+        deallocate((heap)vn->txhandlers, tx, sizeof(struct vnet_tx));
+        LINK_STATS_INC(link.drop);
+        return ERR_BUF;
+    }
+    tx->vn = vn;
+    tx->p = p;
 
-    vqmsg m = allocate_vqmsg(vn->txq);
+    vqmsg m = allocate_vqmsg(txq);
     assert(m != INVALID_ADDRESS);
-    vqmsg_push(vn->txq, m, vn->empty_phys, vn->net_header_len, false);
+    vqmsg_push(txq, m, physical_from_virtual(&tx->hdr), vn->net_header_len, false);
 
     pbuf_ref(p);
 
     for (struct pbuf * q = p; q != NULL; q = q->next)
-        vqmsg_push(vn->txq, m, physical_from_virtual(q->payload), q->len, false);
+        vqmsg_push(txq, m, physical_from_virtual(q->payload), q->len, false);
 
-    vqmsg_commit(vn->txq, m, closure((heap)vn->txhandlers, tx_complete, p));
+    vqmsg_commit(txq, m, init_closure(&tx->complete, vnet_tx_complete));
     
     MIB2_STATS_NETIF_ADD(netif, ifoutoctets, p->tot_len);
     if (((u8_t *)p->payload)[0] & 1) {
@@ -127,54 +393,62 @@ static void receive_buffer_release(struct pbuf *p)
     deallocate((heap)x->vn->rxbuffers, x, x->vn->rxbuflen + sizeof(struct xpbuf));
 }
 
-static void post_receive(vnet vn);
+static void post_receive(vnet vn, vnet_queue q);
 
-static u16 vnet_csum(u8 *buf, u64 len)
+/* With VIRTIO_NET_F_GUEST_CSUM, lwIP does not verify TCP checksums on this interface (see
+ * virtioif_init): they are either validated by the device, or verified here. An IP fragment can only
+ * be verified after reassembly, which lwIP does synchronously while the fragment that completes the
+ * datagram is input: for fragments, *lwip_check is set so that lwIP TCP checksum verification is
+ * enabled only while the fragment is being input. Checksums of other protocols are left to lwIP,
+ * except for partial checksums, which are completed here. */
+static boolean vnet_rx_csum(vnet vn, struct pbuf *p, struct virtio_net_hdr *hdr,
+                            boolean *lwip_check)
 {
-    u64 sum = 0;
-    while (len >= sizeof(u64)) {
-        u64 s = *(u64 *)buf;
-        sum += s;
-        if (sum < s)
-            sum++;
-        buf += sizeof(u64);
-        len -= sizeof(u64);
-    }
-    if (len >= sizeof(u32)) {
-        u32 s = *(u32 *)buf;
-        sum += s;
-        if (sum < s)
-            sum++;
-        buf += sizeof(u32);
-        len -= sizeof(u32);
-    }
-    if (len >= sizeof(u16)) {
-        u16 s = *(u16 *)buf;
-        sum += s;
-        if (sum < s)
-            sum++;
-        buf += sizeof(u16);
-        len -= sizeof(u16);
+    if (!(vn->dev->features & VIRTIO_NET_F_GUEST_CSUM))
+        return true;
+    bytes l4_offset, l4_len;
+    u64 sum;
+    boolean fragment = false;
+    u8 proto = vnet_l4_header(p, &l4_offset, &l4_len, &sum, &fragment);
+    if (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+        /* The packet comes from a local sender and is known to be good; the checksum is completed
+         * even for TCP, because lwIP may be verifying TCP checksums for a fragment input on another
+         * queue. */
+        bytes csum_pos = hdr->csum_start + hdr->csum_offset;
+        if ((hdr->csum_start >= p->tot_len) || (csum_pos + sizeof(u16) > p->tot_len))
+            return false;
+        u16 csum = ~vnet_csum_pbuf(p, hdr->csum_start, p->tot_len - hdr->csum_start);
+        u8 *b = (u8 *)&csum;
+        pbuf_put_at(p, csum_pos, b[0]);
+        pbuf_put_at(p, csum_pos + 1, b[1]);
+        return true;
     }
-    if (len) {
-        u8 s = *buf;
-        sum += s;
-        if (sum < s)
-            sum++;
+    if (hdr->flags & VIRTIO_NET_HDR_F_DATA_VALID)
+        return true;
+    if (fragment) {
+        *lwip_check = true;
+        return true;
     }
+    if (proto != IP_PROTO_TCP)
+        return true;
+    if ((p->len < l4_offset) || (p->tot_len < l4_offset + l4_len))
+        return false;
+    sum = vnet_csum_add(sum, vnet_csum_pbuf(p, l4_offset, l4_len));
+    return (vnet_csum_fold(sum) == 0xffff);
+}
 
-    /* Fold down to 16 bits */
-    u32 s1 = sum;
-    u32 s2 = sum >> 32;
-    s1 += s2;
-    if (s1 < s2)
-        s1++;
-    u16 s3 = s1;
-    u16 s4 = s1 >> 16;
-    s3 += s4;
-    if (s3 < s4)
-        s3++;
-    return ~s3;
+/* The netif checksum flags are shared by all receive queues, so they are updated under a lock and
+ * TCP checks stay enabled as long as any fragment is being input. */
+static void vnet_rx_lwip_check(vnet vn, boolean enable)
+{
+    spin_lock(&vn->rx_frag_lock);
+    if (enable) {
+        if (vn->rx_frag_inputs++ == 0)
+            vn->n->chksum_flags |= NETIF_CHECKSUM_CHECK_TCP;
+    } else if (--vn->rx_frag_inputs == 0) {
+        vn->n->chksum_flags &= ~NETIF_CHECKSUM_CHECK_TCP;
+    }
+    spin_unlock(&vn->rx_frag_lock);
 }
 
 define_closure_function(0, 1, void, vnet_input,
@@ -184,54 +458,94 @@ define_closure_function(0, 1, void, vnet_input,
 
     xpbuf x = struct_from_field(closure_self(), xpbuf, input);
     vnet vn= x->vn;
-    // under what conditions does a virtio queue give us zero?
-    struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)x->p.pbuf.payload;
-    boolean err = false;
-    len -= vn->net_header_len;
-    assert(len <= x->p.pbuf.len);
-    x->p.pbuf.tot_len = x->p.pbuf.len = len;
-    x->p.pbuf.payload += vn->net_header_len;
-    if (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
-        if (hdr->csum_start + hdr->csum_offset <= len - sizeof(u16)) {
-            u16 csum = vnet_csum(x->p.pbuf.payload + hdr->csum_start, len - hdr->csum_start);
-            *(u16 *)(x->p.pbuf.payload + hdr->csum_start + hdr->csum_offset) = csum;
+    vnet_queue q = x->q;
+    struct pbuf *p = &x->p.pbuf;
+    if (q->rx_head) {
+        /* continuation of a packet spanning multiple mergeable buffers */
+        assert(len <= p->len);
+        p->tot_len = p->len = len;
+        pbuf_cat(q->rx_head, p);
+        q->rx_remain--;
+    } else {
+        // under what conditions does a virtio queue give us zero?
+        struct virtio_net_hdr_mrg_rxbuf *hdr = p->payload;
+        assert(len <= p->tot_len);
+        len -= vn->net_header_len;
+        p->payload += vn->net_header_len;
+        p->len -= vn->net_header_len;
+        p->tot_len -= vn->net_header_len;
+        pbuf_realloc(p, len);   /* releases unused buffers of a chained message */
+        q->rx_head = p;
+        q->rx_hdr = &hdr->hdr;
+        q->rx_remain = ((vn->dev->features & VIRTIO_NET_F_MRG_RXBUF) && (hdr->num_buffers > 1)) ?
+            hdr->num_buffers - 1 : 0;
+    }
+    if (q->rx_remain == 0) {
+        p = q->rx_head;
+        q->rx_head = 0;
+        boolean lwip_check = false;
+        if (!vnet_rx_csum(vn, p, q->rx_hdr, &lwip_check)) {
+            pbuf_free(p);
         } else {
-            err = true;
+            if (lwip_check)
+                vnet_rx_lwip_check(vn, true);
+            if (vn->n->input(p, vn->n) != ERR_OK)
+                pbuf_free(p);
+            if (lwip_check)
+                vnet_rx_lwip_check(vn, false);
         }
     }
-    if (!err)
-        err = (vn->n->input(&x->p.pbuf, vn->n) != ERR_OK);
-    if (err)
-        receive_buffer_release(&x->p.pbuf);
     // we need to get a signal from the device side that there was
     // an underrun here to open up the window
-    post_receive(vn);
+    q->rx_refill++;
 }
 
 
-static void post_receive(vnet vn)
+static void post_receive(vnet vn, vnet_queue q)
 {
-    xpbuf x = allocate((heap)vn->rxbuffers, sizeof(struct xpbuf) + vn->rxbuflen);
-    assert(x != INVALID_ADDRESS);
-    x->vn = vn;
-    x->p.custom_free_function = receive_buffer_release;
-    pbuf_alloced_custom(PBUF_RAW,
-                        vn->rxbuflen,
-                        PBUF_REF,
-                        &x->p,
-                        x+1,
-                        vn->rxbuflen);
-
-    vqmsg m = allocate_vqmsg(vn->rxq);
+    struct virtqueue *rxq = q->rxq;
+    vqmsg m = allocate_vqmsg(rxq);
     assert(m != INVALID_ADDRESS);
-    u64 phys = physical_from_virtual(x + 1);
-    if (vtdev_is_modern(vn->dev) || (vn->dev->features & VIRTIO_F_ANY_LAYOUT)) {
-        vqmsg_push(vn->rxq, m, phys, vn->rxbuflen, true);
-    } else {
-        vqmsg_push(vn->rxq, m, phys, vn->net_header_len, true);
-        vqmsg_push(vn->rxq, m, phys + vn->net_header_len, vn->rxbuflen - vn->net_header_len, true);
+    xpbuf head = 0;
+    for (int i = 0; i < vn->rxbufs_per_msg; i++) {
+        xpbuf x = allocate((heap)vn->rxbuffers, sizeof(struct xpbuf) + vn->rxbuflen);
+        assert(x != INVALID_ADDRESS);
+        x->vn = vn;
+        x->q = q;
+        x->p.custom_free_function = receive_buffer_release;
+        pbuf_alloced_custom(PBUF_RAW,
+                            vn->rxbuflen,
+                            PBUF_REF,
+                            &x->p,
+                            x+1,
+                            vn->rxbuflen);
+
+        u64 phys = physical_from_virtual(x + 1);
+        if (head || vtdev_is_modern(vn->dev) || (vn->dev->features & VIRTIO_F_ANY_LAYOUT)) {
+            vqmsg_push(rxq, m, phys, vn->rxbuflen, true);
+        } else {
+            vqmsg_push(rxq, m, phys, vn->net_header_len, true);
+            vqmsg_push(rxq, m, phys + vn->net_header_len, vn->rxbuflen - vn->net_header_len, true);
+        }
+        if (head)
+            pbuf_cat(&head->p.pbuf, &x->p.pbuf);
+        else
+            head = x;
+    }
+    vqmsg_queue(rxq, m, init_closure(&head->input, vnet_input));
+}
+
+/* Scheduled by the rx queue interrupt: process received packets up to the budget, then replace
+ * the consumed buffers with a single notification to the device. */
+define_closure_function(0, 0, void, vnet_rx_poll)
+{
+    vnet_queue q = struct_from_field(closure_self(), vnet_queue, rx_poll);
+    virtqueue_poll(q->rxq, VIRTIO_NET_RX_POLL_BUDGET);
+    if (q->rx_refill) {
+        for (; q->rx_refill > 0; q->rx_refill--)
+            post_receive(q->vn, q);
+        virtqueue_kick(q->rxq);
     }
-    vqmsg_commit(vn->rxq, m, init_closure(&x->input, vnet_input));
 }
 
 define_closure_function(0, 1, u64, vnet_mem_cleaner,
@@ -270,9 +584,18 @@ static err_t virtioif_init(struct netif *netif)
     /* device capabilities */
     /* don't set NETIF_FLAG_ETHARP if this device is not an ethernet one */
     netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_LINK_UP | NETIF_FLAG_UP;
-
-    for (int i = 0; i < virtqueue_entries(vn->rxq); i++)
-        post_receive(vn);
+    u16 csum_flags = NETIF_CHECKSUM_ENABLE_ALL;
+    if (vn->dev->features & VIRTIO_NET_F_CSUM)
+        csum_flags &= ~NETIF_CHECKSUM_GEN_TCP;
+    if (vn->dev->features & VIRTIO_NET_F_GUEST_CSUM)
+        csum_flags &= ~NETIF_CHECKSUM_CHECK_TCP;
+    NETIF_SET_CHECKSUM_CTRL(netif, csum_flags);
+
+    for (int q = 0; q < vn->num_queues; q++) {
+        for (int i = 0; i < vn->rxmsgcount; i++)
+            post_receive(vn, &vn->queues[q]);
+        virtqueue_kick(vn->queues[q].rxq);
+    }
     
     return ERR_OK;
 }
@@ -283,11 +606,97 @@ static inline u64 find_page_size(bytes each, int n)
     return MIN(1ul << find_order(each * (n + 1)), PAGESIZE_2M);
 }
 
+closure_function(2, 1, void, vnet_mq_set_complete,
+                 vnet, vn, u16, pairs,
+                 u64, len)
+{
+    vnet vn = bound(vn);
+    virtio_net_debug("%s: pairs %d, ack %d\n", __func__, bound(pairs), vn->ctl_cmd->ack);
+    if (vn->ctl_cmd->ack == VIRTIO_NET_OK)
+        vn->active_queues = bound(pairs);
+    else
+        msg_err("failed to enable %d queue pairs\n", bound(pairs));
+    closure_finish();
+}
+
+/* Until this command completes, the device only uses the first queue pair. */
+static void vnet_mq_set_pairs(vnet vn, u16 pairs)
+{
+    struct vnet_ctrl_mq_cmd *cmd = vn->ctl_cmd;
+    cmd->hdr.class = VIRTIO_NET_CTRL_MQ;
+    cmd->hdr.cmd = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+    cmd->mq.virtqueue_pairs = pairs;
+    cmd->ack = VIRTIO_NET_ERR;
+    vqmsg m = allocate_vqmsg(vn->ctl);
+    assert(m != INVALID_ADDRESS);
+    vqmsg_push(vn->ctl, m, vn->ctl_phys, sizeof(cmd->hdr), false);
+    vqmsg_push(vn->ctl, m, vn->ctl_phys + offsetof(struct vnet_ctrl_mq_cmd *, mq),
+               sizeof(cmd->mq), false);
+    vqmsg_push(vn->ctl, m, vn->ctl_phys + offsetof(struct vnet_ctrl_mq_cmd *, ack),
+               sizeof(cmd->ack), true);
+    vqmsg_commit(vn->ctl, m, closure(vn->dev->general, vnet_mq_set_complete, vn, pairs));
+}
+
+static const char *vnet_queue_name(heap h, const char *dir, int q)
+{
+    buffer b = aprintf(h, "virtio net %s %d", dir, q);
+    assert(b != INVALID_ADDRESS);
+    buffer_write_byte(b, 0);
+    return buffer_ref(b, 0);
+}
+
+/* rx queue N has index 2N and tx queue N has index 2N + 1; the control queue comes after the
+ * maximum number of queue pairs supported by the device. */
+static boolean vnet_alloc_queues(vnet vn, u16 max_pairs)
+{
+    vtdev dev = vn->dev;
+    heap h = dev->general;
+    u16 pairs = MIN(max_pairs, total_processors);
+    vn->queues = allocate(h, pairs * sizeof(struct vnet_queue));
+    assert(vn->queues != INVALID_ADDRESS);
+    vn->num_queues = 0;
+    for (int i = 0; i < pairs; i++) {
+        vnet_queue q = &vn->queues[i];
+        q->vn = vn;
+        q->rx_head = 0;
+        q->rx_refill = 0;
+        const char *tx_name = (pairs == 1) ? "virtio net tx" : vnet_queue_name(h, "tx", i);
+        const char *rx_name = (pairs == 1) ? "virtio net rx" : vnet_queue_name(h, "rx", i);
+        status s = virtio_alloc_virtqueue_cpu(dev, tx_name, 2 * i + 1, i, &q->txq);
+        if (is_ok(s))
+            s = virtio_alloc_virtqueue_cpu(dev, rx_name, 2 * i, i, &q->rxq);
+        if (!is_ok(s)) {
+            msg_err("failed to allocate queue pair %d: %v\n", i, s);
+            timm_dealloc(s);
+            break;
+        }
+        virtqueue_set_polling(q->txq, true);
+        virtqueue_set_poll_handler(q->rxq, init_closure(&q->rx_poll, vnet_rx_poll));
+        vn->num_queues++;
+    }
+    if (vn->num_queues == 0)
+        return false;
+    vn->active_queues = 1;
+    spin_lock_init(&vn->rx_frag_lock);
+    vn->rx_frag_inputs = 0;
+    if (vn->num_queues > 1) {
+        status s = virtio_alloc_virtqueue(dev, "virtio net ctl", 2 * max_pairs, &vn->ctl);
+        if (!is_ok(s)) {
+            msg_err("failed to allocate control queue: %v\n", s);
+            timm_dealloc(s);
+            vn->num_queues = 1;
+            return true;
+        }
+        vn->ctl_cmd = alloc_map(dev->contiguous, dev->contiguous->h.pagesize, &vn->ctl_phys);
+        assert(vn->ctl_cmd != INVALID_ADDRESS);
+    }
+    return true;
+}
+
 static void virtio_net_attach(vtdev dev)
 {
-    //u32 badness = VIRTIO_F_BAD_FEATURE | VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM |
-    //    VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6 |  VIRTIO_NET_F_GUEST_ECN|
-    //    VIRTIO_NET_F_GUEST_UFO | VIRTIO_NET_F_CTRL_VLAN | VIRTIO_NET_F_MQ;
+    //u32 badness = VIRTIO_F_BAD_FEATURE | VIRTIO_NET_F_GUEST_ECN|
+    //    VIRTIO_NET_F_GUEST_UFO | VIRTIO_NET_F_CTRL_VLAN;
 
     heap h = dev->general;
     backed_heap contiguous = dev->contiguous;
@@ -298,21 +707,37 @@ static void virtio_net_attach(vtdev dev)
     vn->net_header_len = (dev->features & VIRTIO_F_VERSION_1) ||
         (dev->features & VIRTIO_NET_F_MRG_RXBUF) != 0 ?
         sizeof(struct virtio_net_hdr_mrg_rxbuf) : sizeof(struct virtio_net_hdr);
-    vn->rxbuflen = pad(vn->net_header_len + sizeof(struct eth_hdr) + sizeof(struct eth_vlan_hdr) +
-                       1500, 8);    /* padding to make xpbuf structures aligned to 8 bytes */
+    if ((dev->features & (VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6)) &&
+        !(dev->features & VIRTIO_NET_F_MRG_RXBUF)) {
+        /* Without mergeable buffers, each rx message must be able to hold a full-size large
+           segment: use chains of page-sized buffers. */
+        vn->rxbuflen = PAGESIZE - sizeof(struct xpbuf);
+        vn->rxbufs_per_msg = (vn->net_header_len + sizeof(struct eth_hdr) +
+                              sizeof(struct eth_vlan_hdr) + U16_MAX + vn->rxbuflen - 1) / vn->rxbuflen;
+    } else {
+        vn->rxbuflen = pad(vn->net_header_len + sizeof(struct eth_hdr) + sizeof(struct eth_vlan_hdr) +
+                           1500, 8);    /* padding to make xpbuf structures aligned to 8 bytes */
+        vn->rxbufs_per_msg = 1;
+    }
     mm_register_mem_cleaner(init_closure(&vn->mem_cleaner, vnet_mem_cleaner));
     /* rx = 0, tx = 1, ctl = 2 by 
        page 53 of http://docs.oasis-open.org/virtio/virtio/v1.0/cs01/virtio-v1.0-cs01.pdf */
     vn->dev = dev;
-    virtio_alloc_virtqueue(dev, "virtio net tx", 1, &vn->txq);
-    virtqueue_set_polling(vn->txq, true);
-    virtio_alloc_virtqueue(dev, "virtio net rx", 0, &vn->rxq);
-    virtio_net_debug("%s: rx q entries %d, tx q entries %d\n", __func__,
-                     virtqueue_entries(vn->rxq), virtqueue_entries(vn->txq));
+    u16 max_pairs = (dev->features & VIRTIO_NET_F_MQ) ?
+        vtdev_cfg_read_2(dev, offsetof(struct virtio_net_config *, max_virtqueue_pairs)) : 1;
+    if (!vnet_alloc_queues(vn, max_pairs)) {
+        msg_err("failed to allocate virtqueues\n");
+        return;
+    }
+    struct virtqueue *rxq = vn->queues[0].rxq;
+    struct virtqueue *txq = vn->queues[0].txq;
+    vn->rxmsgcount = virtqueue_entries(rxq) / vn->rxbufs_per_msg;
+    virtio_net_debug("%s: %d queue pairs (max %d), rx q entries %d, tx q entries %d\n", __func__,
+                     vn->num_queues, max_pairs, virtqueue_entries(rxq), virtqueue_entries(txq));
     bytes rx_allocsize = vn->rxbuflen + sizeof(struct xpbuf);
-    bytes rxbuffers_pagesize = find_page_size(rx_allocsize, virtqueue_entries(vn->rxq));
-    bytes tx_handler_size = sizeof(closure_struct_type(tx_complete));
-    bytes tx_handler_pagesize = find_page_size(tx_handler_size, virtqueue_entries(vn->txq));
+    bytes rxbuffers_pagesize = find_page_size(rx_allocsize, virtqueue_entries(rxq));
+    bytes tx_handler_size = sizeof(struct vnet_tx);
+    bytes tx_handler_pagesize = find_page_size(tx_handler_size, virtqueue_entries(txq));
     virtio_net_debug("%s: net_header_len %d, rx_allocsize %d, rxbuffers_pagesize %d "
                      "tx_handler_size %d tx_handler_pagesize %d\n", __func__, vn->net_header_len,
                      rx_allocsize, rxbuffers_pagesize, tx_handler_size, tx_handler_pagesize);
@@ -320,12 +745,10 @@ static void virtio_net_attach(vtdev dev)
     assert(vn->rxbuffers != INVALID_ADDRESS);
     vn->txhandlers = allocate_objcache(h, (heap)contiguous, tx_handler_size, tx_handler_pagesize, true);
     assert(vn->txhandlers != INVALID_ADDRESS);
-    vn->empty = alloc_map(contiguous, contiguous->h.pagesize, &vn->empty_phys);
-    assert(vn->empty != INVALID_ADDRESS);
-    for (int i = 0; i < vn->net_header_len; i++)
-        ((u8 *)vn->empty)[i] = 0;
     vn->n->state = vn;
     vtdev_set_status(dev, VIRTIO_CONFIG_STATUS_DRIVER_OK);
+    if (vn->num_queues > 1)
+        vnet_mq_set_pairs(vn, vn->num_queues);
     netif_add(vn->n,
               0, 0, 0, 
               vn,
@@ -340,7 +763,8 @@ closure_function(2, 1, boolean, vtpci_net_probe,
     if (!vtpci_probe(d, VIRTIO_ID_NETWORK))
         return false;
     vtpci dev = attach_vtpci(bound(general), bound(page_allocator), d,
-        VIRTIO_NET_F_MAC | VIRTIO_F_ANY_LAYOUT | VIRTIO_F_RING_EVENT_IDX);
+        VIRTIO_NET_F_MAC | VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ | VIRTIO_NET_TX_OFFLOAD_FEATURES |
+        VIRTIO_NET_RX_OFFLOAD_FEATURES | VIRTIO_F_ANY_LAYOUT | VIRTIO_F_RING_EVENT_IDX);
     virtio_net_attach(&dev->virtio_dev);
     return true;
 }
@@ -354,7 +778,7 @@ closure_function(2, 1, void, vtmmio_net_probe,
             sizeof(struct virtio_net_config)))
         return;
     if (attach_vtmmio(bound(general), bound(page_allocator), d,
-            VIRTIO_NET_F_MAC))
+            VIRTIO_NET_F_MAC | VIRTIO_NET_TX_OFFLOAD_FEATURES))
         virtio_net_attach(&d->virtio_dev);
 }
 
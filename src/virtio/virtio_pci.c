@@ -246,12 +246,16 @@ static void vtpci_register_non_msix_config_handler(vtpci dev, thunk handler)
     dev->config_handler = handler;
 }
 
-static status vtpci_setup_msix(vtpci dev, thunk handler, const char *name, int cfg_reg)
+/* A negative target_cpu leaves the interrupt placement to the PCI layer. */
+static status vtpci_setup_msix(vtpci dev, thunk handler, const char *name, int cfg_reg,
+                               int target_cpu)
 {
     int msi_slot = allocate_u64(dev->msix_entries, 1);
     if (msi_slot < 0)
         return timm("status", "failed to find free MSI-X slot");
-    if (pci_setup_msix(dev->dev, msi_slot, handler, name) == INVALID_PHYSICAL)
+    u64 v = (target_cpu < 0) ? pci_setup_msix(dev->dev, msi_slot, handler, name) :
+        pci_setup_msix_cpu(dev->dev, msi_slot, handler, name, target_cpu);
+    if (v == INVALID_PHYSICAL)
         return timm("status", "failed to allocate MSI-X vector");
     pci_bar_write_2(&dev->common_config, dev->regs[cfg_reg], msi_slot);
     int check_idx = pci_bar_read_2(&dev->common_config, dev->regs[cfg_reg]);
@@ -261,10 +265,11 @@ static status vtpci_setup_msix(vtpci dev, thunk handler, const char *name, int c
         return timm("status", "cannot configure MSI-X vector");
 }
 
-status vtpci_alloc_virtqueue(vtpci dev,
-                             const char *name,
-                             int idx,
-                             struct virtqueue **result)
+status vtpci_alloc_virtqueue_cpu(vtpci dev,
+                                 const char *name,
+                                 int idx,
+                                 int target_cpu,
+                                 struct virtqueue **result)
 {
     // allocate virtqueue
     struct virtqueue *vq;
@@ -284,7 +289,7 @@ status vtpci_alloc_virtqueue(vtpci dev,
 
     if (dev->msix_entries) {
         // setup virtqueue MSI-X interrupt
-        s = vtpci_setup_msix(dev, handler, name, VTPCI_REG_QUEUE_MSIX_VECTOR);
+        s = vtpci_setup_msix(dev, handler, name, VTPCI_REG_QUEUE_MSIX_VECTOR, target_cpu);
         if (!is_ok(s))
             return s;
     } else {
@@ -307,6 +312,11 @@ status vtpci_alloc_virtqueue(vtpci dev,
     return STATUS_OK;
 }
 
+status vtpci_alloc_virtqueue(vtpci dev, const char *name, int idx, struct virtqueue **result)
+{
+    return vtpci_alloc_virtqueue_cpu(dev, name, idx, -1, result);
+}
+
 closure_function(2, 0, void, vtpci_config_change_msix_irq,
                  vtpci, dev, thunk, handler)
 {
@@ -323,7 +333,7 @@ status vtpci_register_config_change_handler(vtpci dev, thunk handler)
         assert(t != INVALID_ADDRESS);
 
         // XXX vtdev name
-        return vtpci_setup_msix(dev, t, "config change", VTPCI_REG_CONFIG_MSIX_VECTOR);
+        return vtpci_setup_msix(dev, t, "config change", VTPCI_REG_CONFIG_MSIX_VECTOR, -1);
     } else {
         vtpci_register_non_msix_config_handler(dev, handler);
     }
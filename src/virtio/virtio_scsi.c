@@ -263,7 +263,8 @@ static void virtio_scsi_enqueue_request(virtio_scsi s, virtio_scsi_request r,
     assert(m != INVALID_ADDRESS);
 
     vqmsg_push(vq, m, r_phys + offsetof(virtio_scsi_request, req), sizeof(r->req), false);
-    if (r->req.cdb[0] == SCSI_CMD_WRITE_16) {
+    u8 cmd = r->req.cdb[0];
+    if ((cmd == SCSI_CMD_WRITE_16) || (cmd == SCSI_CMD_UNMAP)) {
         if (length > 0)
             vqmsg_push(vq, m, physical_from_virtual(buf), length, false);   // dataout
         vqmsg_push(vq, m, r_phys + offsetof(virtio_scsi_request, resp), sizeof(r->resp),
@@ -411,6 +412,37 @@ static void virtio_scsi_flush(virtio_scsi_disk d, status_handler sh)
                                 closure(s->v->virtio_dev.general, virtio_scsi_io_done, sh));
 }
 
+static void virtio_scsi_unmap(virtio_scsi_disk d, range blocks, status_handler sh)
+{
+    virtio_scsi s = d->scsi;
+    merge m = 0;
+    while (range_span(blocks)) {
+        u32 nblocks = MIN(range_span(blocks), U32_MAX);
+        u64 r_phys;
+        virtio_scsi_request r = virtio_scsi_alloc_request(s, d->target, d->lun, SCSI_CMD_UNMAP,
+                                                          &r_phys);
+        struct scsi_cdb_unmap *cdb = (struct scsi_cdb_unmap *)r->req.cdb;
+        cdb->length = htobe16(sizeof(struct scsi_unmap_param));
+        struct scsi_unmap_param *param = (struct scsi_unmap_param *)r->data;
+        zero(param, sizeof(*param));
+        param->length = htobe16(sizeof(*param) - sizeof(param->length));
+        param->desc_length = htobe16(sizeof(param->desc));
+        param->desc.addr = htobe64(blocks.start);
+        param->desc.length = htobe32(nblocks);
+        virtio_scsi_debug("%s: blocks %R\n", __func__, irangel(blocks.start, nblocks));
+        blocks.start += nblocks;
+        if (!m && range_span(blocks)) {
+            m = allocate_merge(s->v->virtio_dev.general, sh);
+            sh = apply_merge(m);
+        }
+        virtio_scsi_enqueue_request(s, r, r_phys, r->data, sizeof(*param),
+                                    closure(s->v->virtio_dev.general, virtio_scsi_io_done,
+                                            m ? apply_merge(m) : sh));
+    }
+    if (m)
+        apply(sh, STATUS_OK);
+}
+
 define_closure_function(0, 1, void, virtio_scsi_req_handler,
                  storage_req, req)
 {
@@ -425,12 +457,17 @@ define_closure_function(0, 1, void, virtio_scsi_req_handler,
     case STORAGE_OP_FLUSH:
         virtio_scsi_flush(d, req->completion);
         break;
+    case STORAGE_OP_DISCARD:
+        virtio_scsi_unmap(d, req->blocks, req->completion);
+        break;
     case STORAGE_OP_READ:
         virtio_scsi_io(d, SCSI_CMD_READ_16, req->data, req->blocks, req->completion);
         break;
     case STORAGE_OP_WRITE:
         virtio_scsi_io(d, SCSI_CMD_WRITE_16, req->data, req->blocks, req->completion);
         break;
+    default:
+        apply(req->completion, timm("result", "operation not supported"));
     }
 }
 
@@ -18,6 +18,12 @@ typedef struct virtio_blk_req {
     u32 reserved;
     u64 sector;
     u8 status;
+    u8 unused[7];
+    struct virtio_blk_discard_write_zeroes {    /* data of discard and write zeroes requests */
+        u64 sector;
+        u32 num_sectors;
+        u32 flags;
+    } discard;
 } __attribute__((packed)) *virtio_blk_req;
 
 // device configuration offsets
@@ -42,7 +48,8 @@ struct virtio_blk_config {
        u32 opt_io_size;
     } topology;
     u8 writeback;
-    u8 unused0[3];
+    u8 unused0;
+    u16 num_queues;
     u32 max_discard_sectors;
     u32 max_discard_seg;
     u32 discard_sector_alignment;
@@ -60,6 +67,9 @@ struct virtio_blk_config {
 #define VIRTIO_BLK_F_FLUSH      U64_FROM_BIT(9)
 #define VIRTIO_BLK_F_TOPOLOGY   U64_FROM_BIT(10)
 #define VIRTIO_BLK_F_CONFIG_WCE U64_FROM_BIT(11)
+#define VIRTIO_BLK_F_MQ         U64_FROM_BIT(12)
+#define VIRTIO_BLK_F_DISCARD    U64_FROM_BIT(13)
+#define VIRTIO_BLK_F_WRITE_ZEROES   U64_FROM_BIT(14)
 
 #define VIRTIO_BLK_R_CAPACITY_LOW                (offsetof(struct virtio_blk_config *, capacity))
 #define VIRTIO_BLK_R_CAPACITY_HIGH               (offsetof(struct virtio_blk_config *, capacity) + 4)
@@ -74,6 +84,7 @@ struct virtio_blk_config {
 #define VIRTIO_BLK_R_TOPOLOGY_MIN_IO_SIZE        (offsetof(struct virtio_blk_config *, topology) + offsetof(struct virtio_blk_topology *, min_io_size))
 #define VIRTIO_BLK_R_TOPOLOGY_OPT_IO_SIZE        (offsetof(struct virtio_blk_config *, topology) + offsetof(struct virtio_blk_topology *, opt_io_size))
 #define VIRTIO_BLK_R_WRITEBACK                   (offsetof(struct virtio_blk_config *, writeback))
+#define VIRTIO_BLK_R_NUM_QUEUES                  (offsetof(struct virtio_blk_config *, num_queues))
 #define VIRTIO_BLK_R_MAX_DISCARD_SECTORS         (offsetof(struct virtio_blk_config *, max_discard_sectors))
 #define VIRTIO_BLK_R_MAX_DISCARD_SEG             (offsetof(struct virtio_blk_config *, max_discard_seg))
 #define VIRTIO_BLK_R_DISCARD_SECTOR_ALIGNMENT    (offsetof(struct virtio_blk_config *, discard_sector_alignment))
@@ -87,26 +98,58 @@ struct virtio_blk_config {
 #define VIRTIO_BLK_T_IN         0
 #define VIRTIO_BLK_T_OUT        1
 #define VIRTIO_BLK_T_FLUSH      4
+#define VIRTIO_BLK_T_DISCARD    11
+#define VIRTIO_BLK_T_WRITE_ZEROES   13
+
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP  1
 
 #define VIRTIO_BLK_S_OK         0
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
 
 #define VIRTIO_BLK_DRIVER_FEATURES  \
-    (VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_CONFIG_WCE | VIRTIO_BLK_F_FLUSH)
+    (VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_CONFIG_WCE | VIRTIO_BLK_F_FLUSH | \
+     VIRTIO_BLK_F_MQ | VIRTIO_BLK_F_DISCARD | VIRTIO_BLK_F_WRITE_ZEROES | \
+     VIRTIO_F_RING_INDIRECT_DESC)
+
+/* maximum number of descriptors (including request header and status) in an indirect table */
+#define VIRTIO_BLK_INDIRECT_MAX 64
 
 declare_closure_struct(0, 1, void, virtio_storage_req_handler,
                        storage_req, req);
+declare_closure_struct(0, 0, void, virtio_storage_poll);
+
+/* Request queue; with VIRTIO_BLK_F_MQ, there is one queue per CPU (up to the number of queues
+ * supported by the device), with its interrupt targeted at that CPU. */
+typedef struct virtio_blk_queue {
+    struct storage *st;
+    struct virtqueue *vq;
+    u32 poll_scheduled;
+    u64 inflight;       /* number of submitted requests */
+    closure_struct(virtio_storage_poll, poll);
+} *virtio_blk_queue;
 
 typedef struct storage {
     vtdev v;
     closure_struct(virtio_storage_req_handler, req_handler);
-    struct virtqueue *command;
+    struct virtio_blk_queue *queues;
+    u16 num_queues;
     u64 capacity;
     u64 block_size;
     u32 seg_max;
+    u32 discard_type;   /* VIRTIO_BLK_T_DISCARD or VIRTIO_BLK_T_WRITE_ZEROES (with unmap) */
+    u32 max_discard;    /* in sectors; 0 if discarding is not supported */
+    u32 discard_align;  /* in sectors */
+    boolean polling;    /* completions are polled instead of being interrupt-driven */
+    struct storage_stats stats;
+    struct spinlock stats_lock;
 } *storage;
 
+static inline virtio_blk_queue virtio_blk_get_queue(storage st)
+{
+    return &st->queues[current_cpu()->id % st->num_queues];
+}
+
 static virtio_blk_req allocate_virtio_blk_req(storage st, u32 type, u64 sector, u64 *phys)
 {
     virtio_blk_req req = alloc_map(st->v->contiguous, sizeof(struct virtio_blk_req), phys);
@@ -124,18 +167,64 @@ static void deallocate_virtio_blk_req(storage st, virtio_blk_req req, u64 phys)
                   pad(sizeof(struct virtio_blk_req), st->v->contiguous->h.pagesize));
 }
 
-closure_function(4, 1, void, complete,
-                 storage, s, status_handler, f, virtio_blk_req, req, u64, phys,
+closure_function(5, 1, void, complete,
+                 virtio_blk_queue, q, status_handler, f, virtio_blk_req, req, u64, phys,
+                 timestamp, start,
                  u64, len)
 {
+    virtio_blk_queue q = bound(q);
+    storage s = q->st;
+    virtio_blk_req req = bound(req);
+    if ((req->type == VIRTIO_BLK_T_IN) || (req->type == VIRTIO_BLK_T_OUT)) {
+        timestamp latency = now(CLOCK_ID_MONOTONIC_RAW) - bound(start);
+        u64 irqflags = spin_lock_irq(&s->stats_lock);
+        storage_stats_account(&s->stats, req->type == VIRTIO_BLK_T_OUT, latency);
+        spin_unlock_irq(&s->stats_lock, irqflags);
+    }
     status st = 0;
     // 1 is io error, 2 is unsupported operation
-    if (bound(req)->status) st = timm("result", "%d", bound(req)->status);
+    if (req->status) st = timm("result", "%d", req->status);
     async_apply_status_handler(bound(f), st);
-    deallocate_virtio_blk_req(bound(s), bound(req), bound(phys));
+    deallocate_virtio_blk_req(s, req, bound(phys));
+    fetch_and_add(&q->inflight, -1);
     closure_finish();
 }
 
+static void virtio_storage_poll_kick(virtio_blk_queue q)
+{
+    if (compare_and_swap_32(&q->poll_scheduled, false, true))
+        async_apply_poll((thunk)&q->poll);
+}
+
+/* In polling mode, completions are reaped from the CPU that submitted the request. */
+static vqfinish virtio_storage_completion(virtio_blk_queue q, status_handler sh,
+                                          virtio_blk_req req, u64 req_phys)
+{
+    storage st = q->st;
+    vqfinish c = closure(st->v->general, complete, q, sh, req, req_phys,
+                         now(CLOCK_ID_MONOTONIC_RAW));
+    assert(c != INVALID_ADDRESS);
+    fetch_and_add(&q->inflight, 1);
+    if (st->polling)
+        virtio_storage_poll_kick(q);
+    return c;
+}
+
+/* Runs from the poll queue, and reschedules itself as long as there are requests in flight. */
+define_closure_function(0, 0, void, virtio_storage_poll)
+{
+    virtio_blk_queue q = struct_from_field(closure_self(), virtio_blk_queue, poll);
+    virtqueue_poll(q->vq, virtqueue_entries(q->vq));
+    if (!q->inflight) {
+        q->poll_scheduled = false;
+        memory_barrier();
+        /* check again for requests submitted before poll_scheduled was cleared */
+        if (!q->inflight || !compare_and_swap_32(&q->poll_scheduled, false, true))
+            return;
+    }
+    async_apply_poll((thunk)&q->poll);
+}
+
 static inline void storage_rw_internal(storage st, boolean write, void * buf,
                                        range sectors, status_handler sh)
 {
@@ -152,28 +241,27 @@ static inline void storage_rw_internal(storage st, boolean write, void * buf,
     u64 req_phys;
     virtio_blk_req req = allocate_virtio_blk_req(st, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
                                                  start_sector, &req_phys);
-    virtqueue vq = st->command;
+    virtio_blk_queue q = virtio_blk_get_queue(st);
+    virtqueue vq = q->vq;
     vqmsg m = allocate_vqmsg(vq);
     assert(m != INVALID_ADDRESS);
     vqmsg_push(vq, m, req_phys, VIRTIO_BLK_REQ_HEADER_SIZE, false);
     vqmsg_push(vq, m, physical_from_virtual(buf), nsectors * st->block_size, !write);
     u64 statusp = req_phys + VIRTIO_BLK_REQ_HEADER_SIZE;
     vqmsg_push(vq, m, statusp, VIRTIO_BLK_REQ_STATUS_SIZE, true);
-    vqfinish c = closure(st->v->general, complete, st, sh, req, req_phys);
-    vqmsg_commit(vq, m, c);
+    vqmsg_commit(vq, m, virtio_storage_completion(q, sh, req, req_phys));
     return;
   out_inval:
     msg_err("%s", err);               /* yes, bark */
     apply(sh, timm("result", "%s", err));
 }
 
-static void virtio_storage_io_commit(storage st, virtqueue vq, vqmsg msg, virtio_blk_req req,
+static void virtio_storage_io_commit(virtio_blk_queue q, vqmsg msg, virtio_blk_req req,
                                      u64 req_phys, status_handler completion)
 {
+    virtqueue vq = q->vq;
     vqmsg_push(vq, msg, req_phys + VIRTIO_BLK_REQ_HEADER_SIZE, VIRTIO_BLK_REQ_STATUS_SIZE, true);
-    vqfinish c = closure(st->v->general, complete, st, completion, req, req_phys);
-    assert(c != INVALID_ADDRESS);
-    vqmsg_commit(vq, msg, c);
+    vqmsg_commit(vq, msg, virtio_storage_completion(q, completion, req, req_phys));
 }
 
 static void virtio_storage_io_sg(storage st, boolean write, sg_list sg, range blocks,
@@ -183,7 +271,8 @@ static void virtio_storage_io_sg(storage st, boolean write, sg_list sg, range bl
     virtio_blk_req req = 0;
     u64 req_phys;
     heap h = st->v->general;
-    virtqueue vq = st->command;
+    virtio_blk_queue q = virtio_blk_get_queue(st);
+    virtqueue vq = q->vq;
     vqmsg msg;
     u32 desc_count;
     merge m = 0;
@@ -208,12 +297,54 @@ static void virtio_storage_io_sg(storage st, boolean write, sg_list sg, range bl
                 m = allocate_merge(h, sh);
                 sh = apply_merge(m);
             }
-            virtio_storage_io_commit(st, vq, msg, req, req_phys, m ? apply_merge(m) : sh);
+            virtio_storage_io_commit(q, msg, req, req_phys, m ? apply_merge(m) : sh);
             req = 0;
         }
     }
     if (req) {
-        virtio_storage_io_commit(st, vq, msg, req, req_phys, m ? apply_merge(m) : sh);
+        virtio_storage_io_commit(q, msg, req, req_phys, m ? apply_merge(m) : sh);
+    }
+    if (m)
+        apply(sh, STATUS_OK);
+}
+
+static void virtio_storage_discard(storage st, range blocks, status_handler sh)
+{
+    virtio_blk_debug("discard blocks %R\n", blocks);
+    if (!st->max_discard) {
+        apply(sh, timm("result", "discard not supported"));
+        return;
+    }
+    /* the part of the range that is not aligned to the device discard granularity is left as is */
+    u32 align = st->discard_align;
+    blocks.start = ((blocks.start + align - 1) / align) * align;
+    blocks.end -= blocks.end % align;
+    if (blocks.end <= blocks.start) {
+        apply(sh, STATUS_OK);
+        return;
+    }
+    virtio_blk_queue q = virtio_blk_get_queue(st);
+    virtqueue vq = q->vq;
+    merge m = 0;
+    if (range_span(blocks) > st->max_discard) {
+        m = allocate_merge(st->v->general, sh);
+        sh = apply_merge(m);
+    }
+    while (range_span(blocks)) {
+        u32 nsectors = MIN(range_span(blocks), st->max_discard);
+        u64 req_phys;
+        virtio_blk_req req = allocate_virtio_blk_req(st, st->discard_type, 0, &req_phys);
+        req->discard.sector = blocks.start;
+        req->discard.num_sectors = nsectors;
+        req->discard.flags = (st->discard_type == VIRTIO_BLK_T_WRITE_ZEROES) ?
+                VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP : 0;
+        vqmsg msg = allocate_vqmsg(vq);
+        assert(msg != INVALID_ADDRESS);
+        vqmsg_push(vq, msg, req_phys, VIRTIO_BLK_REQ_HEADER_SIZE, false);
+        vqmsg_push(vq, msg, req_phys + offsetof(virtio_blk_req, discard), sizeof(req->discard),
+                   false);
+        virtio_storage_io_commit(q, msg, req, req_phys, m ? apply_merge(m) : sh);
+        blocks.start += nsectors;
     }
     if (m)
         apply(sh, STATUS_OK);
@@ -224,14 +355,13 @@ static void storage_flush(storage st, status_handler s)
     virtio_blk_debug("%s: handler %p (%F)\n", __func__, s, s);
     u64 req_phys;
     virtio_blk_req req = allocate_virtio_blk_req(st, VIRTIO_BLK_T_FLUSH, 0, &req_phys);
-    virtqueue vq = st->command;
+    virtio_blk_queue q = virtio_blk_get_queue(st);
+    virtqueue vq = q->vq;
     vqmsg m = allocate_vqmsg(vq);
     assert(m != INVALID_ADDRESS);
     vqmsg_push(vq, m, req_phys, VIRTIO_BLK_REQ_HEADER_SIZE, false);
     vqmsg_push(vq, m, req_phys + VIRTIO_BLK_REQ_HEADER_SIZE, VIRTIO_BLK_REQ_STATUS_SIZE, true);
-    vqfinish c = closure(st->v->general, complete, st, s, req, req_phys);
-    assert(c != INVALID_ADDRESS);
-    vqmsg_commit(vq, m, c);
+    vqmsg_commit(vq, m, virtio_storage_completion(q, s, req, req_phys));
 }
 
 define_closure_function(0, 1, void, virtio_storage_req_handler,
@@ -257,9 +387,75 @@ define_closure_function(0, 1, void, virtio_storage_req_handler,
     case STORAGE_OP_WRITE:
         storage_rw_internal(st, true, req->data, req->blocks, req->completion);
         break;
+    case STORAGE_OP_SETPOLL:
+        st->polling = (req->data != 0);
+        for (int i = 0; i < st->num_queues; i++) {
+            virtio_blk_queue q = &st->queues[i];
+            virtqueue_set_polling(q->vq, st->polling);
+
+            /* requests in flight no longer raise interrupts */
+            if (st->polling && q->inflight)
+                virtio_storage_poll_kick(q);
+        }
+        apply(req->completion, STATUS_OK);
+        break;
+    case STORAGE_OP_DISCARD:
+        virtio_storage_discard(st, req->blocks, req->completion);
+        break;
+    case STORAGE_OP_PLUG:
+    case STORAGE_OP_UNPLUG:
+        virtqueue_plug(virtio_blk_get_queue(st)->vq, req->op == STORAGE_OP_PLUG);
+        apply(req->completion, STATUS_OK);
+        break;
+    case STORAGE_OP_GETSTATS: {
+        u64 irqflags = spin_lock_irq(&st->stats_lock);
+        storage_stats_merge(req->data, &st->stats);
+        spin_unlock_irq(&st->stats_lock, irqflags);
+        apply(req->completion, STATUS_OK);
+        break;
+    }
+    default:
+        apply(req->completion, timm("result", "operation not supported"));
     }
 }
 
+static const char *virtio_blk_queue_name(heap h, int q)
+{
+    buffer b = aprintf(h, "virtio blk %d", q);
+    assert(b != INVALID_ADDRESS);
+    buffer_write_byte(b, 0);
+    return buffer_ref(b, 0);
+}
+
+static void virtio_blk_alloc_queues(storage s, heap general)
+{
+    vtdev v = s->v;
+    u16 max_queues = (v->features & VIRTIO_BLK_F_MQ) ?
+            vtdev_cfg_read_2(v, VIRTIO_BLK_R_NUM_QUEUES) : 1;
+    max_queues = MAX(MIN(max_queues, (u16)total_processors), 1);
+    virtio_blk_debug("%s: %d queue(s)\n", __func__, max_queues);
+    s->queues = allocate_zero(general, max_queues * sizeof(struct virtio_blk_queue));
+    assert(s->queues != INVALID_ADDRESS);
+    s->num_queues = 0;
+    for (int i = 0; i < max_queues; i++) {
+        virtio_blk_queue q = &s->queues[i];
+        status st = (max_queues == 1) ? virtio_alloc_virtqueue(v, "virtio blk", 0, &q->vq) :
+                virtio_alloc_virtqueue_cpu(v, virtio_blk_queue_name(general, i), i, i, &q->vq);
+        if (!is_ok(st)) {
+            msg_err("failed to allocate queue %d: %v\n", i, st);
+            timm_dealloc(st);
+            break;
+        }
+        q->st = s;
+        init_closure(&q->poll, virtio_storage_poll);
+
+        /* a request takes one descriptor for each data segment plus header and status */
+        virtqueue_set_indirect(q->vq, MIN(s->seg_max + 2, VIRTIO_BLK_INDIRECT_MAX));
+        s->num_queues++;
+    }
+    assert(s->num_queues > 0);
+}
+
 static void virtio_blk_attach(heap general, storage_attach a, vtdev v)
 {
     storage s = allocate(general, sizeof(struct storage));
@@ -271,10 +467,32 @@ static void virtio_blk_attach(heap general, storage_attach a, vtdev v)
     s->capacity = (vtdev_cfg_read_4(v, VIRTIO_BLK_R_CAPACITY_LOW) |
 		   ((u64) vtdev_cfg_read_4(v, VIRTIO_BLK_R_CAPACITY_HIGH) << 32)) * s->block_size;
     virtio_blk_debug("%s: capacity 0x%lx, block size 0x%x\n", __func__, s->capacity, s->block_size);
-    virtio_alloc_virtqueue(v, "virtio blk", 0, &s->command);
-
     s->seg_max = (v->features & VIRTIO_BLK_F_SEG_MAX) ?
             vtdev_cfg_read_4(v, VIRTIO_BLK_R_SEG_MAX) : 1;
+    s->discard_align = 1;
+    if (v->features & VIRTIO_BLK_F_DISCARD) {
+        s->discard_type = VIRTIO_BLK_T_DISCARD;
+        s->max_discard = vtdev_cfg_read_4(v, VIRTIO_BLK_R_MAX_DISCARD_SECTORS);
+        s->discard_align = MAX(vtdev_cfg_read_4(v, VIRTIO_BLK_R_DISCARD_SECTOR_ALIGNMENT), 1);
+
+        /* each request carries a single segment; keep request boundaries aligned */
+        if (vtdev_cfg_read_4(v, VIRTIO_BLK_R_MAX_DISCARD_SEG) == 0)
+            s->max_discard = 0;
+        else
+            s->max_discard -= s->max_discard % s->discard_align;
+    } else if ((v->features & VIRTIO_BLK_F_WRITE_ZEROES) &&
+               vtdev_cfg_read_1(v, VIRTIO_BLK_R_WRITE_ZEROS_MAY_UNMAP)) {
+        s->discard_type = VIRTIO_BLK_T_WRITE_ZEROES;
+        s->max_discard = vtdev_cfg_read_4(v, VIRTIO_BLK_R_MAX_WRITE_ZEROS_SECTORS);
+    } else {
+        s->max_discard = 0;
+    }
+    virtio_blk_debug("%s: max discard sectors %d, alignment %d\n", __func__, s->max_discard,
+                     s->discard_align);
+    virtio_blk_alloc_queues(s, general);
+    s->polling = false;
+    zero(&s->stats, sizeof(s->stats));
+    spin_lock_init(&s->stats_lock);
     if (v->features & VIRTIO_BLK_F_FLUSH) {
         if (v->features & VIRTIO_BLK_F_CONFIG_WCE)
             vtdev_cfg_write_1(v, VIRTIO_BLK_R_WRITEBACK, 1 /* writeback */);
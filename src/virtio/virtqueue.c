@@ -75,6 +75,33 @@ struct vring_used {
     struct vring_used_elem ring[0];
 } __attribute__((packed));
 
+/* packed ring layout (VIRTIO_F_RING_PACKED) */
+#define VRING_PACKED_DESC_F_AVAIL   (1 << 7)
+#define VRING_PACKED_DESC_F_USED    (1 << 15)
+
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 1
+#define VRING_PACKED_EVENT_FLAG_DESC    2
+#define VRING_PACKED_EVENT_F_WRAP_CTR   15
+
+struct vring_packed_desc {
+    u64 busaddr;
+    u32 len;
+    u16 id;
+    u16 flags;
+} __attribute__((packed));
+
+struct vring_packed_event {
+    u16 off_wrap;
+    u16 flags;
+} __attribute__((packed));
+
+/* per buffer id state */
+struct vring_packed_id {
+    u16 next;                   /* free list link */
+    u16 count;                  /* ring descriptors taken by the buffer */
+};
+
 typedef struct vqmsg {
     struct list l;              /* vq->msg_queue when queued, or chained for bh process */
     union {
@@ -97,11 +124,24 @@ typedef struct virtqueue {
     volatile struct vring_used *used;    
     u16 *avail_event;
     u16 *used_event;
+    boolean packed;
+    volatile struct vring_packed_desc *packed_desc;
+    volatile struct vring_packed_event *driver_event;
+    volatile struct vring_packed_event *device_event;
+    struct vring_packed_id *packed_ids;
+    u16 avail_pos;              /* packed only: next ring descriptor to be made available */
+    boolean avail_wrap;         /* packed only: driver ring wrap counter */
+    boolean used_wrap;          /* packed only: device ring wrap counter */
     boolean polling;
     boolean events_enabled;
+    thunk poll_handler;         /* interrupt-mitigated mode, see virtqueue_set_poll_handler() */
+    boolean poll_scheduled;
+    u16 plugged;                /* see virtqueue_plug() */
+    struct vring_desc *indirect;    /* indirect descriptor tables, one per ring descriptor */
+    u16 indirect_max;               /* descriptors per indirect table */
     u64 free_cnt;               /* atomic */
-    u16 desc_idx;               /* head of descriptor free list */
-    u16 last_used_idx;          /* irq only */
+    u16 desc_idx;               /* head of descriptor (buffer id if packed) free list */
+    u16 last_used_idx;          /* irq only; ring position if packed */
     struct list msg_queue;
     struct list free_msgs;
     struct spinlock lock;
@@ -154,6 +194,23 @@ void vqmsg_push(virtqueue vq, vqmsg m, u64 phys_addr, u32 len, boolean write)
 
 static void virtqueue_fill(virtqueue vq);
 
+/* Queues the message without making it available to the device until virtqueue_kick() is called,
+ * so that a batch of messages can be submitted with a single notification. */
+void vqmsg_queue(virtqueue vq, vqmsg m, vqfinish completion)
+{
+    m->completion = completion;
+    u64 irqflags = spin_lock_irq(&vq->lock);
+    list_push_back(&vq->msg_queue, &m->l);
+    spin_unlock_irq(&vq->lock, irqflags);
+}
+
+void virtqueue_kick(virtqueue vq)
+{
+    u64 irqflags = spin_lock_irq(&vq->lock);
+    virtqueue_fill(vq);
+    spin_unlock_irq(&vq->lock, irqflags);
+}
+
 void vqmsg_commit(virtqueue vq, vqmsg m, vqfinish completion)
 {
     m->completion = completion;
@@ -161,39 +218,109 @@ void vqmsg_commit(virtqueue vq, vqmsg m, vqfinish completion)
                             __func__, vq->name, m, completion, completion);
     u64 irqflags = spin_lock_irq(&vq->lock);
     list_push_back(&vq->msg_queue, &m->l);
-    virtqueue_fill(vq);
+    if (!vq->plugged)
+        virtqueue_fill(vq);
+    spin_unlock_irq(&vq->lock, irqflags);
+}
+
+/* While a queue is plugged, committed messages are held back as with vqmsg_queue(); when the last
+ * plug is removed, they are made available to the device with a single notification. */
+void virtqueue_plug(virtqueue vq, boolean plug)
+{
+    u64 irqflags = spin_lock_irq(&vq->lock);
+    if (plug) {
+        vq->plugged++;
+    } else {
+        assert(vq->plugged > 0);
+        if (--vq->plugged == 0)
+            virtqueue_fill(vq);
+    }
     spin_unlock_irq(&vq->lock, irqflags);
 }
 
+static boolean vq_used_pending(virtqueue vq)
+{
+    if (vq->packed) {
+        u16 flags = vq->packed_desc[vq->last_used_idx].flags;
+        boolean avail = (flags & VRING_PACKED_DESC_F_AVAIL) != 0;
+        boolean used = (flags & VRING_PACKED_DESC_F_USED) != 0;
+        return (avail == used) && (used == vq->used_wrap);
+    }
+    return (vq->last_used_idx != vq->used->idx);
+}
+
+/* called with lock held */
+static vqmsg vq_packed_pop_used(virtqueue vq)
+{
+    if (!vq_used_pending(vq))
+        return 0;
+
+    /* the descriptor contents are valid only once its flags show it as used */
+    read_barrier();
+    volatile struct vring_packed_desc *d = vq->packed_desc + vq->last_used_idx;
+    u16 id = d->id;
+    vqmsg m = vq->msgs[id];
+    assert(m);
+    virtqueue_debug_verbose("%s: vq %s: last_used_idx %d, id %d, len %d\n",
+        __func__, vq->name, vq->last_used_idx, id, d->len);
+
+    /* the device writes a single used descriptor per buffer and skips the rest of the chain */
+    u16 count = vq->packed_ids[id].count;
+    assert((count == 1) || (count == m->count));
+    vq->last_used_idx += count;
+    if (vq->last_used_idx >= vq->entries) {
+        vq->last_used_idx -= vq->entries;
+        vq->used_wrap = !vq->used_wrap;
+    }
+    vq->packed_ids[id].next = vq->desc_idx;
+    vq->desc_idx = id;
+
+    fetch_and_add(&vq->free_cnt, count);
+    m->len = d->len;
+    vq->msgs[id] = 0;
+    return m;
+}
+
+/* called with lock held */
+static vqmsg vq_pop_used(virtqueue vq)
+{
+    if (vq->packed)
+        return vq_packed_pop_used(vq);
+    if (vq->last_used_idx == vq->used->idx)
+        return 0;
+    volatile struct vring_used_elem *uep = vq->used->ring + (vq->last_used_idx & (vq->entries - 1));
+    virtqueue_debug_verbose("%s: vq %s: last_used_idx %d, id %d, len %d\n",
+        __func__, vq->name, vq->last_used_idx, uep->id, uep->len);
+    u16 head = uep->id;
+    vqmsg m = vq->msgs[head];
+
+    /* return descriptor(s) to free list */
+    int dcount = 1;
+    volatile struct vring_desc *d = vq->desc + head;
+    boolean indirect = (d->flags & VRING_DESC_F_INDIRECT) != 0;
+    while ((d->flags & VRING_DESC_F_NEXT)) {
+        d = vq->desc + d->next;
+        dcount++;
+    }
+    assert(indirect ? (dcount == 1) : (dcount == m->count));
+    d->next = vq->desc_idx;
+    vq->desc_idx = head;
+
+    vq->last_used_idx++;
+    fetch_and_add(&vq->free_cnt, dcount);
+    m->len = uep->len;
+    vq->msgs[head] = 0;
+    virtqueue_debug("add msg %p\n", m);
+    return m;
+}
+
 static void vq_poll(virtqueue vq)
 {
     // ensure we see up-to-date used->idx (updated by host)
     memory_barrier();
-    
-    while (vq->last_used_idx != vq->used->idx) {
-        volatile struct vring_used_elem *uep = vq->used->ring + (vq->last_used_idx & (vq->entries - 1));
-        virtqueue_debug_verbose("%s: vq %s: last_used_idx %d, id %d, len %d\n",
-            __func__, vq->name, vq->last_used_idx, uep->id, uep->len);
-        u16 head = uep->id;
-        vqmsg m = vq->msgs[head];
-
-        /* return descriptor(s) to free list */
-        int dcount = 1;
-        volatile struct vring_desc *d = vq->desc + head;
-        while ((d->flags & VRING_DESC_F_NEXT)) {
-            d = vq->desc + d->next;
-            dcount++;
-        }
-        assert(dcount == m->count);
-        d->next = vq->desc_idx;
-        vq->desc_idx = head;
-
-        vq->last_used_idx++;
-        fetch_and_add(&vq->free_cnt, m->count);
-        m->len = uep->len;
-        vq->msgs[head] = 0;
-        virtqueue_debug("add msg %p\n", m);
 
+    vqmsg m;
+    while ((m = vq_pop_used(vq))) {
         async_apply_1(m->completion, (void*)m->len);
 
         /* TODO should probably observe a limit / drain method here */
@@ -201,19 +328,30 @@ static void vq_poll(virtqueue vq)
     }
 }
 
+static void vq_enable_events(virtqueue vq);
+static void vq_disable_events(virtqueue vq);
+static boolean vq_set_used_event(virtqueue vq);
+
 closure_function(1, 0, void, vq_interrupt,
                  virtqueue, vq)
 {
     virtqueue vq = bound(vq);
-    virtqueue_debug_verbose("%s: ENTRY: vq %s: entries %d, last_used_idx %d, used->idx %d, desc_idx %d\n",
-        __func__, vq->name, vq->entries, vq->last_used_idx, vq->used->idx, vq->desc_idx);
+    virtqueue_debug_verbose("%s: ENTRY: vq %s: entries %d, last_used_idx %d, desc_idx %d\n",
+        __func__, vq->name, vq->entries, vq->last_used_idx, vq->desc_idx);
 
     spin_lock(&vq->lock);
+    if (vq->poll_handler) {
+        if (!vq->poll_scheduled) {
+            vq_disable_events(vq);
+            vq->poll_scheduled = true;
+            async_apply_bh(vq->poll_handler);
+        }
+        spin_unlock(&vq->lock);
+        return;
+    }
   poll:
     vq_poll(vq);
-    if (!vq->polling && (vq->dev->features & VIRTIO_F_RING_EVENT_IDX) &&
-        (vq->last_used_idx != *vq->used_event)) {
-        *vq->used_event = vq->last_used_idx;
+    if (!vq->polling && (vq->dev->features & VIRTIO_F_RING_EVENT_IDX) && vq_set_used_event(vq)) {
         /* Poll again, to cover cases where a new buffer has been used after the previous poll but
          * before updating used_event. */
         goto poll;
@@ -233,21 +371,32 @@ status virtqueue_alloc(vtdev dev,
                        virtqueue *vqp,
                        thunk *t)
 {
+    boolean packed = (dev->features & VIRTIO_F_RING_PACKED) != 0;
     u64 vq_alloc_size = sizeof(struct virtqueue) + size * sizeof(vqmsg);
+    if (packed)
+        vq_alloc_size += size * sizeof(struct vring_packed_id);
     virtqueue vq = allocate_zero(dev->general, vq_alloc_size);
-    bytes avail_offset = size * sizeof(struct vring_desc);
-    bytes used_offset = pad(avail_offset + sizeof(*vq->avail) + sizeof(vq->avail->ring[0]) * size +
-                            sizeof(u16) /* used_event */, align);
-    bytes alloc = used_offset + pad(sizeof(*vq->used) + sizeof(vq->used->ring[0]) * size +
-                                    sizeof(u16) /* avail_event */, align);
+    bytes avail_offset, used_offset, alloc;
+    if (packed) {
+        /* driver and device event suppression areas follow the descriptor ring */
+        avail_offset = size * sizeof(struct vring_packed_desc);
+        used_offset = avail_offset + sizeof(struct vring_packed_event);
+        alloc = used_offset + sizeof(struct vring_packed_event);
+    } else {
+        avail_offset = size * sizeof(struct vring_desc);
+        used_offset = pad(avail_offset + sizeof(*vq->avail) + sizeof(vq->avail->ring[0]) * size +
+                          sizeof(u16) /* used_event */, align);
+        alloc = used_offset + pad(sizeof(*vq->used) + sizeof(vq->used->ring[0]) * size +
+                                  sizeof(u16) /* avail_event */, align);
+    }
     
     if (vq == INVALID_ADDRESS) 
         return timm("status", "cannot allocate virtqueue");
     
     vq->dev = dev;
     vq->name = name;
-    virtqueue_debug("%s: vq %s: idx %d, size %d, alloc %d\n",
-                    __func__, vq->name, queue_index, size, alloc);
+    virtqueue_debug("%s: vq %s: idx %d, size %d, alloc %d%s\n",
+                    __func__, vq->name, queue_index, size, alloc, packed ? ", packed" : "");
     vq->queue_index = queue_index;
     vq->notify_offset = notify_offset;
     vq->entries = size;
@@ -261,6 +410,22 @@ status virtqueue_alloc(vtdev dev,
         return(timm("status", "cannot allocate memory for virtqueue ring"));
     }
 
+    vq->events_enabled = true;
+    if (packed) {
+        vq->packed = true;
+        vq->packed_desc = vq->ring_mem;
+        vq->driver_event = vq->ring_mem + avail_offset;
+        vq->device_event = vq->ring_mem + used_offset;
+        vq->packed_ids = (struct vring_packed_id *)(vq->msgs + size);
+        vq->avail_wrap = vq->used_wrap = true;
+
+        // initialize buffer id free list
+        for (int i = 0; i < vq->entries - 1; i++)
+            vq->packed_ids[i].next = i + 1;
+        vq->packed_ids[vq->entries - 1].next = VQ_RING_DESC_CHAIN_END;
+        goto done;
+    }
+
     vq->desc = (struct vring_desc *) vq->ring_mem;
     vq->avail = (struct vring_avail *) (vq->ring_mem + avail_offset);
     vq->used = (struct vring_used *) (vq->ring_mem + used_offset);
@@ -268,13 +433,13 @@ status virtqueue_alloc(vtdev dev,
         __func__, vq, vq->desc, vq->avail, vq->used);
     vq->avail_event = (void *)(vq->used + 1) + sizeof(vq->used->ring[0]) * size;
     vq->used_event = (void *)(vq->avail + 1) + sizeof(vq->avail->ring[0]) * size;
-    vq->events_enabled = true;
 
     // initialize descriptor chains
     for (int i = 0; i < vq->entries - 1; i++)
         vq->desc[i].next = i + 1;
     vq->desc[vq->entries - 1].next = VQ_RING_DESC_CHAIN_END;
 
+  done:
     *t = closure(dev->general, vq_interrupt, vq);
     *vqp = vq;
     return STATUS_OK;
@@ -285,14 +450,16 @@ physical virtqueue_desc_paddr(virtqueue vq)
     return physical_from_virtual(vq->ring_mem);
 }
 
+/* For a packed queue, the driver event suppression area takes the place of the available ring. */
 physical virtqueue_avail_paddr(virtqueue vq)
 {
-    return physical_from_virtual((void *)vq->avail);
+    return physical_from_virtual(vq->packed ? (void *)vq->driver_event : (void *)vq->avail);
 }
 
+/* For a packed queue, the device event suppression area takes the place of the used ring. */
 physical virtqueue_used_paddr(virtqueue vq)
 {
-    return physical_from_virtual((void *)vq->used);
+    return physical_from_virtual(vq->packed ? (void *)vq->device_event : (void *)vq->used);
 }
 
 u16 virtqueue_entries(virtqueue vq)
@@ -300,18 +467,39 @@ u16 virtqueue_entries(virtqueue vq)
     return vq->entries;
 }
 
+/* Moves the used event to the current used position; returns false if it was already there. */
+static boolean vq_set_used_event(virtqueue vq)
+{
+    if (vq->packed) {
+        u16 off_wrap = vq->last_used_idx | (vq->used_wrap << VRING_PACKED_EVENT_F_WRAP_CTR);
+        if (vq->driver_event->off_wrap == off_wrap)
+            return false;
+        vq->driver_event->off_wrap = off_wrap;
+    } else {
+        if (*vq->used_event == vq->last_used_idx)
+            return false;
+        *vq->used_event = vq->last_used_idx;
+    }
+    return true;
+}
+
 static void vq_enable_events(virtqueue vq)
 {
     if (vq->dev->features & VIRTIO_F_RING_EVENT_IDX)
-        *vq->used_event = vq->last_used_idx;
-    else
+        vq_set_used_event(vq);
+    if (vq->packed)
+        vq->driver_event->flags = (vq->dev->features & VIRTIO_F_RING_EVENT_IDX) ?
+                                  VRING_PACKED_EVENT_FLAG_DESC : VRING_PACKED_EVENT_FLAG_ENABLE;
+    else if (!(vq->dev->features & VIRTIO_F_RING_EVENT_IDX))
         vq->avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
     vq->events_enabled = true;
 }
 
 static void vq_disable_events(virtqueue vq)
 {
-    if (vq->dev->features & VIRTIO_F_RING_EVENT_IDX)
+    if (vq->packed)
+        vq->driver_event->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+    else if (vq->dev->features & VIRTIO_F_RING_EVENT_IDX)
         /* set an arbitrary value, we will still receive an interrupt every 64K messages */
         *vq->used_event = (u16)-1;
     else
@@ -321,20 +509,115 @@ static void vq_disable_events(virtqueue vq)
 
 void virtqueue_set_polling(virtqueue vq, boolean enable)
 {
+    u64 irqflags = spin_lock_irq(&vq->lock);
     if (enable)
         vq_disable_events(vq);
     else
         vq_enable_events(vq);
     vq->polling = enable;
+    spin_unlock_irq(&vq->lock, irqflags);
+}
+
+/* Messages with more than one and up to max_desc descriptors are submitted via an indirect
+ * descriptor table, so that they take a single ring descriptor. Requires the
+ * VIRTIO_F_RING_INDIRECT_DESC feature to have been negotiated. */
+boolean virtqueue_set_indirect(virtqueue vq, u16 max_desc)
+{
+    if (!(vq->dev->features & VIRTIO_F_RING_INDIRECT_DESC) || (max_desc < 2))
+        return false;
+    bytes size = vq->entries * max_desc * sizeof(struct vring_desc);
+    struct vring_desc *indirect = allocate(&vq->dev->contiguous->h, size);
+    if (indirect == INVALID_ADDRESS)
+        return false;
+    u64 irqflags = spin_lock_irq(&vq->lock);
+    vq->indirect = indirect;
+    vq->indirect_max = max_desc;
+    spin_unlock_irq(&vq->lock, irqflags);
+    return true;
+}
+
+/* In this mode, the queue interrupt only disables further interrupts and schedules the handler
+ * (in bottom-half context, on the interrupted CPU); the handler retrieves completed messages with
+ * virtqueue_poll(). */
+void virtqueue_set_poll_handler(virtqueue vq, thunk handler)
+{
+    vq->poll_handler = handler;
 }
 
+/* Invokes the completions of up to budget used messages, and returns their number. Once the queue
+ * is drained, interrupts are enabled again; otherwise, the poll handler is rescheduled on the poll
+ * queue, which the runloop services after the other queues and threads have had a turn. In polling
+ * mode (see virtqueue_set_polling()), interrupts
+ * stay disabled and the caller is responsible for polling again. */
+u64 virtqueue_poll(virtqueue vq, u64 budget)
+{
+    struct list done;
+    list_init(&done);
+    u64 count = 0;
+    u64 irqflags = spin_lock_irq(&vq->lock);
+    memory_barrier();
+    vqmsg m;
+    while ((count < budget) && (m = vq_pop_used(vq))) {
+        list_push_back(&done, &m->l);
+        count++;
+    }
+
+    /* post the messages that were waiting for the descriptors just freed */
+    if (count && !vq->plugged && !list_empty(&vq->msg_queue))
+        virtqueue_fill(vq);
+    boolean reschedule = (count == budget);
+    if (vq->polling) {
+        reschedule = false;
+    } else if (!reschedule) {
+        vq_enable_events(vq);
+        /* check again for messages used before interrupts were enabled */
+        memory_barrier();
+        reschedule = vq_used_pending(vq);
+        if (reschedule)
+            vq_disable_events(vq);
+        else
+            vq->poll_scheduled = false;
+    }
+    spin_unlock_irq(&vq->lock, irqflags);
+    if (reschedule)
+        async_apply_poll(vq->poll_handler);
+
+    list_foreach(&done, l) {
+        m = struct_from_list(l, vqmsg, l);
+        apply(m->completion, m->len);
+    }
+    if (count) {
+        irqflags = spin_lock_irq(&vq->lock);
+        list_foreach(&done, l) {
+            list_delete(l);
+            list_insert_after(&vq->free_msgs, l);
+        }
+        spin_unlock_irq(&vq->lock, irqflags);
+    }
+    return count;
+}
+
+/* added is the number of available ring entries (descriptors if packed) just published */
 static int virtqueue_notify(virtqueue vq, u16 added)
 {
     // ensure used->flags update is visible to us
     // and updated avail->idx is visible to host
     memory_barrier();
     int should_notify;
-    if (vq->dev->features & VIRTIO_F_RING_EVENT_IDX)
+    if (vq->packed) {
+        u16 flags = vq->device_event->flags;
+        if (flags == VRING_PACKED_EVENT_FLAG_DESC) {
+            /* notify if the event descriptor is among the ones just made available */
+            u16 off_wrap = vq->device_event->off_wrap;
+            u16 event_idx = off_wrap & MASK(VRING_PACKED_EVENT_F_WRAP_CTR);
+            if (!(off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) != !vq->avail_wrap)
+                event_idx -= vq->entries;
+            u16 old_pos = vq->avail_pos - added;
+            should_notify = ((u16)(vq->avail_pos - event_idx - 1) < (u16)(vq->avail_pos - old_pos));
+        } else {
+            should_notify = (flags != VRING_PACKED_EVENT_FLAG_DISABLE);
+        }
+    } else if (vq->dev->features & VIRTIO_F_RING_EVENT_IDX)
         should_notify = ((vq->avail->idx - *vq->avail_event - 1) < added) || (added == vq->entries);
     else
         should_notify = ((vq->used->flags & VRING_USED_F_NO_NOTIFY) == 0);
@@ -343,11 +626,126 @@ static int virtqueue_notify(virtqueue vq, u16 added)
     return should_notify;
 }
 
+static void vq_split_add(virtqueue vq, vqmsg m, boolean indirect)
+{
+    u16 head = vq->desc_idx;
+    vq->msgs[head] = m;
+
+    if (indirect) {
+        /* the table of the head descriptor is not in use until the descriptor is returned */
+        struct vring_desc *table = vq->indirect + head * vq->indirect_max;
+        for (int i = 0; i < m->count; i++) {
+            struct vring_desc *src = buffer_ref(m->descv, i * sizeof(*src));
+            table[i].busaddr = src->busaddr;
+            table[i].len = src->len;
+            table[i].flags = src->flags;
+            if (i < m->count - 1) {
+                table[i].flags |= VRING_DESC_F_NEXT;
+                table[i].next = i + 1;
+            }
+        }
+        volatile struct vring_desc *d = vq->desc + head;
+        d->busaddr = physical_from_virtual(table);
+        d->len = m->count * sizeof(struct vring_desc);
+        d->flags = VRING_DESC_F_INDIRECT;
+        vq->desc_idx = d->next;
+        virtqueue_debug_verbose("      - indirect table %p, %d descriptors\n", table, m->count);
+    } else {
+        for (int i = 0; i < m->count; i++) {
+            struct vring_desc *src = buffer_ref(m->descv, i * sizeof(*src));
+            volatile struct vring_desc *d = vq->desc + vq->desc_idx;
+            d->busaddr = src->busaddr;
+            d->len = src->len;
+            d->flags = src->flags;
+            if (i < m->count - 1)
+                d->flags |= VRING_DESC_F_NEXT;
+            vq->desc_idx = d->next;
+
+            virtqueue_debug_verbose("      - desc_idx %d, vring_desc %p, busaddr 0x%lx, "
+                                    "len 0x%x, flags 0x%x, next %d\n", vq->desc_idx, d,
+                                    d->busaddr, d->len, d->flags, d->next);
+        }
+    }
+
+    u16 avail_idx = vq->avail->idx & (vq->entries - 1);
+    vq->avail->ring[avail_idx] = head;
+    virtqueue_debug_verbose("      avail->ring[%d] = %d\n", avail_idx, head);
+
+    // ensure desc and avail ring updates above are visible before updating avail->idx
+    write_barrier();
+    vq->avail->idx++;
+}
+
+static u16 vq_packed_avail_flags(virtqueue vq)
+{
+    return vq->avail_wrap ? VRING_PACKED_DESC_F_AVAIL : VRING_PACKED_DESC_F_USED;
+}
+
+static void vq_packed_advance(virtqueue vq)
+{
+    if (++vq->avail_pos == vq->entries) {
+        vq->avail_pos = 0;
+        vq->avail_wrap = !vq->avail_wrap;
+    }
+}
+
+static void vq_packed_add(virtqueue vq, vqmsg m, boolean indirect, u16 ring_count)
+{
+    u16 id = vq->desc_idx;
+    vq->desc_idx = vq->packed_ids[id].next;
+    vq->packed_ids[id].count = ring_count;
+    vq->msgs[id] = m;
+
+    /* The head descriptor is made available last, so that the device cannot see a partially
+     * written chain. */
+    u16 head = vq->avail_pos;
+    u16 head_flags = 0;
+    if (indirect) {
+        /* descriptors in an indirect table are implicitly chained */
+        struct vring_packed_desc *table = (void *)(vq->indirect + id * vq->indirect_max);
+        for (int i = 0; i < m->count; i++) {
+            struct vring_desc *src = buffer_ref(m->descv, i * sizeof(*src));
+            table[i].busaddr = src->busaddr;
+            table[i].len = src->len;
+            table[i].id = 0;
+            table[i].flags = src->flags;
+        }
+        volatile struct vring_packed_desc *d = vq->packed_desc + head;
+        d->busaddr = physical_from_virtual(table);
+        d->len = m->count * sizeof(struct vring_packed_desc);
+        d->id = id;
+        head_flags = VRING_DESC_F_INDIRECT | vq_packed_avail_flags(vq);
+        vq_packed_advance(vq);
+        virtqueue_debug_verbose("      - indirect table %p, %d descriptors\n", table, m->count);
+    } else {
+        for (int i = 0; i < m->count; i++) {
+            struct vring_desc *src = buffer_ref(m->descv, i * sizeof(*src));
+            volatile struct vring_packed_desc *d = vq->packed_desc + vq->avail_pos;
+            d->busaddr = src->busaddr;
+            d->len = src->len;
+            d->id = id;
+            u16 flags = src->flags | vq_packed_avail_flags(vq);
+            if (i < m->count - 1)
+                flags |= VRING_DESC_F_NEXT;
+            if (i == 0)
+                head_flags = flags;
+            else
+                d->flags = flags;
+            virtqueue_debug_verbose("      - pos %d, id %d, busaddr 0x%lx, len 0x%x, flags 0x%x\n",
+                                    vq->avail_pos, id, d->busaddr, d->len, flags);
+            vq_packed_advance(vq);
+        }
+    }
+
+    write_barrier();
+    vq->packed_desc[head].flags = head_flags;
+}
+
 /* called with lock held */
 static void virtqueue_fill(virtqueue vq)
 {
-    virtqueue_debug("%s: ENTRY: vq %s: entries %d, desc_idx %d, avail->idx %d, avail->flags 0x%x\n",
-        __func__, vq->name, vq->entries, vq->desc_idx, vq->avail->idx, vq->avail->flags);
+    virtqueue_debug("%s: ENTRY: vq %s: entries %d, desc_idx %d, free_cnt %ld\n",
+        __func__, vq->name, vq->entries, vq->desc_idx, vq->free_cnt);
 
     list n = list_get_next(&vq->msg_queue);
     u16 added = 0;
@@ -357,7 +755,9 @@ static void virtqueue_fill(virtqueue vq)
     while (n && n != &vq->msg_queue) {
         vqmsg m = struct_from_list(n, vqmsg, l);
         virtqueue_debug_verbose("   vqmsg %p, count %d\n", m, m->count);
-        if (vq->free_cnt < m->count) {
+        boolean indirect = vq->indirect && (m->count > 1) && (m->count <= vq->indirect_max);
+        u16 ring_count = indirect ? 1 : m->count;
+        if (vq->free_cnt < ring_count) {
             virtqueue_debug_verbose("      vq %s: queue full (vq->free_cnt %ld)\n",
                 vq->name, vq->free_cnt);
             break;
@@ -365,33 +765,12 @@ static void virtqueue_fill(virtqueue vq)
         assert(vq->free_cnt <= vq->entries);
 
         assert(m->completion);
-        u16 head = vq->desc_idx;
-        vq->msgs[head] = m;
-
-        for (int i = 0; i < m->count; i++) {
-            struct vring_desc *src = buffer_ref(m->descv, i * sizeof(*src));
-            volatile struct vring_desc *d = vq->desc + vq->desc_idx;
-            d->busaddr = src->busaddr;
-            d->len = src->len;
-            d->flags = src->flags;
-            if (i < m->count - 1)
-                d->flags |= VRING_DESC_F_NEXT;
-            vq->desc_idx = d->next;
-
-            virtqueue_debug_verbose("      - desc_idx %d, vring_desc %p, busaddr 0x%lx, "
-                                    "len 0x%x, flags 0x%x, next %d\n", vq->desc_idx, d, d->busaddr,
-                                    d->len, d->flags, d->next);
-        }
-
-        u16 avail_idx = vq->avail->idx & (vq->entries - 1);
-        vq->avail->ring[avail_idx] = head;
-        virtqueue_debug_verbose("      avail->ring[%d] = %d\n", avail_idx, head);
-        fetch_and_add(&vq->free_cnt, -m->count);
-        added++;
-
-        // ensure desc and avail ring updates above are visible before updating avail->idx
-        write_barrier();
-        vq->avail->idx++;
+        if (vq->packed)
+            vq_packed_add(vq, m, indirect, ring_count);
+        else
+            vq_split_add(vq, m, indirect);
+        fetch_and_add(&vq->free_cnt, -ring_count);
+        added += vq->packed ? ring_count : 1;
 
         list nn = list_get_next(n);
         list_delete(n);
@@ -147,9 +147,10 @@ static inline pageflags pageflags_from_pte(pte pte)
     return (pageflags){.w = flags_from_pte(pte)};
 }
 
+/* flags may come from a block entry; bit 7 is PAT in a page entry */
 static inline u64 page_pte(u64 phys, u64 flags)
 {
-    return phys | (flags & ~PAGE_NO_PS) | PAGE_PRESENT;
+    return phys | (flags & ~(PAGE_NO_PS | PAGE_PS)) | PAGE_PRESENT;
 }
 
 static inline u64 block_pte(u64 phys, u64 flags)
@@ -0,0 +1,138 @@
+#include <runtime.h>
+#include <stdlib.h>
+
+#define TEST_ENTRIES    4096
+
+#define test_assert(expr) do { \
+    if (!(expr)) { \
+        msg_err("%s -- failed at %s:%d\n", #expr, __FILE__, __LINE__); \
+        return false; \
+    } \
+} while (0)
+
+static void *entry_from_index(u64 index)
+{
+    return pointer_from_u64(index * 2 + 1);
+}
+
+closure_function(2, 2, boolean, check_order,
+                 u64 *, last, u64 *, count,
+                 u64, index, void *, p)
+{
+    if ((*bound(count) > 0) && (index <= *bound(last))) {
+        msg_err("index 0x%lx visited after 0x%lx\n", index, *bound(last));
+        return false;
+    }
+    if (p != entry_from_index(index)) {
+        msg_err("index 0x%lx has entry %p\n", index, p);
+        return false;
+    }
+    *bound(last) = index;
+    (*bound(count))++;
+    return true;
+}
+
+closure_function(1, 2, boolean, count_entries,
+                 u64 *, count,
+                 u64, index, void *, p)
+{
+    (*bound(count))++;
+    return true;
+}
+
+static boolean basic_test(heap h)
+{
+    struct radix_tree t;
+    init_radix_tree(&t, h);
+    test_assert(radix_lookup(&t, 0) == INVALID_ADDRESS);
+    u64 index = 0;
+    test_assert(radix_lookup_next(&t, &index) == INVALID_ADDRESS);
+    test_assert(radix_remove(&t, 0) == INVALID_ADDRESS);
+
+    u64 keys[] = {0, 1, 63, 64, 4095, 4096, 1ull << 32, (1ull << 61) - 1, -2ull};
+    for (int i = 0; i < _countof(keys); i++) {
+        test_assert(radix_insert(&t, keys[i], entry_from_index(keys[i])));
+        test_assert(!radix_insert(&t, keys[i], entry_from_index(keys[i])));
+    }
+    test_assert(radix_get_count(&t) == _countof(keys));
+    for (int i = 0; i < _countof(keys); i++) {
+        test_assert(radix_lookup(&t, keys[i]) == entry_from_index(keys[i]));
+        if (keys[i] > 0 && (i == 0 || keys[i - 1] != keys[i] - 1))
+            test_assert(radix_lookup(&t, keys[i] - 1) == INVALID_ADDRESS);
+        index = (i > 0) ? keys[i - 1] + 1 : 0;
+        test_assert(radix_lookup_next(&t, &index) == entry_from_index(keys[i]));
+        test_assert(index == keys[i]);
+    }
+    u64 last = 0, count = 0;
+    test_assert(radix_traverse(&t, 0, stack_closure(check_order, &last, &count)));
+    test_assert(count == _countof(keys));
+    count = 0;
+    test_assert(radix_traverse(&t, 65, stack_closure(count_entries, &count)));
+    test_assert(count == _countof(keys) - 4);
+
+    for (int i = 0; i < _countof(keys); i++) {
+        test_assert(radix_remove(&t, keys[i]) == entry_from_index(keys[i]));
+        test_assert(radix_lookup(&t, keys[i]) == INVALID_ADDRESS);
+    }
+    test_assert(radix_get_count(&t) == 0);
+    index = 0;
+    test_assert(radix_lookup_next(&t, &index) == INVALID_ADDRESS);
+    destruct_radix_tree(&t, 0);
+    return true;
+}
+
+static boolean random_test(heap h)
+{
+    struct radix_tree t;
+    init_radix_tree(&t, h);
+    u64 *keys = malloc(TEST_ENTRIES * sizeof(u64));
+    test_assert(keys);
+    int n = 0;
+    for (int i = 0; i < TEST_ENTRIES; i++) {
+        /* mix of dense and sparse indices */
+        u64 k = (i & 1) ? random_u64() & MASK(24) : random_u64() & MASK(12);
+        if (radix_insert(&t, k, entry_from_index(k)))
+            keys[n++] = k;
+        else
+            test_assert(radix_lookup(&t, k) == entry_from_index(k));
+    }
+    test_assert(radix_get_count(&t) == n);
+    u64 last = 0, count = 0;
+    test_assert(radix_traverse(&t, 0, stack_closure(check_order, &last, &count)));
+    test_assert(count == n);
+
+    /* remove every other key, then check the remaining ones */
+    for (int i = 0; i < n; i += 2)
+        test_assert(radix_remove(&t, keys[i]) == entry_from_index(keys[i]));
+    for (int i = 0; i < n; i++)
+        test_assert(radix_lookup(&t, keys[i]) ==
+                    ((i & 1) ? entry_from_index(keys[i]) : INVALID_ADDRESS));
+    test_assert(radix_get_count(&t) == n / 2);
+    last = count = 0;
+    test_assert(radix_traverse(&t, 0, stack_closure(check_order, &last, &count)));
+    test_assert(count == n / 2);
+
+    count = 0;
+    destruct_radix_tree(&t, stack_closure(count_entries, &count));
+    test_assert(count == n / 2);
+    test_assert(radix_get_count(&t) == 0);
+    free(keys);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    heap h = init_process_runtime();
+
+    if (!basic_test(h))
+        goto fail;
+
+    if (!random_test(h))
+        goto fail;
+
+    msg_debug("test passed\n");
+    exit(EXIT_SUCCESS);
+  fail:
+    msg_err("test failed\n");
+    exit(EXIT_FAILURE);
+}
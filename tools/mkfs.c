@@ -353,8 +353,8 @@ closure_function(0, 2, void, mkfs_write_handler,
     }
 }
 
-closure_function(4, 2, void, fsc,
-                 heap, h, descriptor, out, tuple, root, const char *, target_root,
+closure_function(5, 2, void, fsc,
+                 heap, h, descriptor, out, tuple, root, const char *, target_root, filesystem *, created,
                  filesystem, fs, status, s)
 {
     tuple root = bound(root);
@@ -376,7 +376,10 @@ closure_function(4, 2, void, fsc,
     deallocate_buffer(b);
     rprintf("\n");
 
+    /* the first tuple in the log becomes the root of the filesystem when mounted */
     tfs tfs = (struct tfs *)fs;
+    deallocate_value(fs->root);
+    fs->root = md;
     filesystem_write_tuple(tfs, md);
     vector i;
     buffer off = 0;
@@ -393,15 +396,28 @@ closure_function(4, 2, void, fsc,
                 if (!off)
                     off = value_from_u64(0);
                 /* make an empty file */
-                filesystem_write_eav(tfs, f, sym(extents), allocate_tuple(), false);
+                tuple extents = allocate_tuple();
+                filesystem_write_eav(tfs, f, sym(extents), extents, false);
+                set(f, sym(extents), extents);
                 filesystem_write_eav(tfs, f, sym(filelength), off, false);
+                set(f, sym(filelength), off);
             }
         }
     }
     filesystem_flush(fs, ignore_status);
+    *bound(created) = fs;
     closure_finish();
 }
 
+/* Ship the image with a checkpoint of the metadata tree, which is faster to mount than the log
+   entries written while populating it. This is done after create_filesystem() has returned, since
+   the checkpoint replaces the log that create_filesystem() is still completing. */
+static void checkpoint_fs(filesystem fs)
+{
+    if (fs)
+        filesystem_log_checkpoint(fs, ignore_status);
+}
+
 static void write_blob_padded(descriptor out, u8 *blob, size_t len, boolean with_trailer)
 {
     assert(write(out, blob, len) == len);
@@ -623,6 +639,7 @@ int main(int argc, char **argv)
     long long coredumplimit = 0;
     boolean empty_fs = false;
     const char *uefi_loader = NULL;
+    filesystem fs = 0;
     heap h = init_process_runtime();
     cmdline_tuples = allocate_vector(h, 4);
     assert(cmdline_tuples != INVALID_ADDRESS);
@@ -788,8 +805,10 @@ int main(int argc, char **argv)
             }
         }
         if (boot) {
+            filesystem bootfs = 0;
             create_filesystem(h, SECTOR_SIZE, BOOTFS_SIZE, closure(h, bwrite, out, offset), false,
-                              "", closure(h, fsc, h, out, boot, target_root));
+                              "", closure(h, fsc, h, out, boot, target_root, &bootfs));
+            checkpoint_fs(bootfs);
             offset += BOOTFS_SIZE;
 
             /* Remove tuple from root, so it doesn't end up in the root FS. */
@@ -805,7 +824,8 @@ int main(int argc, char **argv)
                       closure(h, bwrite, out, offset),
                       false,
                       label,
-                      closure(h, fsc, h, out, root, target_root));
+                      closure(h, fsc, h, out, root, target_root, &fs));
+    checkpoint_fs(fs);
 
     off_t current_size = lseek(out, 0, SEEK_END);
     if (current_size < 0) {